@@ -21,6 +21,14 @@ elif [[ $1 == 4 ]]
 then
     echo -e "${GREEN}malloc_4.cpp${NC}"
     g++ -g -Wall -c malloc_4.cpp
+elif [[ $1 == "preload" ]]
+then
+    echo -e "${GREEN}libmalloc_4.so${NC}"
+    g++ -O2 -Wall -pthread -fPIC -ftls-model=initial-exec -DMALLOC_4_NO_SIZE_LIMIT -shared -o libmalloc_4.so preload.cpp malloc_4.cpp
+elif [[ $1 == "dispatch" ]]
+then
+    echo -e "${GREEN}libmalloc_dispatch.so${NC}"
+    g++ -O2 -Wall -pthread -fPIC -ftls-model=initial-exec -Wl,-Bsymbolic-functions -DMALLOC_DISPATCH -shared -o libmalloc_dispatch.so malloc_dispatch.cpp malloc_2.cpp malloc_3.cpp malloc_4.cpp
 elif [[ $1 == "all" ]]
 then
     echo -e "${GREEN}Compile all four files${NC}"
@@ -37,4 +45,6 @@ else
     echo -e "\tARG = 3 - compile malloc_3.cpp"
     echo -e "\tARG = 4 - compile malloc_4.cpp"
     echo -e "\tARG = all - compile malloc_N.cpp for N = 1, 2, 3, 4"
+    echo -e "\tARG = preload - build malloc_4.cpp as libmalloc_4.so (for LD_PRELOAD)"
+    echo -e "\tARG = dispatch - build malloc_2/3/4.cpp as libmalloc_dispatch.so (engine picked at startup)"
 fi
\ No newline at end of file
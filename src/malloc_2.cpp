@@ -15,6 +15,13 @@
 
 
 
+// malloc_dispatch.cpp builds the engines side by side, each in its own namespace
+#ifdef MALLOC_DISPATCH
+namespace malloc_2 {
+#endif
+
+
+
 
 // constants
 #define MAX_MALLOC_2_SIZE 100000000
@@ -116,6 +123,12 @@ typedef struct malloc_metadata_t MallocMetadata;
 // global head of the alloction list
 static MallocMetadata* metadata_head = nullptr;
 
+// global tail of the alloction list
+static MallocMetadata* metadata_tail = nullptr;
+
+// global number of free'd blocks in the alloction list
+static size_t free_blocks_count = 0;
+
 
 
 /**
@@ -133,6 +146,11 @@ static MallocMetadata* metadata_head = nullptr;
  */
 static MallocMetadata* get_free_metadata_block(size_t size)
 {
+    // nothing was free'd, no need to walk the list
+    if (free_blocks_count == 0)
+    {
+        return nullptr;
+    }
     METADATA_FOR_EACH(block, metadata_head)
     {
         if (block->is_free && block->size >= size)
@@ -145,27 +163,17 @@ static MallocMetadata* get_free_metadata_block(size_t size)
 
 /**
  * @function:   static MallocMetadata* get_last_metadata_block()
- * @brief:      search for the last block in alloc list.
+ * @brief:      get the last block in alloc list (O(1), the tail is tracked).
  * 
  * @returns:
  *     - Success: a pointer to the last block.
  *
  *     - Failure:
- *          Never Fail (motivation loll)
+ *          If the list is empty, returns nullptr.
  */
-
 static MallocMetadata* get_last_metadata_block()
 {
-    if (metadata_head  == nullptr) return nullptr;
-    METADATA_FOR_EACH(block, metadata_head)
-    {
-        if (block->next == nullptr)
-        {
-            return block;
-        }
-            
-    }
-    return nullptr;
+    return metadata_tail;
 }
 
 /**
@@ -203,6 +211,7 @@ void* smalloc(size_t size)
         
         INIT_METADATA(ret, size, false, nullptr, nullptr)
         metadata_head = (MallocMetadata*)ret;
+        metadata_tail = (MallocMetadata*)ret;
         return GET_PTR_FROM_METADATA(ret);
     }
     
@@ -211,6 +220,7 @@ void* smalloc(size_t size)
     if (freed != nullptr)
     {
         freed->is_free = false;
+        free_blocks_count--;
         return GET_PTR_FROM_METADATA(freed);
     }
 
@@ -223,6 +233,7 @@ void* smalloc(size_t size)
     MallocMetadata* last = get_last_metadata_block();
     last->next = (MallocMetadata*)ret;
     INIT_METADATA(ret, size, false, nullptr, last);
+    metadata_tail = (MallocMetadata*)ret;
     return GET_PTR_FROM_METADATA(ret);
 }
 
@@ -276,6 +287,10 @@ void sfree(void* p)
         return;
     }
     MallocMetadata* to_free =  GET_METADATA_FROM_PTR(p);
+    if (!to_free->is_free)
+    {
+        free_blocks_count++;
+    }
     to_free->is_free = true;
     return;
 }
@@ -438,4 +453,10 @@ size_t _num_meta_data_bytes()
 size_t _size_meta_data()
 {
     return sizeof(malloc_metadata_t);
-}
\ No newline at end of file
+}
+
+
+
+#ifdef MALLOC_DISPATCH
+} /* namespace malloc_2 */
+#endif
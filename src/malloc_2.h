@@ -3,6 +3,10 @@
 #ifndef MALLOC2
 #define MALLOC2
 
+#ifdef MALLOC_DISPATCH
+namespace malloc_2 {
+#endif
+
 void* smalloc(size_t size);
 void* scalloc(size_t num, size_t size);
 void sfree(void* p);
@@ -18,4 +22,8 @@ size_t _num_meta_data_bytes();
 size_t _size_meta_data();
 
 
+#ifdef MALLOC_DISPATCH
+} /* namespace malloc_2 */
+#endif
+
 #endif /* MALLOC2 */
\ No newline at end of file
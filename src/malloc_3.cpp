@@ -15,6 +15,13 @@
 #include <sys/mman.h>
 
 
+
+// malloc_dispatch.cpp builds the engines side by side, each in its own namespace
+#ifdef MALLOC_DISPATCH
+namespace malloc_3 {
+#endif
+
+
 size_t _num_free_blocks();
 size_t _num_free_bytes();
 size_t _num_allocated_blocks();
@@ -152,11 +159,13 @@ typedef struct malloc_metadata_t MallocMetadata;
         ((entire_block_size) >= (needed_size) + sizeof(malloc_metadata_t) + 128)
 
 
-// global head of the alloction list from sbrk
+// global head and tail of the alloction list from sbrk (the tail is the wilderness block)
 static MallocMetadata* metadata_head = nullptr;
+static MallocMetadata* metadata_tail = nullptr;
 
-// global head of the alloction list from mmap
+// global head and tail of the alloction list from mmap
 static MallocMetadata* mmap_metadata_head = nullptr;
+static MallocMetadata* mmap_metadata_tail = nullptr;
 
 // global bin of free blocks
 static MallocMetadata* free_block_bin[BIN_SIZE] = {};
@@ -164,53 +173,52 @@ static MallocMetadata* free_block_bin[BIN_SIZE] = {};
 
 
 /**
- * @function:   static MallocMetadata* get_last_metadata_block()
- * @brief:      search for the last block in alloc list.
+ * @function:   void link_next_block(MallocMetadata* block, MallocMetadata* next)
+ * @brief:      make next follow block in the sbrk alloc list (block becomes the tail if next is nullptr)
  * 
- * @returns:
- *     - Success: a pointer to the last block.
- *
- *     - Failure:
- *          Never Fail (motivation loll)
+ * @arguments:
+ *     - MallocMetadata* block: block to link after
+ *     - MallocMetadata* next:  block to follow it (may be nullptr)
  */
-static MallocMetadata* get_last_metadata_block(MallocMetadata* list)
+static void link_next_block(MallocMetadata* block, MallocMetadata* next)
 {
-    if (!list)
+    block->next = next;
+    if (next)
     {
-        return nullptr;
+        next->prev = block;
     }
-    METADATA_FOR_EACH(block, list)
+    else
     {
-        if (block->next == nullptr)
-            return block;
+        metadata_tail = block;
     }
-    // assert(true);
-    return list;
 }
 
 
 
 /**
- * @function:   void remove_from_list(MallocMetadata* to_del, MallocMetadata** list)
+ * @function:   void remove_from_list(MallocMetadata* to_del, MallocMetadata** head, MallocMetadata** tail)
  * @brief:      delete metadata from the list
  * 
  * @arguments:
  *     - MallocMetadata* to_del: block to delete
- *     - MallocMetadata** list: pointer to list to delete from
+ *     - MallocMetadata** head: pointer to head of the list to delete from
+ *     - MallocMetadata** tail: pointer to tail of the list to delete from
  */
-static void remove_from_list(MallocMetadata* to_del, MallocMetadata** list)
+static void remove_from_list(MallocMetadata* to_del, MallocMetadata** head, MallocMetadata** tail)
 {
     if (!to_del->next && !to_del->prev)
     {
-        *list = nullptr;
+        *head = nullptr;
+        *tail = nullptr;
     }
     else if (!to_del->prev)
     {
-        *list = to_del->next;
+        *head = to_del->next;
         to_del->next->prev = nullptr;
     }
     else if (!to_del->next)
     {
+        *tail = to_del->prev;
         to_del->prev->next = nullptr;
     }
     else
@@ -257,29 +265,29 @@ static void remove_from_bin(MallocMetadata* to_del)
 
 
 /**
- * @function:   insert_to_metadata_list(MallocMetadata* new_block, MallocMetadata** list)
- * @brief:      insert metadata into the list
+ * @function:   insert_to_metadata_list(MallocMetadata* new_block, MallocMetadata** head, MallocMetadata** tail)
+ * @brief:      append metadata to the end of the list (O(1), using the tail)
  * 
  * @arguments:
  *     - MallocMetadata* new_block: block to insert
- *     - MallocMetadata** list: pointer to list to append to
+ *     - MallocMetadata** head: pointer to head of the list to append to
+ *     - MallocMetadata** tail: pointer to tail of the list to append to
  */
-static void insert_to_metadata_list(MallocMetadata* new_block, MallocMetadata** list)
+static void insert_to_metadata_list(MallocMetadata* new_block, MallocMetadata** head, MallocMetadata** tail)
 {
+    new_block->next = nullptr;
+    new_block->prev = *tail;
+
     // list is empty
-    if ((*list) == nullptr)
+    if ((*tail) == nullptr)
     {
-        new_block->prev = nullptr;
-        new_block->next = nullptr;
-        *list = new_block;
+        *head = new_block;
     }
     else
     {
-        MallocMetadata* after = get_last_metadata_block(*list);
-        after->next = new_block;
-        new_block->prev = after;
-        new_block->next = nullptr;
+        (*tail)->next = new_block;
     }
+    *tail = new_block;
 }
 
 
@@ -354,10 +362,7 @@ static void cut_block(MallocMetadata* block, size_t size, bool remove_bin = true
     MallocMetadata* new_block = (MallocMetadata*)((intptr_t)block + size + sizeof(malloc_metadata_t));
     INIT_METADATA(new_block, new_block_size - sizeof(malloc_metadata_t), true, block->next, block, nullptr, nullptr);
     insert_block_to_bin(new_block);
-    if (block->next)
-    {
-        block->next->prev = new_block;
-    }
+    link_next_block(new_block, new_block->next);
     block->next = new_block;
     block->is_free  = false;
     block->size     = size;
@@ -446,7 +451,7 @@ void* smalloc(size_t size)
         }
         MallocMetadata* mt = (MallocMetadata*)ret;
         INIT_METADATA(mt, size, false, nullptr, nullptr, nullptr, nullptr);
-        insert_to_metadata_list(mt, &mmap_metadata_head);
+        insert_to_metadata_list(mt, &mmap_metadata_head, &mmap_metadata_tail);
         return GET_PTR_FROM_METADATA(ret);
     }
     // try to use free'd block
@@ -459,7 +464,7 @@ void* smalloc(size_t size)
 
     // try to expand the last brk
 
-    MallocMetadata* last = get_last_metadata_block(metadata_head);
+    MallocMetadata* last = metadata_tail;
     if (last && last->is_free)
     {
         // assert(size > last->size);
@@ -494,7 +499,7 @@ void* smalloc(size_t size)
     INIT_METADATA((MallocMetadata*)ret, size, false, nullptr, nullptr, nullptr, nullptr);
     MallocMetadata* mt = (MallocMetadata*)ret;
 
-    insert_to_metadata_list(mt, &metadata_head);
+    insert_to_metadata_list(mt, &metadata_head, &metadata_tail);
     return GET_PTR_FROM_METADATA(mt);
 }
 
@@ -554,7 +559,7 @@ void sfree(void* p)
     // mmap block
     if (to_free->size >= MIN_KB_BLOCK)
     {
-        remove_from_list(to_free, &mmap_metadata_head);
+        remove_from_list(to_free, &mmap_metadata_head, &mmap_metadata_tail);
         munmap((void *)to_free, to_free->size + sizeof(malloc_metadata_t));
     }
 
@@ -568,11 +573,7 @@ void sfree(void* p)
         {
 
             MallocMetadata* temp = to_free->next;
-            to_free->next = temp->next;
-            if (temp->next)
-            {
-                temp->next->prev = to_free;
-            }
+            link_next_block(to_free, temp->next);
             
             remove_from_bin(temp);
             remove_from_bin(to_free);
@@ -584,11 +585,7 @@ void sfree(void* p)
         if (to_free->prev && to_free->prev->is_free)
         {
             MallocMetadata* temp = to_free->prev;
-            temp->next = to_free->next;
-            if (to_free->next)
-            {
-                to_free->next->prev = temp;
-            }
+            link_next_block(temp, to_free->next);
             remove_from_bin(temp);
             remove_from_bin(to_free);
             temp->size += (to_free->size + sizeof(malloc_metadata_t));
@@ -660,11 +657,7 @@ void* srealloc(void* oldp, size_t size)
                 MallocMetadata* base_next = old_ptr->next->next;
                 remove_from_bin(base);
                 remove_from_bin(base_next);
-                base->next = base_next->next;
-                if (base_next->next)
-                {
-                    base_next->next->prev = base;
-                }
+                link_next_block(base, base_next->next);
                 base->size += sizeof(malloc_metadata_t) + base_next->size;
                 insert_block_to_bin(base);
             }
@@ -679,11 +672,7 @@ void* srealloc(void* oldp, size_t size)
         MallocMetadata* ret = old_ptr->prev;
         remove_from_bin(ret);
         ret->is_free = false;
-        ret->next = old_ptr->next;
-        if (old_ptr->next)
-        {
-            old_ptr->next->prev = ret;
-        }
+        link_next_block(ret, old_ptr->next);
         ret->size += old_ptr->size + sizeof(malloc_metadata_t);
         memmove(GET_PTR_FROM_METADATA(ret), oldp, MMIN(size, old_ptr->size));
         if (IS_LARGE_ENOUGH(ret->size, size))
@@ -696,11 +685,7 @@ void* srealloc(void* oldp, size_t size)
                 MallocMetadata* base_next = ret->next->next;
                 remove_from_bin(base);
                 remove_from_bin(base_next);
-                base->next = base_next->next;
-                if (base_next->next)
-                {
-                    base_next->next->prev = base;
-                }
+                link_next_block(base, base_next->next);
                 base->size += sizeof(malloc_metadata_t) + base_next->size;
                 insert_block_to_bin(base);
             }
@@ -716,11 +701,7 @@ void* srealloc(void* oldp, size_t size)
         MallocMetadata* to_merge = old_ptr->next;
         remove_from_bin(to_merge);
         old_ptr->is_free = false;
-        old_ptr->next = to_merge->next;
-        if (to_merge->next)
-        {
-            to_merge->next->prev = old_ptr;
-        }
+        link_next_block(old_ptr, to_merge->next);
         old_ptr->size += to_merge->size + sizeof(malloc_metadata_t);
         if (IS_LARGE_ENOUGH(old_ptr->size, size))
         {
@@ -731,11 +712,7 @@ void* srealloc(void* oldp, size_t size)
                 MallocMetadata* base_next = old_ptr->next->next;
                 remove_from_bin(base);
                 remove_from_bin(base_next);
-                base->next = base_next->next;
-                if (base_next->next)
-                {
-                    base_next->next->prev = base;
-                }
+                link_next_block(base, base_next->next);
                 base->size += sizeof(malloc_metadata_t) + base_next->size;
                 insert_block_to_bin(base);
             }
@@ -753,11 +730,7 @@ void* srealloc(void* oldp, size_t size)
         remove_from_bin(prev);
         remove_from_bin(next);
         prev->is_free = false;
-        prev->next = next->next;
-        if (next->next)
-        {
-            next->next->prev = prev;
-        }
+        link_next_block(prev, next->next);
         prev->size += old_ptr->size + next->size + 2*sizeof(malloc_metadata_t);
         memmove(GET_PTR_FROM_METADATA(prev), oldp, MMIN(size, old_ptr->size));
         if (IS_LARGE_ENOUGH(prev->size, size))
@@ -769,11 +742,7 @@ void* srealloc(void* oldp, size_t size)
                 MallocMetadata* base_next = prev->next->next;
                 remove_from_bin(base);
                 remove_from_bin(base_next);
-                base->next = base_next->next;
-                if (base_next->next)
-                {
-                    base_next->next->prev = base;
-                }
+                link_next_block(base, base_next->next);
                 base->size += sizeof(malloc_metadata_t) + base_next->size;
                 insert_block_to_bin(base);
             }
@@ -790,11 +759,7 @@ void* srealloc(void* oldp, size_t size)
             MallocMetadata* ret = old_ptr->prev;
             remove_from_bin(ret);
             ret->is_free = false;
-            ret->next = old_ptr->next;
-            if (old_ptr->next)
-            {
-                old_ptr->next->prev = ret;
-            }
+            link_next_block(ret, old_ptr->next);
             ret->size += old_ptr->size + sizeof(malloc_metadata_t);
             void* mem = sbrk(size - ret->size);
             if ((intptr_t)mem == SBRK_FAIL)
@@ -948,4 +913,10 @@ size_t _num_meta_data_bytes()
 size_t _size_meta_data()
 {
     return sizeof(malloc_metadata_t);
-}
\ No newline at end of file
+}
+
+
+
+#ifdef MALLOC_DISPATCH
+} /* namespace malloc_3 */
+#endif
@@ -3,6 +3,10 @@
 #ifndef MALLOC3
 #define MALLOC3
 
+#ifdef MALLOC_DISPATCH
+namespace malloc_3 {
+#endif
+
 void *smalloc(size_t size);
 void *scalloc(size_t num, size_t size);
 void sfree(void *p);
@@ -16,4 +20,8 @@ size_t _num_allocated_bytes();
 size_t _num_meta_data_bytes();
 size_t _size_meta_data();
 
+#ifdef MALLOC_DISPATCH
+} /* namespace malloc_3 */
+#endif
+
 #endif /* MALLOC3 */
\ No newline at end of file
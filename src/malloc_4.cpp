@@ -10,56 +10,545 @@
 
 // includes
 #include <unistd.h>
+#include <errno.h>
 #include <assert.h>
 #include <string.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <sys/mman.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+#if defined(__x86_64__) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#endif
+#include "malloc_4.h"
 
 
-size_t _num_free_blocks();
-size_t _num_free_bytes();
-size_t _num_allocated_blocks();
-size_t _num_allocated_bytes();
-size_t _num_meta_data_bytes();
-size_t _size_meta_data();
+
+// malloc_dispatch.cpp builds the engines side by side, each in its own namespace
+#ifdef MALLOC_DISPATCH
+namespace malloc_4 {
+#endif
 
 
 
 // constants
 //#define NDEBUG
 #define ADDRESS_SIZE (sizeof(void*))
-#define GET_SIZE_WITH_ALIGNMENT(address) ((address) + ((ADDRESS_SIZE - ((address) % ADDRESS_SIZE)) % ADDRESS_SIZE))
-#define MAX_MALLOC_4_SIZE 100000000
+// 16 bytes, alignof(max_align_t) on x86-64: libc's malloc guarantees it and the preloaded
+// library (see preload.cpp) stands in for libc's malloc, long double and SSE objects need it
+#define MALLOC_ALIGNMENT 16
+#define GET_SIZE_WITH_ALIGNMENT(address) ((address) + ((MALLOC_ALIGNMENT - ((address) % MALLOC_ALIGNMENT)) % MALLOC_ALIGNMENT))
+#define GET_SIZE_WITH_PAGES(size) (((size) + MALLOC_PAGE_SIZE - 1) & ~(size_t)(MALLOC_PAGE_SIZE - 1))
 #define SBRK_FAIL -1
-#define BIN_SIZE 128
 #define KB 1024
 #define MIN_KB_BLOCK 128 * KB
+#define SMALL_BIN_SPACING MALLOC_ALIGNMENT
+#define SMALL_BIN_COUNT (KB / SMALL_BIN_SPACING)
+#define MEDIUM_BIN_MIN_SHIFT 10
+#define MEDIUM_BIN_MAX_SHIFT 17
+#define MEDIUM_BIN_SUB_SHIFT 2
+#define MEDIUM_BIN_SUB_CLASSES (1 << MEDIUM_BIN_SUB_SHIFT)
+#define MEDIUM_BIN_COUNT ((MEDIUM_BIN_MAX_SHIFT - MEDIUM_BIN_MIN_SHIFT) * MEDIUM_BIN_SUB_CLASSES + 1)
+#define BIN_SIZE (SMALL_BIN_COUNT + MEDIUM_BIN_COUNT)
+#define BIN_MAP_WORD_BITS 64
+#define BIN_MAP_WORDS ((BIN_SIZE + BIN_MAP_WORD_BITS - 1) / BIN_MAP_WORD_BITS)
+#define MAX_HEAP_SEGMENTS 64
+#define BLOCK_IS_FREE ((size_t)1)
+#define BLOCK_MMAPPED ((size_t)2)
+#define BLOCK_PREV_IN_USE ((size_t)4)
+#define BLOCK_HUGETLB ((size_t)8)
+#define BLOCK_FLAGS (BLOCK_IS_FREE | BLOCK_MMAPPED | BLOCK_PREV_IN_USE | BLOCK_HUGETLB)
+#define MIN_BLOCK_SIZE (sizeof(free_list_node_t))
+#define MALLOC_PAGE_SIZE 4096
+#define HUGE_PAGE_SHIFT 21
+#define HUGE_PAGE_SIZE ((size_t)1 << HUGE_PAGE_SHIFT)
+#define GET_SIZE_WITH_HUGE_PAGES(size) (((size) + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1))
+#define PAGE_REGION_SIZE ((size_t)1 << 30)
+#define PAGE_REGION_PAGES (PAGE_REGION_SIZE / MALLOC_PAGE_SIZE)
+#define SLAB_SIZE MALLOC_PAGE_SIZE
+#define SLAB_MAX_SIZE KB
+#define SLAB_SPACING 16
+#define SLAB_ALIGNMENT 64
+#define SLAB_LINEAR_CLASSES 8
+#define SLAB_SUB_CLASSES 4
+#define SLAB_CLASS_COUNT (SLAB_LINEAR_CLASSES + 3 * SLAB_SUB_CLASSES)
+#define SLAB_NO_CLASS SLAB_CLASS_COUNT
+
+#define CHUNK_SIZE ((size_t)2 * KB * KB)
+#define CHUNK_PAGES (CHUNK_SIZE / MALLOC_PAGE_SIZE)
+#define RUN_REGION_SIZE ((size_t)1 << 30)
+#define FREE_SPAN_LISTS (CHUNK_PAGES + 1)
+#define FREE_SPAN_MAP_WORDS ((FREE_SPAN_LISTS + BIN_MAP_WORD_BITS - 1) / BIN_MAP_WORD_BITS)
+#define RUN_MIN_SLOTS 8
+#define RUN_CLASS_COUNT (MEDIUM_BIN_COUNT - 1)
+#define RUN_NO_CLASS RUN_CLASS_COUNT
+#define TCACHE_BATCH 32
+#define TCACHE_MIN_DEPTH TCACHE_BATCH
+#define TCACHE_DEPTH (2 * TCACHE_BATCH)
+#define TCACHE_MAX_DEPTH (4 * TCACHE_BATCH)
+#define ARENA_REGION_SIZE ((size_t)1 << 30)
+#define TRANSFER_CACHE_BATCHES 16
+#define SPOOL_CHUNK_SIZE (64 * KB)
+#define SPOOL_CHUNK_HEADER 16
+#define SPOOL_MIN_OBJECTS 8
+#define SPOOL_TAG_SHIFT 48
+
+// build with -DMALLOC_4_NO_SIZE_LIMIT to serve any size (not only up to 10^8 bytes), as a
+// drop-in malloc (see preload.cpp). The huge pages (see below) lift the limit too
+#if defined(MALLOC_4_NO_SIZE_LIMIT) || MALLOC_4_HUGE_PAGES > 0
+#define MAX_MALLOC_4_SIZE ((size_t)PTRDIFF_MAX / 2)
+#else
+#define MAX_MALLOC_4_SIZE 100000000
+#endif
+
+// build with -DMALLOC_4_HUGE_PAGES=1 to map the blocks of HUGE_PAGE_SIZE and up on huge page
+// boundaries advised with MADV_HUGEPAGE (transparent huge pages), or with =2 to map them with
+// MAP_HUGETLB from the reserved huge pages (vm.nr_hugepages) first, and advise them only when
+// none is left
+#if MALLOC_4_HUGE_PAGES > 0
+#define USE_HUGE_PAGES true
+#define USE_HUGETLB (MALLOC_4_HUGE_PAGES > 1)
+#else
+#define USE_HUGE_PAGES false
+#define USE_HUGETLB false
+#endif
+
+// build with -DMALLOC_4_THP_HEAP to back the heap with transparent huge pages: arena 0 takes a
+// region like the other arenas (sbrk only once it's full), and every region (the arenas', the
+// slabs' pages and the runs' chunks) is reserved on a huge page boundary and advised with
+// MADV_HUGEPAGE, so the kernel backs each 2MB of it with a huge page when it's first touched
+#ifdef MALLOC_4_THP_HEAP
+#define USE_THP_HEAP true
+#else
+#define USE_THP_HEAP false
+#endif
+
+// build with -DMALLOC_4_NO_SLABS / -DMALLOC_4_NO_RUNS to serve the small / medium sizes
+// from the heap, and with -DMALLOC_4_NO_TCACHE to take the slab locks on every small
+// malloc / free (for benchmarks)
+#ifdef MALLOC_4_NO_SLABS
+#define USE_SLABS false
+#else
+#define USE_SLABS true
+#endif
+
+#ifdef MALLOC_4_NO_RUNS
+#define USE_RUNS false
+#else
+#define USE_RUNS true
+#endif
+
+#if defined(MALLOC_4_NO_TCACHE) || defined(MALLOC_4_PERCPU_CACHE)
+#define USE_TCACHE false
+#else
+#define USE_TCACHE true
+#endif
+
+// build with -DMALLOC_4_NO_TRANSFER_CACHE to move the thread / CPU caches' batches from and to
+// the slabs directly
+#ifdef MALLOC_4_NO_TRANSFER_CACHE
+#define USE_TRANSFER_CACHE false
+#else
+#define USE_TRANSFER_CACHE true
+#endif
+
+// build with -DMALLOC_4_PERCPU_CACHE to cache the free small blocks per CPU instead of per
+// thread
+#ifdef MALLOC_4_PERCPU_CACHE
+#define USE_PERCPU_CACHE true
+#define CPU_CACHE_COUNT 256
+#else
+#define USE_PERCPU_CACHE false
+#define CPU_CACHE_COUNT 1
+#endif
+
+// the CPU caches' hot path is made of restartable sequences (rseq) on x86-64 with glibc's rseq
+// area (2.35 and up). Elsewhere, or if the threads' rseq or membarrier's rseq command isn't
+// there, it takes the CPU's lock instead
+#if defined(__x86_64__) && __has_include(<sys/rseq.h>)
+#define HAVE_RSEQ 1
+#else
+#define HAVE_RSEQ 0
+#endif
+
+// build with -DMALLOC_4_SCAVENGE_MS=<N> to scavenge the idle caches every N ms (0 to never
+// scavenge them)
+#ifdef MALLOC_4_SCAVENGE_MS
+#define SCAVENGE_MS MALLOC_4_SCAVENGE_MS
+#else
+#define SCAVENGE_MS 1000
+#endif
+#define USE_SCAVENGER (SCAVENGE_MS > 0)
+
+// build with -DMALLOC_4_NO_MREMAP to resize the mmap blocks by copying them to a new mapping
+// (for benchmarks)
+#ifdef MALLOC_4_NO_MREMAP
+#define USE_MREMAP false
+#else
+#define USE_MREMAP true
+#endif
+
+// a thread marks its cache busy with a plain store, which the scavenger's membarrier orders.
+// TSan can't see that order, so a TSan build orders the store itself
+#ifdef __SANITIZE_THREAD__
+#define TCACHE_BUSY_ORDER __ATOMIC_SEQ_CST
+#else
+#define TCACHE_BUSY_ORDER __ATOMIC_RELAXED
+#endif
+
+// build with -DMALLOC_4_ARENAS=<N> to split the heap into N arenas (the threads take them
+// round-robin)
+#ifdef MALLOC_4_ARENAS
+#define ARENA_COUNT MALLOC_4_ARENAS
+#else
+#define ARENA_COUNT 4
+#endif
 
 
 
 /**
  * @struct: malloc_metadata_t
- * @brief:  Struct to hold the Metadata of the Allocations.
+ * @brief:  Struct to hold the Metadata of the Allocations (16 bytes).
+ *          Blocks are found by address (boundary tags): the next block starts right after
+ *          the block's payload, and a free block writes its size (footer) in the prev_size
+ *          of the header after it, so that block can find its start.
+ *          Sizes are multiples of MALLOC_ALIGNMENT, so the 4 low bits of size_flags hold the
+ *          BLOCK_* flags.
+ *          The bin links of a free block live in its (free) payload.
  * 
  * @members:
- *     - size_t size:               numbers of bytes in the allocate (include metadata).
- *     - bool is_free:              true if block was free'd before.
- *     - MallocMetadata* next:      pointer to next alloc block (nullptr if last).
- *     - MallocMetadata* prev:      pointer to previous alloc block (nullptr if first).
- *     - MallocMetadata* bin_next:  pointer to next alloc block in free bin entry (nullptr if last).
- *     - MallocMetadata* bin_prev:  pointer to previous alloc block in free bin entry (nullptr if first).
+ *     - size_t prev_size:          size of the block right before this one (valid only if it's free).
+ *     - size_t size_flags:         numbers of bytes in the allocate (not including metadata),
+ *                                  ORed with BLOCK_IS_FREE, BLOCK_MMAPPED, BLOCK_PREV_IN_USE and
+ *                                  BLOCK_HUGETLB (an mmap block of reserved huge pages).
  */
 struct malloc_metadata_t {
-    size_t size;
-    bool is_free;
-    malloc_metadata_t* next;
-    malloc_metadata_t* prev;
-    malloc_metadata_t* bin_next;
-    malloc_metadata_t* bin_prev;
+    size_t prev_size;
+    size_t size_flags;
 };
 
 typedef struct malloc_metadata_t MallocMetadata;
 
 
+/**
+ * @struct: free_list_node_t
+ * @brief:  Links of a free small block in its bin, stored in the block's (free) payload.
+ * 
+ * @members:
+ *     - MallocMetadata* next:      next free block in the bin (nullptr if last).
+ *     - MallocMetadata* prev:      previous free block in the bin (nullptr if first).
+ */
+struct free_list_node_t {
+    MallocMetadata* next;
+    MallocMetadata* prev;
+};
+
+// every heap size is a multiple of MALLOC_ALIGNMENT, so are the headers and the smallest block:
+// the payloads of split remainders, merged blocks and grown last blocks stay aligned too
+static_assert(sizeof(malloc_metadata_t) % MALLOC_ALIGNMENT == 0 && MIN_BLOCK_SIZE % MALLOC_ALIGNMENT == 0 &&
+              alignof(max_align_t) <= MALLOC_ALIGNMENT, "heap payloads wouldn't be MALLOC_ALIGNMENT aligned");
+static_assert(BLOCK_FLAGS < MALLOC_ALIGNMENT, "the BLOCK_* flags don't fit under the sizes");
+
+
+/**
+ * @struct: heap_segment_t
+ * @brief:  A contiguous range of sbrk memory. It ends with a fence, an allocated header of
+ *          size 0, so the last block has a next header too. A new segment starts only if
+ *          someone else moved the program break.
+ * 
+ * @members:
+ *     - MallocMetadata* first:     first block of the segment.
+ *     - MallocMetadata* fence:     the segment's end fence.
+ */
+struct heap_segment_t {
+    MallocMetadata* first;
+    MallocMetadata* fence;
+};
+
+
+/**
+ * @struct: free_tree_node_t
+ * @brief:  Red-black tree node of a free medium block, stored in the block's (free) payload.
+ *          Every medium bin is a tree ordered by (size, address), so best fit, insertion and
+ *          deletion are O(log n) in the number of free blocks of the bin.
+ * 
+ * @members:
+ *     - MallocMetadata* left:      smaller blocks (nullptr if none).
+ *     - MallocMetadata* right:     bigger blocks (nullptr if none).
+ *     - MallocMetadata* parent:    parent block (nullptr if root).
+ *     - bool is_red:               node's color.
+ */
+struct free_tree_node_t {
+    MallocMetadata* left;
+    MallocMetadata* right;
+    MallocMetadata* parent;
+    bool is_red;
+};
+
+
+/**
+ * @struct: slab_t
+ * @brief:  Header of a slab: one page of equal slots of a single small size class. The header is
+ *          at the start of the (aligned) page, so the slab of a slot is found by masking its
+ *          address and the slots need no header of their own. A free slot holds the pointer to
+ *          the next free slot.
+ * 
+ * @members:
+ *     - slab_t* next:          next slab of the class with free slots (nullptr if last).
+ *     - slab_t* prev:          previous slab of the class with free slots (nullptr if first).
+ *     - void* free_list:       free'd slots of the slab.
+ *     - char* unused:          first slot that was never used (slots are carved lazily).
+ *     - uint32_t used:         # of slots in use.
+ *     - uint32_t size_class:   the slab's class (SLAB_NO_CLASS if the page is not a slab).
+ */
+struct slab_t {
+    slab_t* next;
+    slab_t* prev;
+    void* free_list;
+    char* unused;
+    uint32_t used;
+    uint32_t size_class;
+};
+
+#define SLAB_HEADER_SIZE ((sizeof(slab_t) + SLAB_ALIGNMENT - 1) & ~(SLAB_ALIGNMENT - 1))
+
+
+/**
+ * @struct: run_t
+ * @brief:  A span of pages in a chunk: either a run, equal slots of one medium size class, or
+ *          free pages. The descriptor lives in the chunk's header (at the span's first page)
+ *          and the slots need no header, the run is found from the address by the chunk's
+ *          page map.
+ * 
+ * @members:
+ *     - run_t* next:           next run of the class with free slots (nullptr if last), or
+ *                              next free span of as many pages.
+ *     - run_t* prev:           previous run of the class with free slots (nullptr if first),
+ *                              or previous free span of as many pages.
+ *     - uint64_t free_slots:   bitmap of the run's free slots (bit i is set iff slot i is free),
+ *                              or for free pages whether they may hold memory (see
+ *                              IS_SPAN_DIRTY).
+ *     - uint32_t pages:        # of pages of the span.
+ *     - uint32_t size_class:   the run's class (RUN_NO_CLASS if the pages are free).
+ */
+struct run_t {
+    run_t* next;
+    run_t* prev;
+    uint64_t free_slots;
+    uint32_t pages;
+    uint32_t size_class;
+};
+
+
+/**
+ * @struct: chunk_t
+ * @brief:  Header of a CHUNK_SIZE aligned chunk of the run region (its first CHUNK_HEADER_PAGES
+ *          pages). The chunk of a slot is found by masking its address, its run by the page map.
+ * 
+ * @members:
+ *     - uint16_t page_span[]:  first page of the span every page belongs to.
+ *     - run_t spans[]:         descriptor of every span (at the span's first page).
+ */
+struct chunk_t {
+    uint16_t page_span[CHUNK_PAGES];
+    run_t spans[CHUNK_PAGES];
+};
+
+#define CHUNK_HEADER_PAGES ((sizeof(chunk_t) + MALLOC_PAGE_SIZE - 1) / MALLOC_PAGE_SIZE)
+
+
+/**
+ * @struct: malloc_lock_t
+ * @brief:  A mutex that counts how many times a thread had to wait for it.
+ * 
+ * @members:
+ *     - pthread_mutex_t mutex:     the mutex.
+ *     - size_t contentions:        # of lock() calls that found the mutex taken
+ *                                  (only updated while holding it).
+ */
+struct malloc_lock_t {
+    pthread_mutex_t mutex;
+    size_t contentions;
+};
+
+
+/**
+ * @struct: tcache_bin_t
+ * @brief:  A thread's cached free slots of one slab class, linked through their first word.
+ *          Its depth adapts to its misses (see cache_bin_scavenge).
+ * 
+ * @members:
+ *     - void* head:            first cached slot (nullptr if the bin is empty).
+ *     - uint32_t count:        # of cached slots.
+ *     - uint32_t max_depth:    # of cached slots that makes the bin flush (TCACHE_MIN_DEPTH -
+ *                              TCACHE_MAX_DEPTH).
+ *     - uint32_t low_water:    lowest count since the last scavenge.
+ *     - uint32_t misses:       # of refills since the last scavenge.
+ */
+struct tcache_bin_t {
+    void* head;
+    uint32_t count;
+    uint32_t max_depth;
+    uint32_t low_water;
+    uint32_t misses;
+};
+
+
+/**
+ * @struct: tcache_t
+ * @brief:  A thread's cache of free slab slots. The slots it holds are still in use as far as
+ *          their slabs are concerned, they are taken from and given back to the slabs
+ *          TCACHE_BATCH at a time (one lock per batch).
+ * 
+ * @members:
+ *     - tcache_bin_t bins[]:   a bin for every slab class.
+ *     - bool busy:             whether its thread uses it (see tcache_enter).
+ *     - bool scavenging:       whether the scavenger may use it.
+ *     - bool registered:       whether the cache is in the list of thread caches and the
+ *                              thread's exit flushes it (see tcache_key).
+ *     - bool destroyed:        whether the thread's exit flushed it (its last frees, from
+ *                              later TSD destructors, go to the slabs).
+ *     - tcache_t* next:        next thread cache of the list.
+ *     - tcache_t* prev:        previous thread cache of the list.
+ */
+struct tcache_t {
+    tcache_bin_t bins[SLAB_CLASS_COUNT];
+    bool busy;
+    bool scavenging;
+    bool registered;
+    bool destroyed;
+    tcache_t* next;
+    tcache_t* prev;
+};
+
+
+/**
+ * @struct: transfer_cache_t
+ * @brief:  The central cache of a slab class between the thread / CPU caches and the slabs:
+ *          full batches of TCACHE_BATCH slots (linked through their first word) a cache
+ *          flushed, handed whole to a cache that refills, in O(1) per batch.
+ * 
+ * @members:
+ *     - malloc_lock_t lock:    the transfer cache's lock.
+ *     - void* batches[]:       first slot of every batch.
+ *     - uint32_t count:        # of batches.
+ *     - uint32_t low_water:    lowest count since the last scavenge.
+ */
+struct transfer_cache_t {
+    malloc_lock_t lock;
+    void* batches[TRANSFER_CACHE_BATCHES];
+    uint32_t count;
+    uint32_t low_water;
+};
+
+
+/**
+ * @struct: cpu_cache_bin_t
+ * @brief:  A CPU's cached free slots of one slab class, linked through their first word. The
+ *          first slot and the count share a word, so a restartable sequence changes the bin
+ *          with a single store (its commit, see rseq_pop).
+ * 
+ * @members:
+ *     - uint64_t list:         first cached slot | # of cached slots << CPU_BIN_COUNT_SHIFT.
+ *     - uint32_t max_depth:    as tcache_bin_t's.
+ *     - uint32_t low_water:    as tcache_bin_t's.
+ *     - uint32_t misses:       as tcache_bin_t's.
+ */
+struct cpu_cache_bin_t {
+    uint64_t list;
+    uint32_t max_depth;
+    uint32_t low_water;
+    uint32_t misses;
+};
+
+
+/**
+ * @struct: cpu_cache_t
+ * @brief:  A CPU's cache of free slab slots (the tcache_t of -DMALLOC_4_PERCPU_CACHE), shared
+ *          by the threads that run on the CPU, so the cached memory grows with the cores and
+ *          not with the threads. Its threads pop and push with restartable sequences, no lock
+ *          and no atomic instruction: the kernel restarts a sequence that is preempted or
+ *          moved to another CPU before its commit. Another CPU (the scavenger, the stats)
+ *          stops the cache first (see cpu_cache_stop). Without rseq every access takes the
+ *          lock. Aligned to a cache line so the CPUs don't share lines.
+ * 
+ * @members:
+ *     - malloc_lock_t lock:        the cache's lock (held while it's stopped).
+ *     - uint32_t stopped:          whether the restartable sequences must leave the cache
+ *                                  alone (they wait on the lock).
+ *     - cpu_cache_bin_t bins[]:    a bin for every slab class.
+ */
+struct alignas(64) cpu_cache_t {
+    malloc_lock_t lock;
+    uint32_t stopped;
+    cpu_cache_bin_t bins[SLAB_CLASS_COUNT];
+};
+
+
+/**
+ * @struct: arena_t
+ * @brief:  An independent heap: its own blocks, bins and lock. Arena 0 grows at the program
+ *          break, the others in their own region (reserved once with mmap), since there is
+ *          only one program break. A block belongs to the arena whose region holds it.
+ * 
+ * @members:
+ *     - malloc_lock_t lock:                    the arena's lock (bins and segments).
+ *     - heap_segment_t heap_segments[]:        the arena's segments (the last one is the one
+ *                                              that grows).
+ *     - int heap_segments_count:               # of segments.
+ *     - MallocMetadata* free_block_bin[]:      heads of the small bins, roots of the medium
+ *                                              bins' trees.
+ *     - MallocMetadata* free_block_bin_tail[]: tails of the small bins.
+ *     - uint64_t free_block_bin_map[]:         bitmap of the non empty bins (bit i is set iff
+ *                                              free_block_bin[i] != nullptr).
+ *     - char* region_start:                    the arena's region (nullptr for arena 0, unless
+ *                                              -DMALLOC_4_THP_HEAP).
+ *     - char* region_top:                      end of the region's used part (the arena's
+ *                                              break).
+ *     - void* remote_frees:                    blocks free'd while the lock was taken (see
+ *                                              remote_push), arena 0's mmap blocks too.
+ */
+struct arena_t {
+    malloc_lock_t lock;
+    heap_segment_t heap_segments[MAX_HEAP_SEGMENTS];
+    int heap_segments_count;
+    MallocMetadata* free_block_bin[BIN_SIZE];
+    MallocMetadata* free_block_bin_tail[BIN_SIZE];
+    uint64_t free_block_bin_map[BIN_MAP_WORDS];
+    char* region_start;
+    char* region_top;
+    void* remote_frees;
+};
+
+
+/**
+ * @struct: spool_t
+ * @brief:  A pool of fixed size objects, lock free: its free objects are a Treiber stack
+ *          (linked through their first word) whose top is a tagged pointer, the top 16 bits
+ *          count the changes so a top that was popped and pushed back in the meantime (ABA)
+ *          fails the compare and swap. It grows by chunks of chunk_objects objects, taken
+ *          with smalloc and never given back before spool_destroy (so a stale top's next can
+ *          always be read).
+ * 
+ * @members:
+ *     - uint64_t top:              the first free object, tagged (see SPOOL_TAGGED).
+ *     - size_t object_size:        size of the objects (multiple of MALLOC_ALIGNMENT).
+ *     - size_t chunk_objects:      # of objects in a chunk.
+ *     - void* chunks:              the chunks, linked through their header.
+ */
+struct spool_t {
+    uint64_t top;
+    size_t object_size;
+    size_t chunk_objects;
+    void* chunks;
+};
+
+
 /**
  * @macro: INT_TO_KB(X)
  * @brief: returns X kb.
@@ -76,6 +565,14 @@ typedef struct malloc_metadata_t MallocMetadata;
 
 
 
+/**
+ * @macro: MMAX(A,B)
+ * @brief: returns the maximum of A and B.
+ */
+#define MMAX(A,B) (((A) > (B)) ? (A) : (B))
+
+
+
 /**
  * @macro: GET_METADATA_FROM_PTR(alloc_ptr)
  * @brief: get the metadata of the alloc pointer.
@@ -85,868 +582,5054 @@ typedef struct malloc_metadata_t MallocMetadata;
 
 /**
  * @macro: GET_METADATA_SIZE(metadata)
- * @brief: get the block size from the metadata.
+ * @brief: get the block size from the metadata (without the flags).
+ */
+#define GET_METADATA_SIZE(metadata)         (((MallocMetadata*)(metadata))->size_flags & ~BLOCK_FLAGS)
+
+
+/**
+ * @macro: SET_METADATA_SIZE(metadata, size)
+ * @brief: set the block size in the metadata (keeping the flags).
  */
-#define GET_METADATA_SIZE(metadata)         (((MallocMetadata*)metadata)->size)
+#define SET_METADATA_SIZE(metadata, size)   ((metadata)->size_flags = (size) | ((metadata)->size_flags & BLOCK_FLAGS))
 
 
 /**
  * @macro: GET_METADATA_IS_FREE(metadata)
  * @brief: get the block is_Free from the metadata.
  */
-#define GET_METADATA_IS_FREE(metadata)      (((MallocMetadata*)metadata)->is_free)
+#define GET_METADATA_IS_FREE(metadata)      ((((MallocMetadata*)(metadata))->size_flags & BLOCK_IS_FREE) != 0)
 
 
 /**
- * @macro: GET_METADATA_NEXT(metadata)
- * @brief: get the next block from the metadata.
+ * @macro: IS_METADATA_MMAPPED(metadata)
+ * @brief: true if the block was allocated by mmap.
  */
-#define GET_METADATA_NEXT(metadata)         (((MallocMetadata*)metadata)->next)
+#define IS_METADATA_MMAPPED(metadata)       ((((MallocMetadata*)(metadata))->size_flags & BLOCK_MMAPPED) != 0)
 
 
 /**
- * @macro: GET_METADATA_PREV(metadata)  
- * @brief: get the prev block from the metadata.
+ * @macro: IS_METADATA_HUGETLB(metadata)
+ * @brief: true if the block was mapped with MAP_HUGETLB.
  */
-#define GET_METADATA_PREV(metadata)         (((MallocMetadata*)metadata)->prev)
+#define IS_METADATA_HUGETLB(metadata)       ((((MallocMetadata*)(metadata))->size_flags & BLOCK_HUGETLB) != 0)
 
 
 /**
- * @macro: GET_PTR_FROM_METADATA(metadata)
- * @brief: get the actual pointer from the metadata.
+ * @macro: IS_HUGE_SIZE(size)
+ * @brief: true if a block of size bytes is mapped on huge pages (-DMALLOC_4_HUGE_PAGES).
  */
-#define GET_PTR_FROM_METADATA(metadata)     ((void*)((intptr_t)metadata + sizeof(malloc_metadata_t)))
+#define IS_HUGE_SIZE(size)                  (USE_HUGE_PAGES && (size) >= HUGE_PAGE_SIZE)
 
 
 /**
- * @macro: METADATA_FOR_EACH(block, mt_head)
- * @brief: iterate over the list's block, from mt_head until nullptr(end).
+ * @macro: IS_PREV_IN_USE(metadata)
+ * @brief: true if the block right before is allocated (or there is none).
  */
-#define METADATA_FOR_EACH(block, mt_head)   for(MallocMetadata* block = mt_head; block != nullptr; block = block->next)
+#define IS_PREV_IN_USE(metadata)            ((((MallocMetadata*)(metadata))->size_flags & BLOCK_PREV_IN_USE) != 0)
 
 
 /**
- * @macro: INIT_METADATA(metadata, size, is_free, next, prev)
- * @brief: initialize the metadata's members.
+ * @macro: SET_METADATA_FLAG(metadata, flag, on)
+ * @brief: set (on is true) or clear one of the BLOCK_* flags.
  */
-#define INIT_METADATA(metadata, _size, _is_free, _next, _prev, _bin_next, _bin_prev)  \
-        MallocMetadata* tm = (MallocMetadata*)metadata;          \
-        tm->size     = _size;                                    \
-        tm->is_free  = _is_free;                                 \
-        tm->next     = _next;                                    \
-        tm->prev     = _prev;                                    \
-        tm->bin_next = _bin_next;                                \
-        tm->bin_prev = _bin_prev;                                                                    
+#define SET_METADATA_FLAG(metadata, flag, on)   \
+        ((metadata)->size_flags = (on) ? ((metadata)->size_flags | (flag)) : ((metadata)->size_flags & ~(flag)))
 
 
 /**
- * @macro: GET_BIN_ENTRY(size)
- * @brief: gets the matching bin entry from its size.
+ * @macro: GET_PTR_FROM_METADATA(metadata)
+ * @brief: get the actual pointer from the metadata.
  */
-#define GET_BIN_ENTRY(size) ((size)/KB)
+#define GET_PTR_FROM_METADATA(metadata)     ((void*)((intptr_t)metadata + sizeof(malloc_metadata_t)))
 
 
 /**
- * @macro: IS_LARGE_ENOUGH(entire_block_size, needed_size)
- * @brief: returns true if entire_block_size large enough to fit needed_size.
+ * @macro: GET_NEXT_METADATA(metadata)
+ * @brief: get the header right after the block (the next block or the segment's fence).
  */
-#define IS_LARGE_ENOUGH(entire_block_size, needed_size) \
-        ((entire_block_size) >= (needed_size) + sizeof(malloc_metadata_t) + 128)
+#define GET_NEXT_METADATA(metadata)         ((MallocMetadata*)((intptr_t)metadata + sizeof(malloc_metadata_t) + GET_METADATA_SIZE(metadata)))
+
 
+/**
+ * @macro: IS_FENCE(metadata)
+ * @brief: true if the header is a segment's end fence.
+ */
+#define IS_FENCE(metadata)                  (GET_METADATA_SIZE(metadata) == 0)
 
-// global head of the alloction list from sbrk
-static MallocMetadata* metadata_head = nullptr;
 
-// global head of the alloction list from mmap
-static MallocMetadata* mmap_metadata_head = nullptr;
+/**
+ * @macro: GET_LIST_NODE(metadata)
+ * @brief: get the bin links of a free small block (live in its payload).
+ */
+#define GET_LIST_NODE(metadata)             ((free_list_node_t*)GET_PTR_FROM_METADATA(metadata))
 
-// global bin of free blocks
-static MallocMetadata* free_block_bin[BIN_SIZE] = {};
 
+/**
+ * @macro: GET_TREE_NODE(metadata)
+ * @brief: get the tree node of a free medium block (lives in its payload).
+ */
+#define GET_TREE_NODE(metadata)             ((free_tree_node_t*)GET_PTR_FROM_METADATA(metadata))
 
 
 /**
- * @function:   static MallocMetadata* get_last_metadata_block()
- * @brief:      search for the last block in alloc list.
- * 
- * @returns:
- *     - Success: a pointer to the last block.
- *
- *     - Failure:
- *          Never Fail (motivation loll)
+ * @macro: IS_TREE_NODE_RED(metadata)
+ * @brief: true if the tree node is red (nullptr leaves are black).
  */
-static MallocMetadata* get_last_metadata_block(MallocMetadata* list)
-{
-    if (!list)
-    {
-        return nullptr;
-    }
-    METADATA_FOR_EACH(block, list)
-    {
-        if (block->next == nullptr)
-            return block;
-    }
-    // assert(true);
-    return list;
-}
+#define IS_TREE_NODE_RED(metadata)          ((metadata) != nullptr && GET_TREE_NODE(metadata)->is_red)
+
 
+/**
+ * @macro: IS_TREE_NODE_LESS(a, b)
+ * @brief: the tree order, by size and then by address.
+ */
+#define IS_TREE_NODE_LESS(a, b)             (GET_METADATA_SIZE(a) < GET_METADATA_SIZE(b) ||                         \
+                                             (GET_METADATA_SIZE(a) == GET_METADATA_SIZE(b) && (a) < (b)))
 
 
 /**
- * @function:   void remove_from_list(MallocMetadata* to_del, MallocMetadata** list)
- * @brief:      delete metadata from the list
- * 
- * @arguments:
- *     - MallocMetadata* to_del: block to delete
- *     - MallocMetadata** list: pointer to list to delete from
+ * @macro: HEAP_FOR_EACH(arena, block)
+ * @brief: iterate over the arena's blocks by address, segment after segment.
  */
-static void remove_from_list(MallocMetadata* to_del, MallocMetadata** list)
-{
-    if (!to_del->next && !to_del->prev)
-    {
-        *list = nullptr;
-    }
-    else if (!to_del->prev)
-    {
-        *list = to_del->next;
-        to_del->next->prev = nullptr;
-    }
-    else if (!to_del->next)
-    {
-        to_del->prev->next = nullptr;
-    }
-    else
-    {
-        to_del->next->prev = to_del->prev;
-        to_del->prev->next = to_del->next;
-    }
-    to_del->next = nullptr;
-    to_del->prev = nullptr;
-    return;
-}
+#define HEAP_FOR_EACH(arena, block)                                                                 \
+        for (int seg_i = 0; seg_i < (arena)->heap_segments_count; seg_i++)                          \
+            for (MallocMetadata* block = (arena)->heap_segments[seg_i].first;                       \
+                 block != (arena)->heap_segments[seg_i].fence; block = GET_NEXT_METADATA(block))
 
 
+/**
+ * @macro: INIT_METADATA(metadata, size, flags)
+ * @brief: initialize the metadata's size and flags (prev_size is left as is).
+ */
+#define INIT_METADATA(metadata, _size, _flags)  (((MallocMetadata*)(metadata))->size_flags = (_size) | (_flags))
 
 
 /**
- * @function:   void remove_from_bin(MallocMetadata* to_del)
- * @brief:      delete metadata from the right bin
+ * @struct: medium_bin_table_t
+ * @brief:  Compile time table of the medium bins' size classes.
+ *          Every power of two between 1KB and MIN_KB_BLOCK is split into MEDIUM_BIN_SUB_CLASSES
+ *          classes, medium bin i holds the free blocks with min_size[i] <= size < min_size[i + 1].
+ *          The last bin takes every block of MIN_KB_BLOCK and above (merged sbrk blocks).
  * 
- * @arguments:
- *     - MallocMetadata* to_del: block to delete
+ * @members:
+ *     - size_t min_size[]:     smallest block size of every medium bin.
  */
-static void remove_from_bin(MallocMetadata* to_del)
-{
-    MallocMetadata** list = &free_block_bin[GET_BIN_ENTRY(to_del->size)];
-    if (!to_del->bin_next && !to_del->bin_prev)
-    {
-        *list = nullptr;
-    }
-    else if (!to_del->bin_prev)
-    {
-        *list = to_del->bin_next;
-        to_del->bin_next->bin_prev = nullptr;
-    }
-    else
+struct medium_bin_table_t {
+    size_t min_size[MEDIUM_BIN_COUNT];
+
+    constexpr medium_bin_table_t() : min_size()
     {
-        to_del->bin_prev->bin_next = nullptr;
+        for (int i = 0; i < MEDIUM_BIN_COUNT; i++)
+        {
+            size_t base = (size_t)1 << (MEDIUM_BIN_MIN_SHIFT + i / MEDIUM_BIN_SUB_CLASSES);
+            min_size[i] = base + (i % MEDIUM_BIN_SUB_CLASSES) * (base >> MEDIUM_BIN_SUB_SHIFT);
+        }
     }
-    to_del->bin_next = nullptr;
-    to_del->bin_prev = nullptr;
-    return;
-}
+};
+
+static constexpr medium_bin_table_t medium_bin_table;
 
 
 
 /**
- * @function:   insert_to_metadata_list(MallocMetadata* new_block, MallocMetadata** list)
- * @brief:      insert metadata into the list
- * 
- * @arguments:
- *     - MallocMetadata* new_block: block to insert
- *     - MallocMetadata** list: pointer to list to append to
+ * @function:   constexpr int get_medium_bin_entry(size_t size)
+ * @brief:      gets the medium bin (size class) of a size of at least 1KB, in O(1).
+ *              the power of two picks the row and the next MEDIUM_BIN_SUB_SHIFT bits the class.
  */
-static void insert_to_metadata_list(MallocMetadata* new_block, MallocMetadata** list)
+static constexpr int get_medium_bin_entry(size_t size)
 {
-    // list is empty
-    if ((*list) == nullptr)
-    {
-        new_block->prev = nullptr;
-        new_block->next = nullptr;
-        *list = new_block;
-    }
-    else
+    int shift = 63 - __builtin_clzl(size);
+    if (shift >= MEDIUM_BIN_MAX_SHIFT)
     {
-        MallocMetadata* after = get_last_metadata_block(*list);
-        after->next = new_block;
-        new_block->prev = after;
-        new_block->next = nullptr;
+        return MEDIUM_BIN_COUNT - 1;
     }
+    return (shift - MEDIUM_BIN_MIN_SHIFT) * MEDIUM_BIN_SUB_CLASSES +
+           (int)((size >> (shift - MEDIUM_BIN_SUB_SHIFT)) & (MEDIUM_BIN_SUB_CLASSES - 1));
 }
 
 
+
 /**
- * @function:   void insert_block_to_bin(MallocMetadata* new_block)
- * @brief:      insert metadata into its bin
- * 
- * @arguments:
- *     - MallocMetadata* new_block: block to insert
+ * @function:   constexpr bool medium_bin_table_is_valid()
+ * @brief:      checks that get_medium_bin_entry matches the class boundaries of medium_bin_table.
  */
-static void insert_block_to_bin(MallocMetadata* new_block)
+static constexpr bool medium_bin_table_is_valid()
 {
-    // list is empty
-    if (free_block_bin[GET_BIN_ENTRY(new_block->size)] == nullptr)
+    for (int i = 0; i < MEDIUM_BIN_COUNT; i++)
     {
-        new_block->bin_prev = nullptr;
-        new_block->bin_next = nullptr;
-        free_block_bin[GET_BIN_ENTRY(new_block->size)] = new_block;
-    }
-    else
-    {
-        MallocMetadata* last;
-        for(MallocMetadata* block = free_block_bin[GET_BIN_ENTRY(new_block->size)]; block != nullptr; block = block->bin_next)
+        if (get_medium_bin_entry(medium_bin_table.min_size[i]) != i ||
+            (i > 0 && get_medium_bin_entry(medium_bin_table.min_size[i] - 1) != i - 1))
         {
-            last = block;
-            if(block->size >= new_block->size)
-            {
-                // insert before block
-                MallocMetadata* prev = block->bin_prev;
-                if (prev == nullptr)
-                {
-                    block->bin_prev = new_block;
-                    new_block->bin_next = block;
-                    new_block->bin_prev = nullptr;
-                    free_block_bin[GET_BIN_ENTRY(new_block->size)] = new_block;
-                }
-                else
-                {
-                    prev->bin_next = new_block;
-                    new_block->bin_prev = prev;
-                    new_block->bin_next = block;
-                    block->bin_prev = new_block;
-                }
-                return;
-            }
+            return false;
         }
-        // insert new_block last
-        new_block->bin_next = nullptr;
-        new_block->bin_prev = last;
-        last->bin_next = new_block;
-        new_block->is_free = true;
     }
+    return medium_bin_table.min_size[0] == KB && medium_bin_table.min_size[MEDIUM_BIN_COUNT - 1] == MIN_KB_BLOCK;
 }
 
+static_assert(medium_bin_table_is_valid(), "medium bin size classes are inconsistent");
+
 
 
 /**
- * @function:   void cut_block(MallocMetadata* block, size_t size)
- * @brief:      split the block into two according to the size
+ * @struct: slab_class_table_t
+ * @brief:  Compile time table of the slab size classes: SLAB_SPACING apart up to
+ *          SLAB_LINEAR_CLASSES * SLAB_SPACING, then SLAB_SUB_CLASSES classes per power of two up
+ *          to SLAB_MAX_SIZE.
  * 
- * @arguments:
- *     - size_t size:           # of bytes to find in blocks.
- *     - MallocMetadata* block: block to split
+ * @members:
+ *     - uint32_t slot_size[]:  slot size of every class.
+ *     - uint32_t capacity[]:   # of slots in a slab of every class.
+ *     - uint8_t class_of[]:    smallest class that fits, by size / SLAB_SPACING (rounded up).
  */
-static void cut_block(MallocMetadata* block, size_t size, bool remove_bin = true)
-{
-    if (remove_bin)
-    {
-        remove_from_bin(block);
-    }
-    int new_block_size = block->size - size;
-    MallocMetadata* new_block = (MallocMetadata*)((intptr_t)block + size + sizeof(malloc_metadata_t));
-    INIT_METADATA(new_block, new_block_size - sizeof(malloc_metadata_t), true, block->next, block, nullptr, nullptr);
-    insert_block_to_bin(new_block);
-    if (block->next)
+struct slab_class_table_t {
+    uint32_t slot_size[SLAB_CLASS_COUNT];
+    uint32_t capacity[SLAB_CLASS_COUNT];
+    uint8_t class_of[SLAB_MAX_SIZE / SLAB_SPACING + 1];
+
+    constexpr slab_class_table_t() : slot_size(), capacity(), class_of()
     {
-        block->next->prev = new_block;
+        for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+        {
+            if (i < SLAB_LINEAR_CLASSES)
+            {
+                slot_size[i] = (i + 1) * SLAB_SPACING;
+            }
+            else
+            {
+                uint32_t base = (SLAB_LINEAR_CLASSES * SLAB_SPACING) << ((i - SLAB_LINEAR_CLASSES) / SLAB_SUB_CLASSES);
+                slot_size[i] = base + ((i - SLAB_LINEAR_CLASSES) % SLAB_SUB_CLASSES + 1) * (base / SLAB_SUB_CLASSES);
+            }
+            capacity[i] = (SLAB_SIZE - SLAB_HEADER_SIZE) / slot_size[i];
+        }
+        int size_class = 0;
+        for (int i = 0; i <= SLAB_MAX_SIZE / SLAB_SPACING; i++)
+        {
+            while (slot_size[size_class] < (uint32_t)i * SLAB_SPACING)
+            {
+                size_class++;
+            }
+            class_of[i] = size_class;
+        }
     }
-    block->next = new_block;
-    block->is_free  = false;
-    block->size     = size;
-    block->bin_next = nullptr;
-    block->bin_prev = nullptr;
-}
-
-
+};
 
+static constexpr slab_class_table_t slab_class_table;
 
+static_assert(slab_class_table.slot_size[SLAB_CLASS_COUNT - 1] == SLAB_MAX_SIZE, "slab size classes are inconsistent");
+static_assert(SLAB_HEADER_SIZE % MALLOC_ALIGNMENT == 0 && SLAB_SPACING % MALLOC_ALIGNMENT == 0,
+              "slab slots wouldn't be MALLOC_ALIGNMENT aligned");
 
 
 
 /**
- * @function:   static void* get_free_metadata_block(size_t size)
- * @brief:      search for suitable block from the alloc list (when block.size large enough).
+ * @struct: run_class_table_t
+ * @brief:  Compile time table of the run size classes: the medium bins' classes, run class i
+ *          holds the sizes medium_bin_table.min_size[i] < size <= medium_bin_table.min_size[i + 1].
+ *          A run is the fewest pages that fit RUN_MIN_SLOTS slots.
  * 
- * @arguments:
- *     - size_t size: # of bytes to find in blocks.
- * 
- * @returns:
- *     - Success: a pointer to the matching block.
- *
- *     - Failure:
- *          If no suitable block was found, returns nullptr.
+ * @members:
+ *     - uint32_t slot_size[]:  slot size of every class.
+ *     - uint32_t pages[]:      # of pages of a run of every class.
+ *     - uint32_t slots[]:      # of slots in a run of every class.
  */
-static MallocMetadata* get_free_metadata_block(size_t size)
-{
-    for (int i = GET_BIN_ENTRY(size); i < BIN_SIZE; i++)
+struct run_class_table_t {
+    uint32_t slot_size[RUN_CLASS_COUNT];
+    uint32_t pages[RUN_CLASS_COUNT];
+    uint32_t slots[RUN_CLASS_COUNT];
+
+    constexpr run_class_table_t() : slot_size(), pages(), slots()
     {
-        if (free_block_bin[i] == nullptr) continue;
-        METADATA_FOR_EACH(block, free_block_bin[i])
+        for (int i = 0; i < RUN_CLASS_COUNT; i++)
         {
-            if (block && block->size >= size)
-            {
-                if (IS_LARGE_ENOUGH(block->size, size))
-                {
-                    cut_block(block, size);
-                    block->is_free = false;
-                    return block;
-                }
-                remove_from_bin(block);
-                block->is_free = false;
-                return block;
-            }
+            slot_size[i] = medium_bin_table.min_size[i + 1];
+            pages[i] = (RUN_MIN_SLOTS * slot_size[i] + MALLOC_PAGE_SIZE - 1) / MALLOC_PAGE_SIZE;
+            slots[i] = pages[i] * MALLOC_PAGE_SIZE / slot_size[i];
         }
     }
-    return nullptr;
-}
+};
 
+static constexpr run_class_table_t run_class_table;
+
+static_assert(run_class_table.slots[0] <= 64 && run_class_table.pages[RUN_CLASS_COUNT - 1] <= CHUNK_PAGES - CHUNK_HEADER_PAGES,
+              "run size classes don't fit the run bitmap or a chunk");
 
 
 
 /**
- * @function:   void* smalloc(size_t size)
+ * @macro: GET_RUN_CLASS(size)
+ * @brief: gets the run class of a size above SLAB_MAX_SIZE and below MIN_KB_BLOCK, in O(1).
+ */
+#define GET_RUN_CLASS(size) (get_medium_bin_entry((size) - 1))
+
+
+/**
+ * @macro: GET_RUN_ALL_SLOTS(size_class)
+ * @brief: the free_slots bitmap of an empty run of the class.
+ */
+#define GET_RUN_ALL_SLOTS(size_class)                                                               \
+        ((run_class_table.slots[size_class] == 64) ? ~(uint64_t)0 : (((uint64_t)1 << run_class_table.slots[size_class]) - 1))
+
+
+/**
+ * @macro: GET_CHUNK(ptr)
+ * @brief: get the chunk of a slot (the start of its CHUNK_SIZE aligned chunk).
+ */
+#define GET_CHUNK(ptr) ((chunk_t*)((uintptr_t)(ptr) & ~(uintptr_t)(CHUNK_SIZE - 1)))
+
+
+/**
+ * @macro: GET_PAGE_INDEX(chunk, ptr)
+ * @brief: get the index of the page of ptr in its chunk.
+ */
+#define GET_PAGE_INDEX(chunk, ptr) ((uint32_t)(((uintptr_t)(ptr) - (uintptr_t)(chunk)) / MALLOC_PAGE_SIZE))
+
+
+/**
+ * @macro: GET_PAGE_ADDRESS(chunk, page)
+ * @brief: get the address of a page of the chunk.
+ */
+#define GET_PAGE_ADDRESS(chunk, page) ((char*)(chunk) + (size_t)(page) * MALLOC_PAGE_SIZE)
+
+
+/**
+ * @macro: IS_SPAN_DIRTY(span) / SET_SPAN_DIRTY(span, dirty)
+ * @brief: whether a span of free pages was used since the scavenger last gave its memory back
+ *         to the OS (see purge_free_spans), kept in its free_slots.
+ */
+#define IS_SPAN_DIRTY(span)         ((span)->free_slots != 0)
+#define SET_SPAN_DIRTY(span, dirty) ((span)->free_slots = (dirty) ? 1 : 0)
+
+
+/**
+ * @macro: IS_RUN_PTR(ptr)
+ * @brief: true if the pointer is inside the run region (a run's slot).
+ */
+#define IS_RUN_PTR(ptr) (run_region_start != nullptr && (uintptr_t)(ptr) - (uintptr_t)run_region_start < RUN_REGION_SIZE)
+
+
+/**
+ * @macro: RUN_REGION_FOR_EACH(chunk, run)
+ * @brief: iterate over the spans (runs and free pages) of all the chunks, chunk after chunk.
+ */
+#define RUN_REGION_FOR_EACH(chunk, run)                                                                 \
+        for (chunk_t* chunk = (chunk_t*)run_region_start; (char*)chunk < run_region_top;                 \
+             chunk = (chunk_t*)((char*)chunk + CHUNK_SIZE))                                              \
+            for (run_t* run = &chunk->spans[CHUNK_HEADER_PAGES]; run < &chunk->spans[CHUNK_PAGES];       \
+                 run += run->pages)
+
+
+/**
+ * @macro: GET_SLAB_CLASS(size)
+ * @brief: gets the slab class of a size of at most SLAB_MAX_SIZE, in O(1).
+ */
+#define GET_SLAB_CLASS(size) (slab_class_table.class_of[((size) + SLAB_SPACING - 1) / SLAB_SPACING])
+
+
+/**
+ * @macro: GET_SLAB(ptr)
+ * @brief: get the slab of a slot (the start of its page).
+ */
+#define GET_SLAB(ptr) ((slab_t*)((uintptr_t)(ptr) & ~(uintptr_t)(SLAB_SIZE - 1)))
+
+
+/**
+ * @macro: IS_SLAB_PTR(ptr)
+ * @brief: true if the pointer is inside the page region (a slab's slot).
+ */
+#define IS_SLAB_PTR(ptr) (page_region_start != nullptr && (uintptr_t)(ptr) - (uintptr_t)page_region_start < PAGE_REGION_SIZE)
+
+
+/**
+ * @macro: GET_REGION_PAGE_INDEX(page) / IS_PAGE_PURGED(page)
+ * @brief: the index of a page of the page region, and whether the scavenger gave it back to
+ *         the OS (see purge_free_pages).
+ */
+#define GET_REGION_PAGE_INDEX(page) ((size_t)((char*)(page) - page_region_start) / MALLOC_PAGE_SIZE)
+#define IS_PAGE_PURGED(page)        ((purged_pages_map[GET_REGION_PAGE_INDEX(page) / 64] >> (GET_REGION_PAGE_INDEX(page) % 64)) & 1)
+
+
+/**
+ * @macro: PAGE_REGION_FOR_EACH(slab)
+ * @brief: iterate over the pages of the page region that were ever used (free pages included,
+ *         but not the ones given back to the OS, their header is gone).
+ */
+#define PAGE_REGION_FOR_EACH(slab)                                                      \
+        for (slab_t* slab = (slab_t*)page_region_start; (char*)slab < page_region_top;   \
+             slab = (slab_t*)((char*)slab + SLAB_SIZE))                                  \
+            if (!IS_PAGE_PURGED(slab))
+
+
+
+/**
+ * @macro: GET_BIN_ENTRY(size)
+ * @brief: gets the matching bin entry from its size.
+ *         sizes under 1KB get their own small bin (SMALL_BIN_SPACING bytes wide),
+ *         larger sizes go to their medium bin (size class), after the small bins.
+ */
+#define GET_BIN_ENTRY(size) \
+        ((size) < KB ? (int)((size) / SMALL_BIN_SPACING) : SMALL_BIN_COUNT + get_medium_bin_entry(size))
+
+
+/**
+ * @macro: IS_SMALL_BIN(entry)
+ * @brief: returns true if the bin entry is one of the small (unsorted) bins.
+ */
+#define IS_SMALL_BIN(entry) ((entry) < SMALL_BIN_COUNT)
+
+
+/**
+ * @macro: SET_BIN_MAP_BIT(arena, entry) / CLEAR_BIN_MAP_BIT(arena, entry)
+ * @brief: mark the bin entry as non empty / empty in the arena's bins bitmap.
+ */
+#define SET_BIN_MAP_BIT(arena, entry)   ((arena)->free_block_bin_map[(entry) / BIN_MAP_WORD_BITS] |= (uint64_t)1 << ((entry) % BIN_MAP_WORD_BITS))
+#define CLEAR_BIN_MAP_BIT(arena, entry) ((arena)->free_block_bin_map[(entry) / BIN_MAP_WORD_BITS] &= ~((uint64_t)1 << ((entry) % BIN_MAP_WORD_BITS)))
+
+
+/**
+ * @macro: IS_LARGE_ENOUGH(entire_block_size, needed_size)
+ * @brief: returns true if entire_block_size large enough to fit needed_size.
+ */
+#define IS_LARGE_ENOUGH(entire_block_size, needed_size) \
+        ((entire_block_size) >= (needed_size) + sizeof(malloc_metadata_t) + 128)
+
+
+/**
+ * @macro: SET_CACHE_BIN_COUNT(bin, _count)
+ * @brief: set the # of slots of a cache's bin. _num_cached_bytes() reads the counts of the
+ *         other threads' caches, so it's a relaxed atomic store (a plain store on x86).
+ */
+#define SET_CACHE_BIN_COUNT(bin, _count) __atomic_store_n(&(bin)->count, (_count), __ATOMIC_RELAXED)
+
+
+/**
+ * @macro: CPU_BIN_HEAD(list) / CPU_BIN_COUNT(list) / CPU_BIN_LIST(head, count)
+ * @brief: the first slot and the # of slots of a CPU cache's bin list, and the list of both
+ *         (user addresses fit in 48 bits).
+ */
+#define CPU_BIN_COUNT_SHIFT 48
+#define CPU_BIN_HEAD(list)          ((void*)(uintptr_t)((list) & (((uint64_t)1 << CPU_BIN_COUNT_SHIFT) - 1)))
+#define CPU_BIN_COUNT(list)         ((uint32_t)((list) >> CPU_BIN_COUNT_SHIFT))
+#define CPU_BIN_LIST(head, count)   ((uint64_t)(uintptr_t)(head) | ((uint64_t)(count) << CPU_BIN_COUNT_SHIFT))
+
+
+/**
+ * @macro: CPU_BIN_PUSHED / CPU_BIN_FULL / CPU_BIN_ABORTED / CPU_BIN_RETRY
+ * @brief: what a push on a CPU cache's bin did, and the slot a pop returns when the thread must
+ *         retry (it left the CPU or the cache is stopped, see cpu_cache_stop).
+ */
+#define CPU_BIN_PUSHED  0
+#define CPU_BIN_FULL    1
+#define CPU_BIN_ABORTED 2
+#define CPU_BIN_RETRY   ((void*)1)
+
+
+/**
+ * @macro: SPOOL_GET_PTR(top)
+ * @brief: returns the object a pool's tagged top points to (user addresses fit in 48 bits).
+ */
+#define SPOOL_GET_PTR(top) ((void*)(uintptr_t)((top) & (((uint64_t)1 << SPOOL_TAG_SHIFT) - 1)))
+
+
+/**
+ * @macro: SPOOL_TAGGED(ptr, top)
+ * @brief: returns the tagged top that replaces top with ptr (the tag is top's plus one).
+ */
+#define SPOOL_TAGGED(ptr, top) ((uint64_t)(uintptr_t)(ptr) | ((((top) >> SPOOL_TAG_SHIFT) + 1) << SPOOL_TAG_SHIFT))
+
+
+// global arenas (arena 0 is the sbrk heap) and the # of threads that took one
+static arena_t arenas[ARENA_COUNT] = {};
+static size_t arena_threads = 0;
+
+// global counters of the blocks from mmap, and of their reserved huge pages (MAP_HUGETLB)
+static size_t mmap_blocks_count = 0;
+static size_t mmap_bytes_count = 0;
+static size_t huge_pages_count = 0;
+
+// global page region (reserved once with mmap) the slabs are carved from, its released pages
+// (linked in the page), and the released pages the scavenger gave back to the OS (a bitmap by
+// page, their memory is gone, and the first word of the map that may have a bit set)
+static char* page_region_start = nullptr;
+static char* page_region_top = nullptr;
+static void* free_pages = nullptr;
+static uint64_t purged_pages_map[PAGE_REGION_PAGES / 64] = {};
+static size_t purged_pages_count = 0;
+static size_t purged_pages_hint = 0;
+
+// global lists of the slabs with free slots, per slab class
+static slab_t* slab_partial[SLAB_CLASS_COUNT] = {};
+
+// global remote frees: per slab class, run class (and arena, see arena_t) the blocks free'd
+// while the lock was taken, drained by the next allocation or free that takes it
+static void* slab_remote_frees[SLAB_CLASS_COUNT] = {};
+static void* run_remote_frees[RUN_CLASS_COUNT] = {};
+static void* mmap_remote_frees = nullptr;
+static size_t remote_frees_count = 0;
+
+// global run region (reserved once with mmap) the chunks are carved from
+static char* run_region_start = nullptr;
+static char* run_region_top = nullptr;
+
+// global lists of the runs with free slots, per run class
+static run_t* run_partial[RUN_CLASS_COUNT] = {};
+
+// global lists of the chunks' free spans, per # of pages, and the bitmap of the non empty ones
+// (under the growth lock)
+static run_t* free_spans[FREE_SPAN_LISTS] = {};
+static uint64_t free_spans_map[FREE_SPAN_MAP_WORDS] = {};
+
+// global locks: one per slab class and per run class (the class's list and its slabs / runs)
+// and one for the growth (sbrk, the regions' pages and chunks, the mmap counters), every arena,
+// CPU cache and transfer cache has its own, and the list of thread caches too. The list's lock
+// may be held when taking any other, a CPU cache's lock when taking a transfer cache or a class
+// lock, and a class or an arena lock when taking the growth lock.
+static malloc_lock_t slab_locks[SLAB_CLASS_COUNT];
+static malloc_lock_t run_locks[RUN_CLASS_COUNT];
+static malloc_lock_t growth_lock;
+static pthread_once_t malloc_once = PTHREAD_ONCE_INIT;
+
+// set once init_malloc is done, and while fork_prepare holds every lock: when the dispatcher
+// picked another engine, malloc_4 is never initialized and fork leaves it alone
+static bool malloc_initialized = false;
+static bool fork_locked = false;
+
+// the calling thread's cache, flushed when the thread exits by tcache_key's destructor, and
+// the list of the threads' caches (under tcache_list_lock)
+static thread_local tcache_t tcache = {};
+static pthread_key_t tcache_key;
+static tcache_t* tcache_list = nullptr;
+static malloc_lock_t tcache_list_lock;
+
+// global per CPU caches (-DMALLOC_4_PERCPU_CACHE), by the rseq area's CPU (or sched_getcpu() %
+// CPU_CACHE_COUNT without rseq), and whether their hot path is made of restartable sequences
+static cpu_cache_t cpu_caches[CPU_CACHE_COUNT];
+static bool use_rseq = false;
+
+// global transfer caches, per slab class
+static transfer_cache_t transfer_caches[SLAB_CLASS_COUNT];
+
+// global scavenger state
+static bool use_membarrier = false;
+static uint64_t scavenge_last_ms = 0;
+static size_t scavenges_count = 0;
+static size_t scavenged_blocks_count = 0;
+
+// the calling thread's arena (taken on its first heap allocation)
+static thread_local arena_t* thread_arena = nullptr;
+
+
+
+/**
+ * @function:   static void lock(malloc_lock_t* to_lock)
+ * @brief:      take the lock, counting a contention if some other thread holds it.
+ */
+static void lock(malloc_lock_t* to_lock)
+{
+    if (pthread_mutex_trylock(&to_lock->mutex) != 0)
+    {
+        pthread_mutex_lock(&to_lock->mutex);
+        to_lock->contentions++;
+    }
+}
+
+
+
+/**
+ * @function:   static void unlock(malloc_lock_t* to_unlock)
+ * @brief:      release the lock.
+ */
+static void unlock(malloc_lock_t* to_unlock)
+{
+    pthread_mutex_unlock(&to_unlock->mutex);
+}
+
+
+
+/**
+ * @function:   static bool try_lock(malloc_lock_t* to_lock)
+ * @brief:      take the lock only if no other thread holds it (no contention is counted).
+ * 
+ * @returns:
+ *     true if the lock was taken.
+ */
+static bool try_lock(malloc_lock_t* to_lock)
+{
+    return pthread_mutex_trylock(&to_lock->mutex) == 0;
+}
+
+
+
+/**
+ * @function:   static void remote_push_list(void** list, void* first, void* last)
+ * @brief:      push the blocks first..last (linked by their first words) to a remote frees
+ *              list, lock free.
+ */
+static void remote_push_list(void** list, void* first, void* last)
+{
+    void* head = __atomic_load_n(list, __ATOMIC_RELAXED);
+    do
+    {
+        *(void**)last = head;
+    } while (!__atomic_compare_exchange_n(list, &head, first, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+
+/**
+ * @function:   static void remote_push(void** list, void* p)
+ * @brief:      push a free'd block to a remote frees list, lock free (one CAS unless another
+ *              thread pushes at the same time). The link is kept in the block's first word.
+ */
+static void remote_push(void** list, void* p)
+{
+    remote_push_list(list, p, p);
+    __atomic_fetch_add(&remote_frees_count, 1, __ATOMIC_RELAXED);
+}
+
+
+
+/**
+ * @function:   static void* remote_take(void** list)
+ * @brief:      take the whole remote frees list at once (one atomic exchange, none if it's empty).
+ * 
+ * @returns:
+ *     the first block of the list (nullptr if it's empty).
+ */
+static void* remote_take(void** list)
+{
+    if (__atomic_load_n(list, __ATOMIC_RELAXED) == nullptr)
+    {
+        return nullptr;
+    }
+    return __atomic_exchange_n(list, nullptr, __ATOMIC_ACQUIRE);
+}
+
+
+
+/**
+ * @function:   static void lock_all()
+ * @brief:      take every lock (in the locks' order: thread caches list, CPU caches, transfer
+ *              caches, classes, arenas, growth).
+ */
+static void lock_all()
+{
+    lock(&tcache_list_lock);
+    for (int i = 0; i < CPU_CACHE_COUNT; i++)
+    {
+        lock(&cpu_caches[i].lock);
+    }
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+    {
+        lock(&transfer_caches[i].lock);
+    }
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+    {
+        lock(&slab_locks[i]);
+    }
+    for (int i = 0; i < RUN_CLASS_COUNT; i++)
+    {
+        lock(&run_locks[i]);
+    }
+    for (int i = 0; i < ARENA_COUNT; i++)
+    {
+        lock(&arenas[i].lock);
+    }
+    lock(&growth_lock);
+}
+
+
+
+/**
+ * @function:   static void unlock_all()
+ * @brief:      release every lock.
+ */
+static void unlock_all()
+{
+    unlock(&growth_lock);
+    for (int i = ARENA_COUNT - 1; i >= 0; i--)
+    {
+        unlock(&arenas[i].lock);
+    }
+    for (int i = RUN_CLASS_COUNT - 1; i >= 0; i--)
+    {
+        unlock(&run_locks[i]);
+    }
+    for (int i = SLAB_CLASS_COUNT - 1; i >= 0; i--)
+    {
+        unlock(&slab_locks[i]);
+    }
+    for (int i = SLAB_CLASS_COUNT - 1; i >= 0; i--)
+    {
+        unlock(&transfer_caches[i].lock);
+    }
+    for (int i = CPU_CACHE_COUNT - 1; i >= 0; i--)
+    {
+        unlock(&cpu_caches[i].lock);
+    }
+    unlock(&tcache_list_lock);
+}
+
+
+
+/**
+ * @function:   MallocMetadata* get_next_block(MallocMetadata* block)
+ * @brief:      get the block right after block (by address), in O(1)
+ * 
+ * @returns:
+ *     - Success: a pointer to the next block.
+ *
+ *     - Failure:
+ *          If block is the last block of its segment, returns nullptr.
+ */
+static MallocMetadata* get_next_block(MallocMetadata* block)
+{
+    MallocMetadata* next = GET_NEXT_METADATA(block);
+    return IS_FENCE(next) ? nullptr : next;
+}
+
+
+
+/**
+ * @function:   MallocMetadata* get_prev_free_block(MallocMetadata* block)
+ * @brief:      get the block right before block (by address) if it's free, using its footer (prev_size)
+ * 
+ * @returns:
+ *     - Success: a pointer to the previous block.
+ *
+ *     - Failure:
+ *          If the previous block is allocated (or block is first), returns nullptr.
+ */
+static MallocMetadata* get_prev_free_block(MallocMetadata* block)
+{
+    if (IS_PREV_IN_USE(block))
+    {
+        return nullptr;
+    }
+    return (MallocMetadata*)((intptr_t)block - block->prev_size - sizeof(malloc_metadata_t));
+}
+
+
+
+/**
+ * @function:   void set_block_is_free(MallocMetadata* block, bool is_free)
+ * @brief:      mark the block as free (writing its footer) or allocated, and let the
+ *              header after it know
+ */
+static void set_block_is_free(MallocMetadata* block, bool is_free)
+{
+    MallocMetadata* next = GET_NEXT_METADATA(block);
+    SET_METADATA_FLAG(block, BLOCK_IS_FREE, is_free);
+    if (is_free)
+    {
+        next->prev_size = GET_METADATA_SIZE(block);
+    }
+    SET_METADATA_FLAG(next, BLOCK_PREV_IN_USE, !is_free);
+}
+
+
+
+/**
+ * @function:   void tree_replace_child(MallocMetadata** root, MallocMetadata* parent, MallocMetadata* old_child, MallocMetadata* new_child)
+ * @brief:      make new_child take old_child's place under parent (or as the root)
+ */
+static void tree_replace_child(MallocMetadata** root, MallocMetadata* parent, MallocMetadata* old_child, MallocMetadata* new_child)
+{
+    if (parent == nullptr)
+    {
+        *root = new_child;
+    }
+    else if (GET_TREE_NODE(parent)->left == old_child)
+    {
+        GET_TREE_NODE(parent)->left = new_child;
+    }
+    else
+    {
+        GET_TREE_NODE(parent)->right = new_child;
+    }
+    if (new_child)
+    {
+        GET_TREE_NODE(new_child)->parent = parent;
+    }
+}
+
+
+
+/**
+ * @function:   void tree_rotate(MallocMetadata** root, MallocMetadata* block, bool left)
+ * @brief:      rotate the subtree of block to the left (its right child goes up) or right
+ */
+static void tree_rotate(MallocMetadata** root, MallocMetadata* block, bool left)
+{
+    free_tree_node_t* node = GET_TREE_NODE(block);
+    MallocMetadata* up = left ? node->right : node->left;
+    free_tree_node_t* up_node = GET_TREE_NODE(up);
+    MallocMetadata* moved = left ? up_node->left : up_node->right;
+
+    if (left)
+    {
+        node->right = moved;
+        up_node->left = block;
+    }
+    else
+    {
+        node->left = moved;
+        up_node->right = block;
+    }
+    if (moved)
+    {
+        GET_TREE_NODE(moved)->parent = block;
+    }
+    tree_replace_child(root, node->parent, block, up);
+    node->parent = up;
+}
+
+
+
+/**
+ * @function:   void tree_insert(MallocMetadata** root, MallocMetadata* new_block)
+ * @brief:      insert a free block into a red-black tree
+ * 
+ * @arguments:
+ *     - MallocMetadata** root: pointer to the tree's root
+ *     - MallocMetadata* new_block: block to insert
+ */
+static void tree_insert(MallocMetadata** root, MallocMetadata* new_block)
+{
+    free_tree_node_t* node = GET_TREE_NODE(new_block);
+    MallocMetadata* parent = nullptr;
+    MallocMetadata** link = root;
+    while (*link)
+    {
+        parent = *link;
+        link = IS_TREE_NODE_LESS(new_block, parent) ? &GET_TREE_NODE(parent)->left : &GET_TREE_NODE(parent)->right;
+    }
+    node->left = nullptr;
+    node->right = nullptr;
+    node->parent = parent;
+    node->is_red = true;
+    *link = new_block;
+
+    // fix a red node with a red parent, going up
+    MallocMetadata* block = new_block;
+    while (IS_TREE_NODE_RED(GET_TREE_NODE(block)->parent))
+    {
+        MallocMetadata* parent_block = GET_TREE_NODE(block)->parent;
+        MallocMetadata* grand = GET_TREE_NODE(parent_block)->parent;
+        bool parent_is_left = (GET_TREE_NODE(grand)->left == parent_block);
+        MallocMetadata* uncle = parent_is_left ? GET_TREE_NODE(grand)->right : GET_TREE_NODE(grand)->left;
+        if (IS_TREE_NODE_RED(uncle))
+        {
+            GET_TREE_NODE(parent_block)->is_red = false;
+            GET_TREE_NODE(uncle)->is_red = false;
+            GET_TREE_NODE(grand)->is_red = true;
+            block = grand;
+            continue;
+        }
+        if (block == (parent_is_left ? GET_TREE_NODE(parent_block)->right : GET_TREE_NODE(parent_block)->left))
+        {
+            tree_rotate(root, parent_block, parent_is_left);
+            block = parent_block;
+            parent_block = GET_TREE_NODE(block)->parent;
+        }
+        GET_TREE_NODE(parent_block)->is_red = false;
+        GET_TREE_NODE(grand)->is_red = true;
+        tree_rotate(root, grand, !parent_is_left);
+    }
+    GET_TREE_NODE(*root)->is_red = false;
+}
+
+
+
+/**
+ * @function:   void tree_remove(MallocMetadata** root, MallocMetadata* to_del)
+ * @brief:      delete a free block from a red-black tree
+ * 
+ * @arguments:
+ *     - MallocMetadata** root: pointer to the tree's root
+ *     - MallocMetadata* to_del: block to delete
+ */
+static void tree_remove(MallocMetadata** root, MallocMetadata* to_del)
+{
+    free_tree_node_t* node = GET_TREE_NODE(to_del);
+    MallocMetadata* child;
+    MallocMetadata* child_parent;
+    bool removed_red = node->is_red;
+
+    if (node->left == nullptr || node->right == nullptr)
+    {
+        child = node->left ? node->left : node->right;
+        child_parent = node->parent;
+        tree_replace_child(root, node->parent, to_del, child);
+    }
+    else
+    {
+        // the successor (leftmost of the right subtree) takes to_del's place
+        MallocMetadata* successor = node->right;
+        while (GET_TREE_NODE(successor)->left)
+        {
+            successor = GET_TREE_NODE(successor)->left;
+        }
+        free_tree_node_t* succ_node = GET_TREE_NODE(successor);
+        removed_red = succ_node->is_red;
+        child = succ_node->right;
+        if (succ_node->parent == to_del)
+        {
+            child_parent = successor;
+        }
+        else
+        {
+            child_parent = succ_node->parent;
+            tree_replace_child(root, succ_node->parent, successor, child);
+            succ_node->right = node->right;
+            GET_TREE_NODE(succ_node->right)->parent = successor;
+        }
+        tree_replace_child(root, node->parent, to_del, successor);
+        succ_node->left = node->left;
+        GET_TREE_NODE(succ_node->left)->parent = successor;
+        succ_node->is_red = node->is_red;
+    }
+
+    // a black node was taken out, fix the missing black going up
+    while (!removed_red && child != *root && !IS_TREE_NODE_RED(child))
+    {
+        free_tree_node_t* parent_node = GET_TREE_NODE(child_parent);
+        bool child_is_left = (parent_node->left == child);
+        MallocMetadata* sibling = child_is_left ? parent_node->right : parent_node->left;
+        if (IS_TREE_NODE_RED(sibling))
+        {
+            GET_TREE_NODE(sibling)->is_red = false;
+            parent_node->is_red = true;
+            tree_rotate(root, child_parent, child_is_left);
+            sibling = child_is_left ? parent_node->right : parent_node->left;
+        }
+        free_tree_node_t* sib_node = GET_TREE_NODE(sibling);
+        MallocMetadata* near = child_is_left ? sib_node->left : sib_node->right;
+        MallocMetadata* far = child_is_left ? sib_node->right : sib_node->left;
+        if (!IS_TREE_NODE_RED(near) && !IS_TREE_NODE_RED(far))
+        {
+            sib_node->is_red = true;
+            child = child_parent;
+            child_parent = parent_node->parent;
+            continue;
+        }
+        if (!IS_TREE_NODE_RED(far))
+        {
+            GET_TREE_NODE(near)->is_red = false;
+            sib_node->is_red = true;
+            tree_rotate(root, sibling, !child_is_left);
+            sibling = child_is_left ? parent_node->right : parent_node->left;
+            sib_node = GET_TREE_NODE(sibling);
+            far = child_is_left ? sib_node->right : sib_node->left;
+        }
+        sib_node->is_red = parent_node->is_red;
+        parent_node->is_red = false;
+        GET_TREE_NODE(far)->is_red = false;
+        tree_rotate(root, child_parent, child_is_left);
+        child = *root;
+        break;
+    }
+    if (child)
+    {
+        GET_TREE_NODE(child)->is_red = false;
+    }
+}
+
+
+
+/**
+ * @function:   MallocMetadata* tree_best_fit(MallocMetadata* root, size_t size)
+ * @brief:      find the smallest block of at least size bytes in a tree (lowest address on ties)
+ * 
+ * @returns:
+ *     - Success: a pointer to the matching block.
+ *
+ *     - Failure:
+ *          If every block in the tree is too small, returns nullptr.
+ */
+static MallocMetadata* tree_best_fit(MallocMetadata* root, size_t size)
+{
+    MallocMetadata* best = nullptr;
+    MallocMetadata* block = root;
+    while (block)
+    {
+        if (GET_METADATA_SIZE(block) >= size)
+        {
+            best = block;
+            block = GET_TREE_NODE(block)->left;
+        }
+        else
+        {
+            block = GET_TREE_NODE(block)->right;
+        }
+    }
+    return best;
+}
+
+
+
+/**
+ * @function:   int get_next_non_empty_bin(arena_t* arena, int entry)
+ * @brief:      find the first non empty bin from entry and up, using the bins bitmap
+ *              (one count-trailing-zeros per bitmap word).
+ * 
+ * @returns:
+ *     - Success: the bin entry.
+ *
+ *     - Failure:
+ *          If all the bins from entry and up are empty, returns BIN_SIZE.
+ */
+static int get_next_non_empty_bin(arena_t* arena, int entry)
+{
+    for (int word = entry / BIN_MAP_WORD_BITS; word < BIN_MAP_WORDS; word++)
+    {
+        uint64_t bits = arena->free_block_bin_map[word];
+        if (word == entry / BIN_MAP_WORD_BITS)
+        {
+            bits &= ~(uint64_t)0 << (entry % BIN_MAP_WORD_BITS);
+        }
+        if (bits)
+        {
+            return word * BIN_MAP_WORD_BITS + __builtin_ctzll(bits);
+        }
+    }
+    return BIN_SIZE;
+}
+
+
+
+/**
+ * @function:   void insert_block_to_bin_before(arena_t* arena, MallocMetadata* new_block, MallocMetadata* block, int entry)
+ * @brief:      link new_block into the bin entry, right before block (or last if block is nullptr)
+ */
+static void insert_block_to_bin_before(arena_t* arena, MallocMetadata* new_block, MallocMetadata* block, int entry)
+{
+    MallocMetadata* prev = block ? GET_LIST_NODE(block)->prev : arena->free_block_bin_tail[entry];
+    GET_LIST_NODE(new_block)->next = block;
+    GET_LIST_NODE(new_block)->prev = prev;
+    if (prev)
+    {
+        GET_LIST_NODE(prev)->next = new_block;
+    }
+    else
+    {
+        arena->free_block_bin[entry] = new_block;
+        SET_BIN_MAP_BIT(arena, entry);
+    }
+    if (block)
+    {
+        GET_LIST_NODE(block)->prev = new_block;
+    }
+    else
+    {
+        arena->free_block_bin_tail[entry] = new_block;
+    }
+}
+
+
+
+/**
+ * @function:   void remove_from_bin(arena_t* arena, MallocMetadata* to_del)
+ * @brief:      delete metadata from the right bin
+ * 
+ * @arguments:
+ *     - MallocMetadata* to_del: block to delete
+ */
+static void remove_from_bin(arena_t* arena, MallocMetadata* to_del)
+{
+    int entry = GET_BIN_ENTRY(GET_METADATA_SIZE(to_del));
+    if (!IS_SMALL_BIN(entry))
+    {
+        tree_remove(&arena->free_block_bin[entry], to_del);
+        if (!arena->free_block_bin[entry])
+        {
+            CLEAR_BIN_MAP_BIT(arena, entry);
+        }
+        return;
+    }
+    free_list_node_t* node = GET_LIST_NODE(to_del);
+    if (node->prev)
+    {
+        GET_LIST_NODE(node->prev)->next = node->next;
+    }
+    else
+    {
+        arena->free_block_bin[entry] = node->next;
+        if (!node->next)
+        {
+            CLEAR_BIN_MAP_BIT(arena, entry);
+        }
+    }
+    if (node->next)
+    {
+        GET_LIST_NODE(node->next)->prev = node->prev;
+    }
+    else
+    {
+        arena->free_block_bin_tail[entry] = node->prev;
+    }
+    return;
+}
+
+
+
+/**
+ * @function:   void insert_block_to_bin(arena_t* arena, MallocMetadata* new_block)
+ * @brief:      mark the block as free and insert it into its bin.
+ *              small bins hold a single size (SMALL_BIN_SPACING is the alignment), the block
+ *              is pushed first. medium bins are red-black trees (O(log n) insertion).
+ * 
+ * @arguments:
+ *     - MallocMetadata* new_block: block to insert
+ */
+static void insert_block_to_bin(arena_t* arena, MallocMetadata* new_block)
+{
+    int entry = GET_BIN_ENTRY(GET_METADATA_SIZE(new_block));
+    set_block_is_free(new_block, true);
+    if (IS_SMALL_BIN(entry))
+    {
+        insert_block_to_bin_before(arena, new_block, arena->free_block_bin[entry], entry);
+        return;
+    }
+    tree_insert(&arena->free_block_bin[entry], new_block);
+    SET_BIN_MAP_BIT(arena, entry);
+}
+
+
+
+/**
+ * @function:   MallocMetadata* free_block(arena_t* arena, MallocMetadata* block)
+ * @brief:      release a block (that is in no bin) into the bins, merging it in one pass with
+ *              the free blocks right after and right before it.
+ * 
+ * @returns:
+ *     the (merged) free block.
+ */
+static MallocMetadata* free_block(arena_t* arena, MallocMetadata* block)
+{
+    MallocMetadata* next = get_next_block(block);
+    if (next && GET_METADATA_IS_FREE(next))
+    {
+        remove_from_bin(arena, next);
+        SET_METADATA_SIZE(block, GET_METADATA_SIZE(block) + GET_METADATA_SIZE(next) + sizeof(malloc_metadata_t));
+    }
+
+    MallocMetadata* prev = get_prev_free_block(block);
+    if (prev)
+    {
+        remove_from_bin(arena, prev);
+        SET_METADATA_SIZE(prev, GET_METADATA_SIZE(prev) + GET_METADATA_SIZE(block) + sizeof(malloc_metadata_t));
+        block = prev;
+    }
+    insert_block_to_bin(arena, block);
+    return block;
+}
+
+
+
+/**
+ * @function:   void cut_block(arena_t* arena, MallocMetadata* block, size_t size)
+ * @brief:      split an allocated block into two according to the size,
+ *              the remainder is free'd (and merged with a free block after it).
+ * 
+ * @arguments:
+ *     - size_t size:           # of bytes to keep in block.
+ *     - MallocMetadata* block: block to split
+ */
+static void cut_block(arena_t* arena, MallocMetadata* block, size_t size)
+{
+    MallocMetadata* new_block = (MallocMetadata*)((intptr_t)block + size + sizeof(malloc_metadata_t));
+    INIT_METADATA(new_block, GET_METADATA_SIZE(block) - size - sizeof(malloc_metadata_t), BLOCK_PREV_IN_USE);
+    SET_METADATA_SIZE(block, size);
+    free_block(arena, new_block);
+}
+
+
+
+/**
+ * @function:   static MallocMetadata* use_free_block(arena_t* arena, MallocMetadata* block, size_t size)
+ * @brief:      take a free block out of its bin for an allocation of size bytes
+ *              (splitting it if it's large enough).
+ */
+static MallocMetadata* use_free_block(arena_t* arena, MallocMetadata* block, size_t size)
+{
+    remove_from_bin(arena, block);
+    set_block_is_free(block, false);
+    if (IS_LARGE_ENOUGH(GET_METADATA_SIZE(block), size))
+    {
+        cut_block(arena, block, size);
+    }
+    return block;
+}
+
+
+
+/**
+ * @function:   static void* get_free_metadata_block(arena_t* arena, size_t size)
+ * @brief:      search for suitable block from the bins (when block.size large enough).
+ *              only the size's own bin may hold blocks that are too small: a small bin is
+ *              checked in O(1) and a medium bin's tree is searched for the best fit. Every
+ *              block of the bigger bins fits, so the smallest block of the next non empty one
+ *              (found in the bins bitmap) is used.
+ * 
+ * @arguments:
+ *     - size_t size: # of bytes to find in blocks.
+ * 
+ * @returns:
+ *     - Success: a pointer to the matching block.
+ *
+ *     - Failure:
+ *          If no suitable block was found, returns nullptr.
+ */
+static MallocMetadata* get_free_metadata_block(arena_t* arena, size_t size)
+{
+    int entry = GET_BIN_ENTRY(size);
+    MallocMetadata* found = nullptr;
+    if (IS_SMALL_BIN(entry))
+    {
+        // every block of a small bin has the same size
+        found = arena->free_block_bin[entry];
+    }
+    else
+    {
+        found = tree_best_fit(arena->free_block_bin[entry], size);
+    }
+    if (found && GET_METADATA_SIZE(found) >= size)
+    {
+        return use_free_block(arena, found, size);
+    }
+
+    int next = get_next_non_empty_bin(arena, entry + 1);
+    if (next >= BIN_SIZE)
+    {
+        return nullptr;
+    }
+    if (IS_SMALL_BIN(next))
+    {
+        return use_free_block(arena, arena->free_block_bin[next], size);
+    }
+    return use_free_block(arena, tree_best_fit(arena->free_block_bin[next], size), size);
+}
+
+
+
+/**
+ * @function:   static MallocMetadata* get_last_free_block(arena_t* arena)
+ * @brief:      get the wilderness block (last block of the last segment) if it's free, in O(1).
+ * 
+ * @returns:
+ *     - Success: a pointer to the wilderness block.
+ *
+ *     - Failure:
+ *          If there is no wilderness block or it's allocated, returns nullptr.
+ */
+static MallocMetadata* get_last_free_block(arena_t* arena)
+{
+    if (arena->heap_segments_count == 0)
+    {
+        return nullptr;
+    }
+    return get_prev_free_block(arena->heap_segments[arena->heap_segments_count - 1].fence);
+}
+
+
+
+/**
+ * @function:   static char* grow_arena(arena_t* arena, char* expected_break, size_t size)
+ * @brief:      move the arena's break (the program break for arena 0, or its region's break
+ *              while it has room with -DMALLOC_4_THP_HEAP) size bytes up, if it's at
+ *              expected_break (or anywhere if expected_break is nullptr).
+ * 
+ * @returns:
+ *     - Success: the old break (the start of the new memory).
+ *
+ *     - Failure:
+ *          If the break is not at expected_break, sbrk fails or the arena's region is full,
+ *          returns nullptr (and nothing changes).
+ */
+static char* grow_arena(arena_t* arena, char* expected_break, size_t size)
+{
+    char* ret = nullptr;
+    if (arena->region_start && (expected_break == nullptr || arena->region_top == expected_break) &&
+        size <= (size_t)(arena->region_start + ARENA_REGION_SIZE - arena->region_top))
+    {
+        ret = arena->region_top;
+        arena->region_top += size;
+    }
+    else if (arena == &arenas[0])
+    {
+        lock(&growth_lock);
+        if (expected_break == nullptr || sbrk(0) == expected_break)
+        {
+            // a new segment starts MALLOC_ALIGNMENT aligned (sbrk(0) may not be)
+            size_t pad = expected_break ? 0 : (MALLOC_ALIGNMENT - (uintptr_t)sbrk(0) % MALLOC_ALIGNMENT) % MALLOC_ALIGNMENT;
+            ret = (char*)sbrk(size + pad);
+            ret = ((intptr_t)ret == SBRK_FAIL) ? nullptr : ret + pad;
+        }
+        unlock(&growth_lock);
+    }
+    return ret;
+}
+
+
+
+/**
+ * @function:   static bool extend_last_block(arena_t* arena, MallocMetadata* last, size_t size)
+ * @brief:      grow the last block of the arena's last segment to size bytes by moving the
+ *              arena's break (and the fence after it).
+ * 
+ * @returns:
+ *     - Success: true.
+ *
+ *     - Failure:
+ *          If last is not the last block, the program break was moved by someone else or
+ *          the arena can't grow, returns false (and nothing changes).
+ */
+static bool extend_last_block(arena_t* arena, MallocMetadata* last, size_t size)
+{
+    heap_segment_t* segment = &arena->heap_segments[arena->heap_segments_count - 1];
+    if (GET_NEXT_METADATA(last) != segment->fence ||
+        !grow_arena(arena, (char*)segment->fence + sizeof(malloc_metadata_t), size - GET_METADATA_SIZE(last)))
+    {
+        return false;
+    }
+    SET_METADATA_SIZE(last, size);
+    segment->fence = GET_NEXT_METADATA(last);
+    INIT_METADATA(segment->fence, 0, GET_METADATA_IS_FREE(last) ? 0 : BLOCK_PREV_IN_USE);
+    segment->fence->prev_size = GET_METADATA_SIZE(last);
+    return true;
+}
+
+
+
+/**
+ * @function:   static MallocMetadata* sbrk_new_block(arena_t* arena, size_t size)
+ * @brief:      allocate a new block at the arena's break. The block takes the place of the last
+ *              segment's fence, or starts a new segment if the break was moved by someone else.
+ * 
+ * @returns:
+ *     - Success: a pointer to the new (allocated) block.
+ *
+ *     - Failure:
+ *          If the arena can't grow (or there are too many segments), returns nullptr.
+ */
+static MallocMetadata* sbrk_new_block(arena_t* arena, size_t size)
+{
+    heap_segment_t* segment = arena->heap_segments_count ? &arena->heap_segments[arena->heap_segments_count - 1] : nullptr;
+    char* ret = nullptr;
+    if (segment)
+    {
+        ret = grow_arena(arena, (char*)segment->fence + sizeof(malloc_metadata_t), size + sizeof(malloc_metadata_t));
+    }
+    bool contiguous = (ret != nullptr);
+    if (!contiguous && arena->heap_segments_count < MAX_HEAP_SEGMENTS)
+    {
+        ret = grow_arena(arena, nullptr, size + 2 * sizeof(malloc_metadata_t));
+    }
+    if (ret == nullptr)
+    {
+        return nullptr;
+    }
+
+    MallocMetadata* block;
+    if (contiguous)
+    {
+        block = segment->fence;
+        INIT_METADATA(block, size, block->size_flags & BLOCK_PREV_IN_USE);
+    }
+    else
+    {
+        block = (MallocMetadata*)ret;
+        INIT_METADATA(block, size, BLOCK_PREV_IN_USE);
+        segment = &arena->heap_segments[arena->heap_segments_count++];
+        segment->first = block;
+    }
+    segment->fence = GET_NEXT_METADATA(block);
+    INIT_METADATA(segment->fence, 0, BLOCK_PREV_IN_USE);
+    return block;
+}
+
+
+
+
+/**
+ * @function:   static char* reserve_region(size_t size, size_t alignment)
+ * @brief:      reserve size bytes of address space (pages are only backed when touched),
+ *              aligned to alignment (a power of two, at least a page). With -DMALLOC_4_THP_HEAP
+ *              the region starts on a huge page boundary and is advised with MADV_HUGEPAGE.
+ * 
+ * @returns:
+ *     - Success: a pointer to the region.
+ *
+ *     - Failure:
+ *          If mmap fails, returns nullptr.
+ */
+static char* reserve_region(size_t size, size_t alignment)
+{
+    if (USE_THP_HEAP)
+    {
+        alignment = MMAX(alignment, HUGE_PAGE_SIZE);
+    }
+    void* ret = mmap(nullptr, size + alignment, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (ret == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    char* start = (char*)(((uintptr_t)ret + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    if (start != ret)
+    {
+        munmap(ret, start - (char*)ret);
+    }
+    munmap(start + size, (char*)ret + alignment - start);
+    if (USE_THP_HEAP)
+    {
+        madvise(start, size, MADV_HUGEPAGE);
+    }
+    return start;
+}
+
+
+
+/**
+ * @function:   static void* get_region_page()
+ * @brief:      get a page from the page region: a released one if there is, then one the
+ *              scavenger gave back to the OS (the kernel maps it again, zeroed, when touched),
+ *              otherwise the next page of the region.
+ * 
+ * @returns:
+ *     - Success: a pointer to the page.
+ *
+ *     - Failure:
+ *          If the region wasn't reserved or is full, returns nullptr.
+ */
+static void* get_region_page()
+{
+    void* page = nullptr;
+    lock(&growth_lock);
+    if (free_pages)
+    {
+        page = free_pages;
+        free_pages = *(void**)page;
+    }
+    else if (purged_pages_count > 0)
+    {
+        while (purged_pages_map[purged_pages_hint] == 0)
+        {
+            purged_pages_hint++;
+        }
+        uint64_t* word = &purged_pages_map[purged_pages_hint];
+        size_t index = purged_pages_hint * 64 + __builtin_ctzll(*word);
+        *word &= *word - 1;
+        purged_pages_count--;
+        page = page_region_start + index * MALLOC_PAGE_SIZE;
+    }
+    else if (page_region_start && page_region_top + MALLOC_PAGE_SIZE <= page_region_start + PAGE_REGION_SIZE)
+    {
+        page = page_region_top;
+        page_region_top += MALLOC_PAGE_SIZE;
+    }
+    unlock(&growth_lock);
+    return page;
+}
+
+
+
+/**
+ * @function:   static void link_slab(slab_t* slab)
+ * @brief:      push the slab to the head of its class's list of slabs with free slots.
+ */
+static void link_slab(slab_t* slab)
+{
+    slab_t** head = &slab_partial[slab->size_class];
+    slab->prev = nullptr;
+    slab->next = *head;
+    if (*head)
+    {
+        (*head)->prev = slab;
+    }
+    *head = slab;
+}
+
+
+
+/**
+ * @function:   static void unlink_slab(slab_t* slab)
+ * @brief:      remove the slab from its class's list of slabs with free slots.
+ */
+static void unlink_slab(slab_t* slab)
+{
+    if (slab->prev)
+    {
+        slab->prev->next = slab->next;
+    }
+    else
+    {
+        slab_partial[slab->size_class] = slab->next;
+    }
+    if (slab->next)
+    {
+        slab->next->prev = slab->prev;
+    }
+}
+
+
+
+/**
+ * @function:   static void release_slab(slab_t* slab)
+ * @brief:      remove an empty slab from its class's list and release its page (call with the
+ *              class's lock held).
+ */
+static void release_slab(slab_t* slab)
+{
+    unlink_slab(slab);
+    lock(&growth_lock);
+    slab->size_class = SLAB_NO_CLASS;
+    *(void**)slab = free_pages;
+    free_pages = slab;
+    unlock(&growth_lock);
+}
+
+
+
+/**
+ * @function:   static void slab_push(void* p)
+ * @brief:      push the slot back to its slab. A full slab gets back to its class's list, an
+ *              empty slab's page is released (unless it's the first slab of the list).
+ *              Call with the class's lock held.
+ */
+static void slab_push(void* p)
+{
+    slab_t* slab = GET_SLAB(p);
+    int size_class = slab->size_class;
+    *(void**)p = slab->free_list;
+    slab->free_list = p;
+    if (slab->used-- == slab_class_table.capacity[size_class])
+    {
+        link_slab(slab);
+    }
+    else if (slab->used == 0 && slab_partial[size_class] != slab)
+    {
+        release_slab(slab);
+    }
+}
+
+
+
+/**
+ * @function:   static void slab_drain_remote_frees(int size_class)
+ * @brief:      push back the slots of the class's remote frees (call with the class's lock held).
+ */
+static void slab_drain_remote_frees(int size_class)
+{
+    for (void* slot = remote_take(&slab_remote_frees[size_class]); slot != nullptr; )
+    {
+        void* next = *(void**)slot;
+        slab_push(slot);
+        slot = next;
+    }
+}
+
+
+
+/**
+ * @function:   static void* slab_pop(int size_class)
+ * @brief:      pop a slot of the class from the first slab with free slots (a new slab is
+ *              made if the class has none), after pushing back the class's remote frees.
+ *              Call with the class's lock held.
+ * 
+ * @returns:
+ *     - Success: a pointer to the slot.
+ *
+ *     - Failure:
+ *          If no page is left for a new slab, returns nullptr.
+ */
+static void* slab_pop(int size_class)
+{
+    slab_drain_remote_frees(size_class);
+    slab_t* slab = slab_partial[size_class];
+    if (!slab)
+    {
+        slab = (slab_t*)get_region_page();
+        if (!slab)
+        {
+            return nullptr;
+        }
+        slab->free_list = nullptr;
+        slab->unused = (char*)slab + SLAB_HEADER_SIZE;
+        slab->used = 0;
+        slab->size_class = size_class;
+        link_slab(slab);
+    }
+
+    void* slot = slab->free_list;
+    if (slot)
+    {
+        slab->free_list = *(void**)slot;
+    }
+    else
+    {
+        slot = slab->unused;
+        slab->unused += slab_class_table.slot_size[size_class];
+    }
+    if (++slab->used == slab_class_table.capacity[size_class])
+    {
+        unlink_slab(slab);
+    }
+    return slot;
+}
+
+
+
+/**
+ * @function:   static void* slab_alloc(size_t size)
+ * @brief:      pop a slot of size's class (see slab_pop).
+ * 
+ * @returns:
+ *     - Success: a pointer to the slot.
+ *
+ *     - Failure:
+ *          If no page is left for a new slab, returns nullptr.
+ */
+static void* slab_alloc(size_t size)
+{
+    int size_class = GET_SLAB_CLASS(size);
+    lock(&slab_locks[size_class]);
+    void* slot = slab_pop(size_class);
+    unlock(&slab_locks[size_class]);
+    return slot;
+}
+
+
+
+/**
+ * @function:   static void slab_free(void* p)
+ * @brief:      push the slot back to its slab (see slab_push) with the class's remote frees,
+ *              or to the class's remote frees if another thread holds the class's lock.
+ */
+static void slab_free(void* p)
+{
+    int size_class = GET_SLAB(p)->size_class;
+    if (!try_lock(&slab_locks[size_class]))
+    {
+        remote_push(&slab_remote_frees[size_class], p);
+        if (try_lock(&slab_locks[size_class]))
+        {
+            slab_drain_remote_frees(size_class);
+            unlock(&slab_locks[size_class]);
+        }
+        return;
+    }
+    slab_drain_remote_frees(size_class);
+    slab_push(p);
+    unlock(&slab_locks[size_class]);
+}
+
+
+
+/**
+ * @function:   static void set_span(chunk_t* chunk, uint32_t first, uint32_t pages, uint32_t size_class)
+ * @brief:      make pages [first, first + pages) of the chunk one span and map its pages to it.
+ *              only the last page of free pages is mapped (to merge with the span after it).
+ */
+static void set_span(chunk_t* chunk, uint32_t first, uint32_t pages, uint32_t size_class)
+{
+    run_t* span = &chunk->spans[first];
+    span->pages = pages;
+    span->size_class = size_class;
+    uint32_t page = (size_class == RUN_NO_CLASS) ? first + pages - 1 : first;
+    for (; page < first + pages; page++)
+    {
+        chunk->page_span[page] = first;
+    }
+}
+
+
+
+/**
+ * @function:   static void link_free_span(run_t* span)
+ * @brief:      push a span of free pages to the head of the free spans list of its # of pages
+ *              (call with the growth lock held).
+ */
+static void link_free_span(run_t* span)
+{
+    run_t** head = &free_spans[span->pages];
+    span->prev = nullptr;
+    span->next = *head;
+    if (*head)
+    {
+        (*head)->prev = span;
+    }
+    *head = span;
+    free_spans_map[span->pages / BIN_MAP_WORD_BITS] |= (uint64_t)1 << (span->pages % BIN_MAP_WORD_BITS);
+}
+
+
+
+/**
+ * @function:   static void unlink_free_span(run_t* span)
+ * @brief:      remove a span of free pages from its free spans list (call with the growth lock
+ *              held).
+ */
+static void unlink_free_span(run_t* span)
+{
+    if (span->prev)
+    {
+        span->prev->next = span->next;
+    }
+    else
+    {
+        free_spans[span->pages] = span->next;
+    }
+    if (span->next)
+    {
+        span->next->prev = span->prev;
+    }
+    if (!free_spans[span->pages])
+    {
+        free_spans_map[span->pages / BIN_MAP_WORD_BITS] &= ~((uint64_t)1 << (span->pages % BIN_MAP_WORD_BITS));
+    }
+}
+
+
+
+/**
+ * @function:   static run_t* get_free_span(uint32_t pages)
+ * @brief:      find the smallest free span of at least pages pages, using the free spans
+ *              bitmap (one count-trailing-zeros per bitmap word), like get_next_non_empty_bin.
+ * 
+ * @returns:
+ *     - Success: the first span of the list.
+ *
+ *     - Failure:
+ *          If every free span is smaller, returns nullptr.
+ */
+static run_t* get_free_span(uint32_t pages)
+{
+    for (uint32_t word = pages / BIN_MAP_WORD_BITS; word < FREE_SPAN_MAP_WORDS; word++)
+    {
+        uint64_t bits = free_spans_map[word];
+        if (word == pages / BIN_MAP_WORD_BITS)
+        {
+            bits &= ~(uint64_t)0 << (pages % BIN_MAP_WORD_BITS);
+        }
+        if (bits)
+        {
+            return free_spans[word * BIN_MAP_WORD_BITS + __builtin_ctzll(bits)];
+        }
+    }
+    return nullptr;
+}
+
+
+
+/**
+ * @function:   static chunk_t* new_chunk()
+ * @brief:      carve the next chunk of the run region, all of its pages after the header are
+ *              one free span, in the free spans lists (call with the growth lock held).
+ * 
+ * @returns:
+ *     - Success: a pointer to the chunk.
+ *
+ *     - Failure:
+ *          If the region wasn't reserved or is full, returns nullptr.
+ */
+static chunk_t* new_chunk()
+{
+    if (!run_region_start || run_region_top + CHUNK_SIZE > run_region_start + RUN_REGION_SIZE)
+    {
+        return nullptr;
+    }
+    chunk_t* chunk = (chunk_t*)run_region_top;
+    run_region_top += CHUNK_SIZE;
+    set_span(chunk, CHUNK_HEADER_PAGES, CHUNK_PAGES - CHUNK_HEADER_PAGES, RUN_NO_CLASS);
+    SET_SPAN_DIRTY(&chunk->spans[CHUNK_HEADER_PAGES], false);
+    link_free_span(&chunk->spans[CHUNK_HEADER_PAGES]);
+    return chunk;
+}
+
+
+
+/**
+ * @function:   static run_t* new_run(int size_class)
+ * @brief:      carve a run of the class from the smallest free span that fits (see
+ *              get_free_span, a new chunk if none does), the rest of the span stays free.
+ * 
+ * @returns:
+ *     - Success: a pointer to the run (with all of its slots free).
+ *
+ *     - Failure:
+ *          If no chunk is left, returns nullptr.
+ */
+static run_t* new_run(int size_class)
+{
+    uint32_t pages = run_class_table.pages[size_class];
+    lock(&growth_lock);
+    run_t* run = get_free_span(pages);
+    if (!run)
+    {
+        chunk_t* chunk = new_chunk();
+        if (!chunk)
+        {
+            unlock(&growth_lock);
+            return nullptr;
+        }
+        run = &chunk->spans[CHUNK_HEADER_PAGES];
+    }
+    unlink_free_span(run);
+
+    chunk_t* run_chunk = GET_CHUNK(run);
+    uint32_t first = run - run_chunk->spans;
+    if (run->pages > pages)
+    {
+        set_span(run_chunk, first + pages, run->pages - pages, RUN_NO_CLASS);
+        SET_SPAN_DIRTY(&run_chunk->spans[first + pages], IS_SPAN_DIRTY(run));
+        link_free_span(&run_chunk->spans[first + pages]);
+    }
+    set_span(run_chunk, first, pages, size_class);
+    unlock(&growth_lock);
+    run->free_slots = GET_RUN_ALL_SLOTS(size_class);
+    return run;
+}
+
+
+
+/**
+ * @function:   static void release_run(chunk_t* chunk, run_t* run)
+ * @brief:      give an empty run's pages back to its chunk, merged with the free spans around it,
+ *              in the free spans lists.
+ */
+static void release_run(chunk_t* chunk, run_t* run)
+{
+    lock(&growth_lock);
+    uint32_t first = run - chunk->spans;
+    uint32_t pages = run->pages;
+    uint32_t next = first + pages;
+    if (next < CHUNK_PAGES && chunk->spans[next].size_class == RUN_NO_CLASS)
+    {
+        unlink_free_span(&chunk->spans[next]);
+        pages += chunk->spans[next].pages;
+    }
+    if (first > CHUNK_HEADER_PAGES)
+    {
+        run_t* prev = &chunk->spans[chunk->page_span[first - 1]];
+        if (prev->size_class == RUN_NO_CLASS)
+        {
+            unlink_free_span(prev);
+            first -= prev->pages;
+            pages += prev->pages;
+        }
+    }
+    set_span(chunk, first, pages, RUN_NO_CLASS);
+    SET_SPAN_DIRTY(&chunk->spans[first], true);
+    link_free_span(&chunk->spans[first]);
+    unlock(&growth_lock);
+}
+
+
+
+/**
+ * @function:   static void link_run(run_t* run)
+ * @brief:      push the run to the head of its class's list of runs with free slots.
+ */
+static void link_run(run_t* run)
+{
+    run_t** head = &run_partial[run->size_class];
+    run->prev = nullptr;
+    run->next = *head;
+    if (*head)
+    {
+        (*head)->prev = run;
+    }
+    *head = run;
+}
+
+
+
+/**
+ * @function:   static void unlink_run(run_t* run)
+ * @brief:      remove the run from its class's list of runs with free slots.
+ */
+static void unlink_run(run_t* run)
+{
+    if (run->prev)
+    {
+        run->prev->next = run->next;
+    }
+    else
+    {
+        run_partial[run->size_class] = run->next;
+    }
+    if (run->next)
+    {
+        run->next->prev = run->prev;
+    }
+}
+
+
+
+/**
+ * @function:   static run_t* get_run(void* p)
+ * @brief:      get the run of a slot, by its chunk's page map.
+ */
+static run_t* get_run(void* p)
+{
+    chunk_t* chunk = GET_CHUNK(p);
+    return &chunk->spans[chunk->page_span[GET_PAGE_INDEX(chunk, p)]];
+}
+
+
+
+/**
+ * @function:   static void run_push(void* p)
+ * @brief:      mark the slot free in its run. A full run gets back to its class's list, an empty
+ *              run is given back to its chunk (unless it's the first run of the list).
+ *              Call with the class's lock held.
+ */
+static void run_push(void* p)
+{
+    chunk_t* chunk = GET_CHUNK(p);
+    run_t* run = get_run(p);
+    int size_class = run->size_class;
+    char* start = GET_PAGE_ADDRESS(chunk, run - chunk->spans);
+
+    if (!run->free_slots)
+    {
+        link_run(run);
+    }
+    run->free_slots |= (uint64_t)1 << (((char*)p - start) / run_class_table.slot_size[size_class]);
+    if (run->free_slots == GET_RUN_ALL_SLOTS(size_class) && run_partial[size_class] != run)
+    {
+        unlink_run(run);
+        release_run(chunk, run);
+    }
+}
+
+
+
+/**
+ * @function:   static void run_drain_remote_frees(int size_class)
+ * @brief:      push back the slots of the class's remote frees (call with the class's lock held).
+ */
+static void run_drain_remote_frees(int size_class)
+{
+    for (void* slot = remote_take(&run_remote_frees[size_class]); slot != nullptr; )
+    {
+        void* next = *(void**)slot;
+        run_push(slot);
+        slot = next;
+    }
+}
+
+
+
+/**
+ * @function:   static void* run_alloc(size_t size)
+ * @brief:      take the first free slot (lowest bit of the bitmap) of the first run of size's
+ *              class with free slots (a new run is carved if the class has none), after
+ *              pushing back the class's remote frees.
+ * 
+ * @returns:
+ *     - Success: a pointer to the slot.
+ *
+ *     - Failure:
+ *          If no chunk is left for a new run, returns nullptr.
+ */
+static void* run_alloc(size_t size)
+{
+    int size_class = GET_RUN_CLASS(size);
+    lock(&run_locks[size_class]);
+    run_drain_remote_frees(size_class);
+    run_t* run = run_partial[size_class];
+    if (!run)
+    {
+        run = new_run(size_class);
+        if (!run)
+        {
+            unlock(&run_locks[size_class]);
+            return nullptr;
+        }
+        link_run(run);
+    }
+
+    int slot = __builtin_ctzll(run->free_slots);
+    run->free_slots &= run->free_slots - 1;
+    if (!run->free_slots)
+    {
+        unlink_run(run);
+    }
+    unlock(&run_locks[size_class]);
+    chunk_t* chunk = GET_CHUNK(run);
+    return GET_PAGE_ADDRESS(chunk, run - chunk->spans) + (size_t)slot * run_class_table.slot_size[size_class];
+}
+
+
+
+/**
+ * @function:   static void run_free(void* p)
+ * @brief:      mark the slot free in its run (see run_push) with the class's remote frees, or
+ *              push it to the class's remote frees if another thread holds the class's lock.
+ */
+static void run_free(void* p)
+{
+    int size_class = get_run(p)->size_class;
+    if (!try_lock(&run_locks[size_class]))
+    {
+        remote_push(&run_remote_frees[size_class], p);
+        if (try_lock(&run_locks[size_class]))
+        {
+            run_drain_remote_frees(size_class);
+            unlock(&run_locks[size_class]);
+        }
+        return;
+    }
+    run_drain_remote_frees(size_class);
+    run_push(p);
+    unlock(&run_locks[size_class]);
+}
+
+
+
+/**
+ * @function:   static void* transfer_pop(int size_class)
+ * @brief:      take a batch from the class's transfer cache, in O(1).
+ * 
+ * @returns:
+ *     - Success: the first slot of the batch (TCACHE_BATCH slots, linked).
+ *
+ *     - Failure:
+ *          If the transfer cache is empty, returns nullptr.
+ */
+static void* transfer_pop(int size_class)
+{
+    transfer_cache_t* transfer = &transfer_caches[size_class];
+    void* batch = nullptr;
+    lock(&transfer->lock);
+    if (transfer->count > 0)
+    {
+        batch = transfer->batches[--transfer->count];
+        transfer->low_water = MMIN(transfer->low_water, transfer->count);
+    }
+    unlock(&transfer->lock);
+    return batch;
+}
+
+
+
+/**
+ * @function:   static bool transfer_push(int size_class, void* batch)
+ * @brief:      give a batch (TCACHE_BATCH slots, linked) to the class's transfer cache, in O(1).
+ * 
+ * @returns:
+ *     false if the transfer cache is full (and the batch wasn't taken).
+ */
+static bool transfer_push(int size_class, void* batch)
+{
+    transfer_cache_t* transfer = &transfer_caches[size_class];
+    bool pushed = false;
+    lock(&transfer->lock);
+    if (transfer->count < TRANSFER_CACHE_BATCHES)
+    {
+        transfer->batches[transfer->count++] = batch;
+        pushed = true;
+    }
+    unlock(&transfer->lock);
+    return pushed;
+}
+
+
+
+/**
+ * @function:   static void transfer_flush_all(int size_class)
+ * @brief:      give every slot of the class's transfer cache back to the slabs.
+ */
+static void transfer_flush_all(int size_class)
+{
+    for (void* batch = transfer_pop(size_class); batch != nullptr; batch = transfer_pop(size_class))
+    {
+        lock(&slab_locks[size_class]);
+        while (batch)
+        {
+            void* next = *(void**)batch;
+            slab_push(batch);
+            batch = next;
+        }
+        unlock(&slab_locks[size_class]);
+    }
+}
+
+
+
+/**
+ * @function:   static void cache_bin_refill(tcache_bin_t* bin, int size_class)
+ * @brief:      fill a cache's empty bin (a miss) with a batch of the class's transfer cache, or
+ *              if it has none with up to TCACHE_BATCH slots from the slabs, under a single
+ *              lock.
+ */
+static void cache_bin_refill(tcache_bin_t* bin, int size_class)
+{
+    bin->misses++;
+    if (USE_TRANSFER_CACHE)
+    {
+        void* batch = transfer_pop(size_class);
+        if (batch)
+        {
+            bin->head = batch;
+            SET_CACHE_BIN_COUNT(bin, TCACHE_BATCH);
+            return;
+        }
+    }
+    uint32_t count = bin->count;
+    lock(&slab_locks[size_class]);
+    for (int i = 0; i < TCACHE_BATCH; i++)
+    {
+        void* slot = slab_pop(size_class);
+        if (!slot)
+        {
+            break;
+        }
+        *(void**)slot = bin->head;
+        bin->head = slot;
+        count++;
+    }
+    unlock(&slab_locks[size_class]);
+    SET_CACHE_BIN_COUNT(bin, count);
+}
+
+
+
+/**
+ * @function:   static void cache_bin_release(tcache_bin_t* bin, int size_class, uint32_t count)
+ * @brief:      give count slots of a cache's bin back to their slabs, under a single lock.
+ */
+static void cache_bin_release(tcache_bin_t* bin, int size_class, uint32_t count)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    uint32_t left = bin->count;
+    lock(&slab_locks[size_class]);
+    for (; count > 0 && bin->head; count--)
+    {
+        void* slot = bin->head;
+        bin->head = *(void**)slot;
+        left--;
+        slab_push(slot);
+    }
+    unlock(&slab_locks[size_class]);
+    SET_CACHE_BIN_COUNT(bin, left);
+}
+
+
+
+/**
+ * @function:   static void cache_bin_flush(tcache_bin_t* bin, int size_class, uint32_t count)
+ * @brief:      give count slots of a cache's bin away: whole batches to the class's transfer
+ *              cache while it has room, the rest back to their slabs under a single lock.
+ */
+static void cache_bin_flush(tcache_bin_t* bin, int size_class, uint32_t count)
+{
+    uint32_t left = bin->count;
+    while (USE_TRANSFER_CACHE && count >= TCACHE_BATCH)
+    {
+        void* last = bin->head;
+        for (int i = 1; i < TCACHE_BATCH; i++)
+        {
+            last = *(void**)last;
+        }
+        void* rest = *(void**)last;
+        *(void**)last = nullptr;
+        if (!transfer_push(size_class, bin->head))
+        {
+            *(void**)last = rest;
+            break;
+        }
+        bin->head = rest;
+        left -= TCACHE_BATCH;
+        count -= TCACHE_BATCH;
+    }
+    SET_CACHE_BIN_COUNT(bin, left);
+    cache_bin_release(bin, size_class, count);
+}
+
+
+
+/**
+ * @function:   static void cache_flush_all(tcache_bin_t* bins)
+ * @brief:      give every slot of a cache's bins back to their slabs.
+ */
+static void cache_flush_all(tcache_bin_t* bins)
+{
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+    {
+        if (bins[i].count > 0)
+        {
+            cache_bin_flush(&bins[i], i, bins[i].count);
+        }
+    }
+}
+
+
+
+/**
+ * @function:   static size_t cache_bytes(tcache_bin_t* bins)
+ * @brief:      # of bytes of the slots a cache holds (the counts may be read from another
+ *              thread).
+ */
+static size_t cache_bytes(tcache_bin_t* bins)
+{
+    size_t result = 0;
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+    {
+        result += (size_t)__atomic_load_n(&bins[i].count, __ATOMIC_RELAXED) * slab_class_table.slot_size[i];
+    }
+    return result;
+}
+
+
+
+/**
+ * @function:   static uint64_t get_time_ms()
+ * @brief:      the monotonic clock, in ms (the coarse clock, read without a system call).
+ */
+static uint64_t get_time_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+
+/**
+ * @function:   static void cache_bin_scavenge(tcache_bin_t* bin, int size_class)
+ * @brief:      adapt a cache's bin to its use since the last scavenge: a bin that missed more
+ *              than once caches deeper, a bin whose low_water slots were never used gives
+ *              them back to the slabs (so their slabs can be released) and caches shallower.
+ *              Call with the cache held.
+ */
+static void cache_bin_scavenge(tcache_bin_t* bin, int size_class)
+{
+    if (bin->misses > 1)
+    {
+        bin->max_depth = MMIN(bin->max_depth * 2, TCACHE_MAX_DEPTH);
+    }
+    else if (bin->low_water > 0)
+    {
+        __atomic_add_fetch(&scavenged_blocks_count, bin->low_water, __ATOMIC_RELAXED);
+        cache_bin_release(bin, size_class, bin->low_water);
+        bin->max_depth = MMAX(bin->max_depth / 2, TCACHE_MIN_DEPTH);
+    }
+    bin->misses = 0;
+    bin->low_water = bin->count;
+}
+
+
+
+/**
+ * @function:   static void transfer_scavenge(int size_class)
+ * @brief:      give the batches the class's transfer cache held since the last scavenge (the
+ *              bottom low_water ones) back to the slabs.
+ */
+static void transfer_scavenge(int size_class)
+{
+    transfer_cache_t* transfer = &transfer_caches[size_class];
+    void* batches[TRANSFER_CACHE_BATCHES];
+    lock(&transfer->lock);
+    uint32_t count = transfer->low_water;
+    memcpy(batches, transfer->batches, count * sizeof(void*));
+    memmove(transfer->batches, transfer->batches + count, (transfer->count - count) * sizeof(void*));
+    transfer->count -= count;
+    transfer->low_water = transfer->count;
+    unlock(&transfer->lock);
+    if (count == 0)
+    {
+        return;
+    }
+    __atomic_add_fetch(&scavenged_blocks_count, count * TCACHE_BATCH, __ATOMIC_RELAXED);
+    lock(&slab_locks[size_class]);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        for (void* slot = batches[i]; slot != nullptr;)
+        {
+            void* next = *(void**)slot;
+            slab_push(slot);
+            slot = next;
+        }
+    }
+    unlock(&slab_locks[size_class]);
+}
+
+
+
+/**
+ * @function:   static void cpu_cache_wait(cpu_cache_t* cache)
+ * @brief:      after an aborted restartable sequence: if the cache is stopped, wait for the
+ *              CPU that stopped it (on its lock).
+ */
+static void cpu_cache_wait(cpu_cache_t* cache)
+{
+    if (__atomic_load_n(&cache->stopped, __ATOMIC_ACQUIRE))
+    {
+        lock(&cache->lock);
+        unlock(&cache->lock);
+    }
+}
+
+
+
+/**
+ * @function:   static void cpu_cache_stop(int cpu)
+ * @brief:      get cpu's cache to change it from any CPU: take its lock, mark it stopped and
+ *              restart the restartable sequence cpu may be in the middle of (membarrier), so
+ *              none commits until cpu_cache_start.
+ */
+static void cpu_cache_stop(int cpu)
+{
+    lock(&cpu_caches[cpu].lock);
+#if HAVE_RSEQ
+    if (use_rseq)
+    {
+        __atomic_store_n(&cpu_caches[cpu].stopped, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, MEMBARRIER_CMD_FLAG_CPU, cpu);
+    }
+#endif
+}
+
+
+
+/**
+ * @function:   static void cpu_cache_start(int cpu)
+ * @brief:      give cpu's cache back to its restartable sequences (see cpu_cache_stop).
+ */
+static void cpu_cache_start(int cpu)
+{
+    __atomic_store_n(&cpu_caches[cpu].stopped, 0, __ATOMIC_RELEASE);
+    unlock(&cpu_caches[cpu].lock);
+}
+
+
+
+/**
+ * @function:   static bool cpu_cache_in_use(int cpu)
+ * @brief:      whether cpu's cache holds slots or held some since the last scavenge (read
+ *              without stopping it, the caches of the CPUs the threads never ran on are left
+ *              alone).
+ */
+static bool cpu_cache_in_use(int cpu)
+{
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+    {
+        if (__atomic_load_n(&cpu_caches[cpu].bins[i].list, __ATOMIC_RELAXED) != 0 ||
+            __atomic_load_n(&cpu_caches[cpu].bins[i].low_water, __ATOMIC_RELAXED) != 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+
+/**
+ * @function:   static void cpu_bin_load(cpu_cache_bin_t* bin, tcache_bin_t* loaded)
+ * @brief:      copy a bin of a stopped CPU cache into a thread cache's bin, for the cache_bin_*
+ *              functions.
+ */
+static void cpu_bin_load(cpu_cache_bin_t* bin, tcache_bin_t* loaded)
+{
+    loaded->head = CPU_BIN_HEAD(bin->list);
+    loaded->count = CPU_BIN_COUNT(bin->list);
+    loaded->max_depth = bin->max_depth;
+    loaded->low_water = bin->low_water;
+    loaded->misses = bin->misses;
+}
+
+
+
+/**
+ * @function:   static void cpu_bin_store(cpu_cache_bin_t* bin, tcache_bin_t* loaded)
+ * @brief:      copy a thread cache's bin back into the bin of a stopped CPU cache (see
+ *              cpu_bin_load).
+ */
+static void cpu_bin_store(cpu_cache_bin_t* bin, tcache_bin_t* loaded)
+{
+    __atomic_store_n(&bin->list, CPU_BIN_LIST(loaded->head, loaded->count), __ATOMIC_RELAXED);
+    bin->max_depth = loaded->max_depth;
+    __atomic_store_n(&bin->low_water, loaded->low_water, __ATOMIC_RELAXED);
+    __atomic_store_n(&bin->misses, loaded->misses, __ATOMIC_RELAXED);
+}
+
+
+
+/**
+ * @function:   static void purge_free_pages()
+ * @brief:      release the empty slabs the classes' lists kept (all but the first), and give the
+ *              memory of the page region's released pages back to the OS (MADV_DONTNEED), for
+ *              the scavenger. Their link is in the page, so they move to the purged pages
+ *              bitmap. The heap on transparent huge pages (-DMALLOC_4_THP_HEAP) keeps them, a
+ *              small page given back would split its huge page.
+ */
+static void purge_free_pages()
+{
+    if (USE_THP_HEAP)
+    {
+        return;
+    }
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+    {
+        lock(&slab_locks[i]);
+        slab_t* slab = slab_partial[i] ? slab_partial[i]->next : nullptr;
+        while (slab)
+        {
+            slab_t* next = slab->next;
+            if (slab->used == 0)
+            {
+                release_slab(slab);
+            }
+            slab = next;
+        }
+        unlock(&slab_locks[i]);
+    }
+    // held across the madvise calls: a page out of free_pages but not yet in the bitmap would
+    // be walked by PAGE_REGION_FOR_EACH (lock_stats) with its header already zeroed
+    lock(&growth_lock);
+    void* page = free_pages;
+    free_pages = nullptr;
+    while (page)
+    {
+        void* next = *(void**)page;
+        madvise(page, MALLOC_PAGE_SIZE, MADV_DONTNEED);
+        size_t index = GET_REGION_PAGE_INDEX(page);
+        purged_pages_map[index / 64] |= (uint64_t)1 << (index % 64);
+        purged_pages_count++;
+        purged_pages_hint = MMIN(purged_pages_hint, index / 64);
+        page = next;
+    }
+    unlock(&growth_lock);
+}
+
+
+
+/**
+ * @function:   static void purge_free_spans()
+ * @brief:      give the empty runs the classes' lists kept (all but the first) back to their
+ *              chunks, and the memory of the run region's free spans back to the OS
+ *              (MADV_DONTNEED), for the scavenger. Their descriptors are in their chunk's
+ *              header, only the spans freed since the last time (dirty) are given back. The heap
+ *              on transparent huge pages keeps them (see purge_free_pages).
+ */
+static void purge_free_spans()
+{
+    if (USE_THP_HEAP)
+    {
+        return;
+    }
+    for (int i = 0; i < RUN_CLASS_COUNT; i++)
+    {
+        lock(&run_locks[i]);
+        run_t* run = run_partial[i] ? run_partial[i]->next : nullptr;
+        while (run)
+        {
+            run_t* next = run->next;
+            if (run->free_slots == GET_RUN_ALL_SLOTS(i))
+            {
+                unlink_run(run);
+                release_run(GET_CHUNK(run), run);
+            }
+            run = next;
+        }
+        unlock(&run_locks[i]);
+    }
+    lock(&growth_lock);
+    for (size_t i = 0; i < FREE_SPAN_LISTS; i++)
+    {
+        for (run_t* span = free_spans[i]; span; span = span->next)
+        {
+            if (IS_SPAN_DIRTY(span))
+            {
+                chunk_t* chunk = GET_CHUNK(span);
+                madvise(GET_PAGE_ADDRESS(chunk, span - chunk->spans), (size_t)span->pages * MALLOC_PAGE_SIZE, MADV_DONTNEED);
+                SET_SPAN_DIRTY(span, false);
+            }
+        }
+    }
+    unlock(&growth_lock);
+}
+
+
+
+/**
+ * @function:   static void scavenge()
+ * @brief:      scavenge every bin of the idle thread caches, of the CPU caches and of the
+ *              transfer caches. The thread caches are marked scavenging, then one membarrier
+ *              (see tcache_enter) and the ones that aren't busy are the scavenger's until
+ *              unmarked (their threads go to the slabs meanwhile). Without membarrier (or if
+ *              it fails) the thread caches are skipped.
+ */
+static void scavenge()
+{
+    lock(&tcache_list_lock);
+    if (tcache_list && use_membarrier)
+    {
+        for (tcache_t* cache = tcache_list; cache; cache = cache->next)
+        {
+            __atomic_store_n(&cache->scavenging, true, __ATOMIC_SEQ_CST);
+        }
+        bool fenced = syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0) == 0;
+        for (tcache_t* cache = tcache_list; cache; cache = cache->next)
+        {
+            if (fenced && !__atomic_load_n(&cache->busy, __ATOMIC_SEQ_CST))
+            {
+                for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+                {
+                    cache_bin_scavenge(&cache->bins[i], i);
+                }
+            }
+            __atomic_store_n(&cache->scavenging, false, __ATOMIC_RELEASE);
+        }
+    }
+    unlock(&tcache_list_lock);
+    for (int i = 0; USE_PERCPU_CACHE && i < CPU_CACHE_COUNT; i++)
+    {
+        if (!cpu_cache_in_use(i))
+        {
+            continue;
+        }
+        cpu_cache_stop(i);
+        for (int j = 0; j < SLAB_CLASS_COUNT; j++)
+        {
+            tcache_bin_t bin;
+            cpu_bin_load(&cpu_caches[i].bins[j], &bin);
+            cache_bin_scavenge(&bin, j);
+            cpu_bin_store(&cpu_caches[i].bins[j], &bin);
+        }
+        cpu_cache_start(i);
+    }
+    for (int i = 0; USE_TRANSFER_CACHE && i < SLAB_CLASS_COUNT; i++)
+    {
+        transfer_scavenge(i);
+    }
+    purge_free_pages();
+    purge_free_spans();
+    __atomic_add_fetch(&scavenges_count, 1, __ATOMIC_RELAXED);
+}
+
+
+
+/**
+ * @function:   static void scavenge_tick()
+ * @brief:      scavenge if SCAVENGE_MS passed since the last time (called on the slow paths,
+ *              by one thread at a time, holding no lock).
+ */
+static void scavenge_tick()
+{
+    if (!USE_SCAVENGER)
+    {
+        return;
+    }
+    // (now < last + SCAVENGE_MS, not now - last < SCAVENGE_MS: -Wextra warns on an unsigned
+    // compare against 0 with -DMALLOC_4_SCAVENGE_MS=0)
+    uint64_t now = get_time_ms();
+    uint64_t last = __atomic_load_n(&scavenge_last_ms, __ATOMIC_RELAXED);
+    if (now < last + SCAVENGE_MS ||
+        !__atomic_compare_exchange_n(&scavenge_last_ms, &last, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    scavenge();
+}
+
+
+
+/**
+ * @function:   static void tcache_destroy(void* cache)
+ * @brief:      tcache_key's destructor: remove the exiting thread's cache from the list of
+ *              thread caches (out of the scavenger's reach), give its slots back to the slabs
+ *              and turn it off, so the thread's frees in the TSD destructors that run after
+ *              this one don't land in a cache nobody flushes.
+ */
+static void tcache_destroy(void* cache)
+{
+    tcache_t* to_destroy = (tcache_t*)cache;
+    to_destroy->registered = false;
+    to_destroy->destroyed = true;
+    lock(&tcache_list_lock);
+    if (to_destroy->prev)
+    {
+        to_destroy->prev->next = to_destroy->next;
+    }
+    else
+    {
+        tcache_list = to_destroy->next;
+    }
+    if (to_destroy->next)
+    {
+        to_destroy->next->prev = to_destroy->prev;
+    }
+    unlock(&tcache_list_lock);
+    cache_flush_all(to_destroy->bins);
+}
+
+
+
+/**
+ * @function:   static void tcache_register()
+ * @brief:      make the thread's exit flush its cache and add the cache to the list of thread
+ *              caches (once per thread).
+ */
+static void tcache_register()
+{
+    if (!tcache.registered)
+    {
+        tcache.registered = true;
+        for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+        {
+            tcache.bins[i].max_depth = TCACHE_DEPTH;
+        }
+        lock(&tcache_list_lock);
+        tcache.prev = nullptr;
+        tcache.next = tcache_list;
+        if (tcache_list)
+        {
+            tcache_list->prev = &tcache;
+        }
+        tcache_list = &tcache;
+        unlock(&tcache_list_lock);
+        pthread_setspecific(tcache_key, &tcache);
+    }
+}
+
+
+
+/**
+ * @function:   static bool tcache_enter()
+ * @brief:      mark the thread's cache busy, so the scavenger leaves it alone until
+ *              tcache_leave. Plain stores and loads, no fence: the scavenger's membarrier
+ *              makes every thread that runs pass one, so either the scavenger sees the cache
+ *              busy or the thread sees it scavenging (see scavenge).
+ * 
+ * @returns:
+ *     false if the scavenger may be on the cache, or the thread's exit flushed it (the caller
+ *     goes to the slabs instead).
+ */
+static bool tcache_enter()
+{
+    if (tcache.destroyed)
+    {
+        return false;
+    }
+    if (!USE_SCAVENGER)
+    {
+        return true;
+    }
+    __atomic_store_n(&tcache.busy, true, TCACHE_BUSY_ORDER);
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&tcache.scavenging, __ATOMIC_SEQ_CST))
+    {
+        __atomic_store_n(&tcache.busy, false, __ATOMIC_RELEASE);
+        return false;
+    }
+    return true;
+}
+
+
+
+/**
+ * @function:   static void tcache_leave()
+ * @brief:      mark the thread's cache idle again (see tcache_enter).
+ */
+static void tcache_leave()
+{
+    if (USE_SCAVENGER)
+    {
+        __atomic_store_n(&tcache.busy, false, __ATOMIC_RELEASE);
+    }
+}
+
+
+
+/**
+ * @function:   static void* tcache_alloc(size_t size)
+ * @brief:      pop a slot of size's class from the thread's cache, refilled from the slabs
+ *              when empty. No lock is taken while the cache has slots.
+ * 
+ * @returns:
+ *     - Success: a pointer to the slot.
+ *
+ *     - Failure:
+ *          If no page is left for a new slab, returns nullptr.
+ */
+static void* tcache_alloc(size_t size)
+{
+    int size_class = GET_SLAB_CLASS(size);
+    if (!tcache_enter())
+    {
+        return slab_alloc(size);
+    }
+    tcache_bin_t* bin = &tcache.bins[size_class];
+    bool missed = !bin->head;
+    if (missed)
+    {
+        tcache_register();
+        cache_bin_refill(bin, size_class);
+        if (!bin->head)
+        {
+            tcache_leave();
+            return nullptr;
+        }
+    }
+    void* slot = bin->head;
+    bin->head = *(void**)slot;
+    SET_CACHE_BIN_COUNT(bin, bin->count - 1);
+    bin->low_water = MMIN(bin->low_water, bin->count);
+    tcache_leave();
+    if (missed)
+    {
+        scavenge_tick();
+    }
+    return slot;
+}
+
+
+
+/**
+ * @function:   static void tcache_free(void* p)
+ * @brief:      push the slot to the thread's cache. A full bin (max_depth) first gives
+ *              TCACHE_BATCH of its slots away (see cache_bin_flush). No lock is taken while
+ *              the bin has room.
+ */
+static void tcache_free(void* p)
+{
+    int size_class = GET_SLAB(p)->size_class;
+    if (!tcache_enter())
+    {
+        slab_free(p);
+        return;
+    }
+    tcache_register();
+    tcache_bin_t* bin = &tcache.bins[size_class];
+    bool full = bin->count >= bin->max_depth;
+    if (full)
+    {
+        cache_bin_flush(bin, size_class, bin->count - bin->max_depth + TCACHE_BATCH);
+    }
+    *(void**)p = bin->head;
+    bin->head = p;
+    SET_CACHE_BIN_COUNT(bin, bin->count + 1);
+    tcache_leave();
+    if (full)
+    {
+        scavenge_tick();
+    }
+}
+
+
+
+#if HAVE_RSEQ
+/**
+ * @macro: RSEQ_SEQUENCE_START / RSEQ_SEQUENCE_ABORT
+ * @brief: the parts every restartable sequence shares. START emits the sequence's descriptor
+ *         (labels 1: first instruction, 2: right after the commit, 4: abort handler) in
+ *         __rseq_cs, points the thread's rseq area at it and checks that the thread is still
+ *         on cpu and that the cache isn't stopped. ABORT is the abort handler, behind the
+ *         signature the kernel checks: it sets the result to the failure value and leaves
+ *         to label 5. The kernel sends a sequence preempted, given a signal or moved to another
+ *         CPU before label 2 to its abort handler.
+ */
+#define RSEQ_SEQUENCE_START                                                 \
+    ".pushsection __rseq_cs, \"aw\"\n\t"                                    \
+    ".balign 32\n\t"                                                        \
+    "3:\n\t"                                                                \
+    ".long 0x0, 0x0\n\t"                                                    \
+    ".quad 1f, (2f - 1f), 4f\n\t"                                           \
+    ".popsection\n\t"                                                       \
+    "leaq 3b(%%rip), %%rcx\n\t"                                             \
+    "movq %%rcx, %[rseq_cs]\n\t"                                            \
+    "1:\n\t"                                                                \
+    "cmpl %[cpu], %[cpu_id]\n\t"                                            \
+    "jnz 4f\n\t"                                                            \
+    "cmpl $0, %[stopped]\n\t"                                               \
+    "jnz 4f\n\t"
+
+#define RSEQ_SEQUENCE_ABORT(FAILURE)                                        \
+    ".pushsection __rseq_failure, \"ax\"\n\t"                               \
+    ".byte 0x0f, 0xb9, 0x3d\n\t"                                            \
+    ".long " RSEQ_SIGNATURE "\n\t"                                          \
+    "4:\n\t"                                                                \
+    "movq $" FAILURE ", %%rax\n\t"                                          \
+    "jmp 5f\n\t"                                                            \
+    ".popsection\n\t"
+
+#define RSEQ_SIGNATURE "0x53053053"
+#define RSEQ_ABORTED ((uint64_t)-1)
+
+
+
+/**
+ * @function:   static struct rseq* rseq_area()
+ * @brief:      the calling thread's rseq area, registered by glibc.
+ */
+static struct rseq* rseq_area()
+{
+    return (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+}
+
+
+
+/**
+ * @function:   static uint64_t rseq_pop(cpu_cache_t* cache, cpu_cache_bin_t* bin, uint32_t cpu)
+ * @brief:      pop the first slot of the bin of cpu's cache, in a restartable sequence: read
+ *              the list, read the slot's next, commit the new list with a single store.
+ * 
+ * @returns:
+ *     the slot (0 if the bin is empty), or RSEQ_ABORTED if the sequence was aborted (the
+ *     thread left cpu or the cache is stopped).
+ */
+static uint64_t rseq_pop(cpu_cache_t* cache, cpu_cache_bin_t* bin, uint32_t cpu)
+{
+    struct rseq* area = rseq_area();
+    uint64_t result;
+    __asm__ __volatile__(
+        RSEQ_SEQUENCE_START
+        "movq %[list], %%rcx\n\t"
+        "movq %%rcx, %%rax\n\t"
+        "shlq $16, %%rax\n\t"
+        "shrq $16, %%rax\n\t"
+        "jz 5f\n\t"
+        "movq (%%rax), %%rdx\n\t"
+        "subq %%rax, %%rcx\n\t"
+        "subq %[one], %%rcx\n\t"
+        "addq %%rdx, %%rcx\n\t"
+        "movq %%rcx, %[list]\n\t"
+        "2:\n\t"
+        RSEQ_SEQUENCE_ABORT("-1")
+        "5:\n\t"
+        : "=&a"(result), [list] "+m"(bin->list), [rseq_cs] "=m"(area->rseq_cs)
+        : [cpu_id] "m"(area->cpu_id), [cpu] "r"(cpu), [stopped] "m"(cache->stopped),
+          [one] "r"((uint64_t)1 << CPU_BIN_COUNT_SHIFT)
+        : "rcx", "rdx", "memory", "cc");
+    return result;
+}
+
+
+
+/**
+ * @function:   static uint64_t rseq_push(cpu_cache_t* cache, cpu_cache_bin_t* bin, uint32_t cpu,
+ *                                        void* first, void* last, uint64_t count, uint64_t limit)
+ * @brief:      push the slots first..last (count of them, linked) on the bin of cpu's cache
+ *              unless that makes it hold more than limit, in a restartable sequence: read the
+ *              list, link last to its first slot, commit the new list with a single store.
+ * 
+ * @returns:
+ *     0 if pushed, 1 if the bin is too full, or RSEQ_ABORTED if the sequence was aborted.
+ */
+static uint64_t rseq_push(cpu_cache_t* cache, cpu_cache_bin_t* bin, uint32_t cpu,
+                          void* first, void* last, uint64_t count, uint64_t limit)
+{
+    struct rseq* area = rseq_area();
+    uint64_t result;
+    __asm__ __volatile__(
+        RSEQ_SEQUENCE_START
+        "movq %[list], %%rcx\n\t"
+        "movq %%rcx, %%rax\n\t"
+        "shrq $48, %%rax\n\t"
+        "addq %[count], %%rax\n\t"
+        "cmpq %[limit], %%rax\n\t"
+        "ja 6f\n\t"
+        "shlq $48, %%rax\n\t"
+        "shlq $16, %%rcx\n\t"
+        "shrq $16, %%rcx\n\t"
+        "movq %%rcx, (%[last])\n\t"
+        "orq %[first], %%rax\n\t"
+        "movq %%rax, %[list]\n\t"
+        "2:\n\t"
+        "xorl %%eax, %%eax\n\t"
+        "jmp 5f\n\t"
+        "6:\n\t"
+        "movl $1, %%eax\n\t"
+        "jmp 5f\n\t"
+        RSEQ_SEQUENCE_ABORT("-1")
+        "5:\n\t"
+        : "=&a"(result), [list] "+m"(bin->list), [rseq_cs] "=m"(area->rseq_cs)
+        : [cpu_id] "m"(area->cpu_id), [cpu] "r"(cpu), [stopped] "m"(cache->stopped),
+          [first] "r"(first), [last] "r"(last), [count] "r"(count), [limit] "r"(limit)
+        : "rcx", "memory", "cc");
+    return result;
+}
+
+
+
+/**
+ * @function:   static uint64_t rseq_take(cpu_cache_t* cache, cpu_cache_bin_t* bin, uint32_t cpu)
+ * @brief:      take every slot of the bin of cpu's cache, in a restartable sequence: read the
+ *              list, commit an empty one.
+ * 
+ * @returns:
+ *     the bin's list, or RSEQ_ABORTED if the sequence was aborted.
+ */
+static uint64_t rseq_take(cpu_cache_t* cache, cpu_cache_bin_t* bin, uint32_t cpu)
+{
+    struct rseq* area = rseq_area();
+    uint64_t result;
+    __asm__ __volatile__(
+        RSEQ_SEQUENCE_START
+        "movq %[list], %%rax\n\t"
+        "movq $0, %[list]\n\t"
+        "2:\n\t"
+        RSEQ_SEQUENCE_ABORT("-1")
+        "5:\n\t"
+        : "=&a"(result), [list] "+m"(bin->list), [rseq_cs] "=m"(area->rseq_cs)
+        : [cpu_id] "m"(area->cpu_id), [cpu] "r"(cpu), [stopped] "m"(cache->stopped)
+        : "rcx", "memory", "cc");
+    return result;
+}
+#endif
+
+
+
+/**
+ * @function:   static cpu_cache_t* get_cpu_cache(uint32_t* cpu)
+ * @brief:      get the cache of the CPU the calling thread runs on, and that CPU (read from the
+ *              thread's rseq area, no system call, sched_getcpu reads it there too).
+ * 
+ * @returns:
+ *     the cache, or nullptr with rseq if the thread's rseq isn't registered or its CPU has no
+ *     cache of its own (the thread goes to the slabs).
+ */
+static cpu_cache_t* get_cpu_cache(uint32_t* cpu)
+{
+#if HAVE_RSEQ
+    if (use_rseq)
+    {
+        *cpu = __atomic_load_n(&rseq_area()->cpu_id, __ATOMIC_RELAXED);
+        return *cpu < CPU_CACHE_COUNT ? &cpu_caches[*cpu] : nullptr;
+    }
+#endif
+    int current = sched_getcpu();
+    *cpu = current < 0 ? 0 : current % CPU_CACHE_COUNT;
+    return &cpu_caches[*cpu];
+}
+
+
+
+/**
+ * @function:   static void* cpu_bin_pop(cpu_cache_t* cache, cpu_cache_bin_t* bin, uint32_t cpu)
+ * @brief:      pop the first slot of the bin of cpu's cache (a restartable sequence, or under
+ *              the cache's lock without rseq).
+ * 
+ * @returns:
+ *     the slot (nullptr if the bin is empty), or CPU_BIN_RETRY if the thread left cpu or the
+ *     cache is stopped.
+ */
+static void* cpu_bin_pop(cpu_cache_t* cache, cpu_cache_bin_t* bin, uint32_t cpu)
+{
+#if HAVE_RSEQ
+    if (use_rseq)
+    {
+        uint64_t slot = rseq_pop(cache, bin, cpu);
+        return slot == RSEQ_ABORTED ? CPU_BIN_RETRY : (void*)(uintptr_t)slot;
+    }
+#endif
+    lock(&cache->lock);
+    uint64_t list = bin->list;
+    void* slot = CPU_BIN_HEAD(list);
+    if (slot)
+    {
+        __atomic_store_n(&bin->list, CPU_BIN_LIST(*(void**)slot, CPU_BIN_COUNT(list) - 1), __ATOMIC_RELAXED);
+    }
+    unlock(&cache->lock);
+    return slot;
+}
+
+
+
+/**
+ * @function:   static int cpu_bin_push(cpu_cache_t* cache, cpu_cache_bin_t* bin, uint32_t cpu,
+ *                                      void* first, void* last, uint32_t count, uint32_t limit)
+ * @brief:      push the slots first..last (count of them, linked) on the bin of cpu's cache,
+ *              unless that makes it hold more than limit (a restartable sequence, or under the
+ *              cache's lock without rseq).
+ * 
+ * @returns:
+ *     CPU_BIN_PUSHED, CPU_BIN_FULL, or CPU_BIN_ABORTED if the thread left cpu or the cache is
+ *     stopped.
+ */
+static int cpu_bin_push(cpu_cache_t* cache, cpu_cache_bin_t* bin, uint32_t cpu,
+                        void* first, void* last, uint32_t count, uint32_t limit)
+{
+#if HAVE_RSEQ
+    if (use_rseq)
+    {
+        uint64_t result = rseq_push(cache, bin, cpu, first, last, count, limit);
+        return result == RSEQ_ABORTED ? CPU_BIN_ABORTED : result == 0 ? CPU_BIN_PUSHED : CPU_BIN_FULL;
+    }
+#endif
+    int result = CPU_BIN_FULL;
+    lock(&cache->lock);
+    uint64_t list = bin->list;
+    if (CPU_BIN_COUNT(list) + count <= limit)
+    {
+        *(void**)last = CPU_BIN_HEAD(list);
+        __atomic_store_n(&bin->list, CPU_BIN_LIST(first, CPU_BIN_COUNT(list) + count), __ATOMIC_RELAXED);
+        result = CPU_BIN_PUSHED;
+    }
+    unlock(&cache->lock);
+    return result;
+}
+
+
+
+/**
+ * @function:   static bool cpu_bin_take(cpu_cache_t* cache, cpu_cache_bin_t* bin, uint32_t cpu,
+ *                                       tcache_bin_t* taken)
+ * @brief:      take every slot of the bin of cpu's cache into taken (a restartable sequence,
+ *              or under the cache's lock without rseq).
+ * 
+ * @returns:
+ *     false if the thread left cpu or the cache is stopped (nothing is taken).
+ */
+static bool cpu_bin_take(cpu_cache_t* cache, cpu_cache_bin_t* bin, uint32_t cpu, tcache_bin_t* taken)
+{
+    uint64_t list;
+#if HAVE_RSEQ
+    if (use_rseq)
+    {
+        list = rseq_take(cache, bin, cpu);
+        if (list == RSEQ_ABORTED)
+        {
+            return false;
+        }
+    }
+    else
+#endif
+    {
+        lock(&cache->lock);
+        list = bin->list;
+        __atomic_store_n(&bin->list, (uint64_t)0, __ATOMIC_RELAXED);
+        unlock(&cache->lock);
+    }
+    taken->head = CPU_BIN_HEAD(list);
+    taken->count = CPU_BIN_COUNT(list);
+    return true;
+}
+
+
+
+/**
+ * @function:   static void cpu_bin_push_batch(int size_class, tcache_bin_t* batch)
+ * @brief:      push a batch of slots (a refill, or what a full bin keeps) on the bin of the
+ *              CPU the thread runs on now, or give it away (see cache_bin_flush) if that bin
+ *              has no room or the CPU no cache.
+ */
+static void cpu_bin_push_batch(int size_class, tcache_bin_t* batch)
+{
+    if (batch->count == 0)
+    {
+        return;
+    }
+    void* last = batch->head;
+    while (*(void**)last)
+    {
+        last = *(void**)last;
+    }
+    for (;;)
+    {
+        uint32_t cpu;
+        cpu_cache_t* cache = get_cpu_cache(&cpu);
+        if (!cache)
+        {
+            break;
+        }
+        cpu_cache_bin_t* bin = &cache->bins[size_class];
+        int result = cpu_bin_push(cache, bin, cpu, batch->head, last, batch->count,
+                                  __atomic_load_n(&bin->max_depth, __ATOMIC_RELAXED) + TCACHE_BATCH);
+        if (result == CPU_BIN_PUSHED)
+        {
+            return;
+        }
+        if (result == CPU_BIN_FULL)
+        {
+            break;
+        }
+        cpu_cache_wait(cache);
+    }
+    cache_bin_flush(batch, size_class, batch->count);
+}
+
+
+
+/**
+ * @function:   static void* cpu_cache_alloc(size_t size)
+ * @brief:      pop a slot of size's class from the CPU's cache, refilled from the transfer
+ *              cache or the slabs when empty. No lock and no atomic instruction while the cache
+ *              has slots (with rseq).
+ * 
+ * @returns:
+ *     - Success: a pointer to the slot.
+ *
+ *     - Failure:
+ *          If no page is left for a new slab, returns nullptr.
+ */
+static void* cpu_cache_alloc(size_t size)
+{
+    int size_class = GET_SLAB_CLASS(size);
+    for (;;)
+    {
+        uint32_t cpu;
+        cpu_cache_t* cache = get_cpu_cache(&cpu);
+        if (!cache)
+        {
+            return slab_alloc(size);
+        }
+        cpu_cache_bin_t* bin = &cache->bins[size_class];
+        void* slot = cpu_bin_pop(cache, bin, cpu);
+        if (slot == CPU_BIN_RETRY)
+        {
+            cpu_cache_wait(cache);
+            continue;
+        }
+        if (slot)
+        {
+            // an atomic min: another thread on the CPU (this one may have moved) can lower
+            // low_water between the load and the store, a plain store would raise it back and
+            // the scavenger would release slots the bin still needs
+            uint32_t left = CPU_BIN_COUNT(__atomic_load_n(&bin->list, __ATOMIC_RELAXED));
+            uint32_t low_water = __atomic_load_n(&bin->low_water, __ATOMIC_RELAXED);
+            while (left < low_water)
+            {
+                if (__atomic_compare_exchange_n(&bin->low_water, &low_water, left, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                {
+                    break;
+                }
+            }
+            return slot;
+        }
+
+        // a miss: refill the bin with a batch (the CPU's bin when the batch is pushed, the
+        // thread may have moved) and pop again
+        tcache_bin_t batch = {};
+        cache_bin_refill(&batch, size_class);
+        if (batch.count == 0)
+        {
+            return nullptr;
+        }
+        __atomic_store_n(&bin->misses, __atomic_load_n(&bin->misses, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+        cpu_bin_push_batch(size_class, &batch);
+        scavenge_tick();
+    }
+}
+
+
+
+/**
+ * @function:   static void cpu_cache_free(void* p)
+ * @brief:      push the slot to the CPU's cache. A full bin (max_depth) is taken whole, gives
+ *              TCACHE_BATCH of its slots away (see cache_bin_flush) and the rest is pushed
+ *              back. No lock and no atomic instruction while the bin has room (with rseq).
+ */
+static void cpu_cache_free(void* p)
+{
+    int size_class = GET_SLAB(p)->size_class;
+    for (;;)
+    {
+        uint32_t cpu;
+        cpu_cache_t* cache = get_cpu_cache(&cpu);
+        if (!cache)
+        {
+            slab_free(p);
+            return;
+        }
+        cpu_cache_bin_t* bin = &cache->bins[size_class];
+        uint32_t max_depth = __atomic_load_n(&bin->max_depth, __ATOMIC_RELAXED);
+        int result = cpu_bin_push(cache, bin, cpu, p, p, 1, max_depth);
+        if (result == CPU_BIN_PUSHED)
+        {
+            return;
+        }
+        tcache_bin_t taken = {};
+        if (result == CPU_BIN_ABORTED || !cpu_bin_take(cache, bin, cpu, &taken))
+        {
+            cpu_cache_wait(cache);
+            continue;
+        }
+        *(void**)p = taken.head;
+        taken.head = p;
+        taken.count++;
+        if (taken.count + TCACHE_BATCH > max_depth)
+        {
+            cache_bin_flush(&taken, size_class, taken.count + TCACHE_BATCH - max_depth);
+        }
+        cpu_bin_push_batch(size_class, &taken);
+        scavenge_tick();
+        return;
+    }
+}
+
+
+
+/**
+ * @function:   static bool rseq_register()
+ * @brief:      register the process for membarrier's rseq command (see cpu_cache_stop), once
+ *              glibc registered the threads' rseq areas.
+ * 
+ * @returns:
+ *     whether the CPU caches' hot path can be made of restartable sequences.
+ */
+static bool rseq_register()
+{
+#if HAVE_RSEQ
+    return USE_PERCPU_CACHE && __rseq_size > 0 &&
+           syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ, 0, 0) == 0;
+#else
+    return false;
+#endif
+}
+
+
+
+/**
+ * @function:   static void init_malloc()
+ * @brief:      initialize the locks and the tcache key and reserve the arenas', page and run
+ *              regions, once (the first smalloc of any thread). The regions never move, so
+ *              the blocks can be recognized by address without any lock.
+ */
+static void init_malloc()
+{
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+    {
+        pthread_mutex_init(&slab_locks[i].mutex, nullptr);
+    }
+    for (int i = 0; i < RUN_CLASS_COUNT; i++)
+    {
+        pthread_mutex_init(&run_locks[i].mutex, nullptr);
+    }
+    for (int i = 0; i < ARENA_COUNT; i++)
+    {
+        pthread_mutex_init(&arenas[i].lock.mutex, nullptr);
+    }
+    pthread_mutex_init(&growth_lock.mutex, nullptr);
+    pthread_mutex_init(&tcache_list_lock.mutex, nullptr);
+    for (int i = 0; i < CPU_CACHE_COUNT; i++)
+    {
+        pthread_mutex_init(&cpu_caches[i].lock.mutex, nullptr);
+        for (int j = 0; j < SLAB_CLASS_COUNT; j++)
+        {
+            cpu_caches[i].bins[j].max_depth = TCACHE_DEPTH;
+        }
+    }
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+    {
+        pthread_mutex_init(&transfer_caches[i].lock.mutex, nullptr);
+    }
+    pthread_key_create(&tcache_key, tcache_destroy);
+    scavenge_last_ms = get_time_ms();
+    use_membarrier = syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+    use_rseq = rseq_register();
+    for (int i = USE_THP_HEAP ? 0 : 1; i < ARENA_COUNT; i++)
+    {
+        arenas[i].region_start = arenas[i].region_top = reserve_region(ARENA_REGION_SIZE, MALLOC_PAGE_SIZE);
+    }
+    if (USE_SLABS)
+    {
+        page_region_start = page_region_top = reserve_region(PAGE_REGION_SIZE, MALLOC_PAGE_SIZE);
+    }
+    if (USE_RUNS)
+    {
+        run_region_start = run_region_top = reserve_region(RUN_REGION_SIZE, CHUNK_SIZE);
+    }
+    __atomic_store_n(&malloc_initialized, true, __ATOMIC_RELEASE);
+}
+
+
+
+
+/**
+ * @function:   static void fork_prepare()
+ * @brief:      before fork: take every lock, so the child gets the allocator in a consistent
+ *              state (no other thread is in the middle of changing it). Does nothing if malloc_4
+ *              was never initialized (nothing to protect, and another engine may be in use).
+ */
+static void fork_prepare()
+{
+    if (!__atomic_load_n(&malloc_initialized, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+    lock_all();
+    fork_locked = true;
+}
+
+
+
+/**
+ * @function:   static void fork_parent()
+ * @brief:      after fork, in the parent: give every lock back.
+ */
+static void fork_parent()
+{
+    if (fork_locked)
+    {
+        fork_locked = false;
+        unlock_all();
+    }
+}
+
+
+
+/**
+ * @function:   static void fork_child()
+ * @brief:      after fork, in the child (the only thread left): give every lock back and
+ *              register the new process for membarrier. The other threads' caches stay in the
+ *              list, for the scavenger to empty.
+ */
+static void fork_child()
+{
+    if (!fork_locked)
+    {
+        return;
+    }
+    fork_locked = false;
+    unlock_all();
+    use_membarrier = syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+    use_rseq = rseq_register();
+}
+
+
+
+/**
+ * @function:   static void malloc_fork_init()
+ * @brief:      make fork go through fork_prepare / fork_parent / fork_child. Runs at load time,
+ *              not on the first smalloc, since pthread_atfork may call malloc (which is
+ *              smalloc in the preloaded library, see preload.cpp).
+ */
+__attribute__((constructor)) static void malloc_fork_init()
+{
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+
+
+/**
+ * @function:   static arena_t* get_arena(void* p)
+ * @brief:      get the arena of a heap block (or arena 0, the sbrk heap, for an mmap block), by
+ *              the arenas' regions.
+ */
+static arena_t* get_arena(void* p)
+{
+    for (int i = 1; i < ARENA_COUNT; i++)
+    {
+        if (arenas[i].region_start && (uintptr_t)p - (uintptr_t)arenas[i].region_start < ARENA_REGION_SIZE)
+        {
+            return &arenas[i];
+        }
+    }
+    return &arenas[0];
+}
+
+
+
+/**
+ * @function:   static arena_t* get_thread_arena()
+ * @brief:      get the calling thread's arena, the threads take the arenas round-robin on their
+ *              first heap allocation.
+ */
+static arena_t* get_thread_arena()
+{
+    if (!thread_arena)
+    {
+        thread_arena = &arenas[__atomic_fetch_add(&arena_threads, 1, __ATOMIC_RELAXED) % ARENA_COUNT];
+    }
+    return thread_arena;
+}
+
+
+
+/**
+ * @function:   static void mmap_free(MallocMetadata* block)
+ * @brief:      unmap an mmap block (its header's page and its payload's pages).
+ */
+static void mmap_free(MallocMetadata* block)
+{
+    lock(&growth_lock);
+    mmap_blocks_count--;
+    mmap_bytes_count -= GET_METADATA_SIZE(block);
+    if (IS_METADATA_HUGETLB(block))
+    {
+        huge_pages_count -= GET_METADATA_SIZE(block) / HUGE_PAGE_SIZE;
+    }
+    unlock(&growth_lock);
+    munmap((char*)block - block->prev_size, block->prev_size + GET_METADATA_SIZE(block) + sizeof(malloc_metadata_t));
+}
+
+
+
+/**
+ * @function:   static void mmap_drain_remote_frees()
+ * @brief:      unmap the mmap blocks taken from arena 0's remote frees (call with no lock held).
+ */
+static void mmap_drain_remote_frees()
+{
+    for (void* p = remote_take(&mmap_remote_frees); p != nullptr; )
+    {
+        void* next = *(void**)p;
+        mmap_free(GET_METADATA_FROM_PTR(p));
+        p = next;
+    }
+}
+
+
+
+/**
+ * @function:   static void arena_drain_remote_frees(arena_t* arena)
+ * @brief:      free the blocks of the arena's remote frees (call with the arena's lock held).
+ *              The mmap blocks (arena 0's) move to mmap_remote_frees, unmapped once the lock
+ *              is released (see mmap_drain_remote_frees), so no system call holds the lock.
+ */
+static void arena_drain_remote_frees(arena_t* arena)
+{
+    void* mmap_first = nullptr;
+    void* mmap_last = nullptr;
+    for (void* p = remote_take(&arena->remote_frees); p != nullptr; )
+    {
+        void* next = *(void**)p;
+        MallocMetadata* block = GET_METADATA_FROM_PTR(p);
+        if (IS_METADATA_MMAPPED(block))
+        {
+            *(void**)p = mmap_first;
+            mmap_first = p;
+            mmap_last = mmap_last ? mmap_last : p;
+        }
+        else if (!GET_METADATA_IS_FREE(block))
+        {
+            free_block(arena, block);
+        }
+        p = next;
+    }
+    if (mmap_first)
+    {
+        remote_push_list(&mmap_remote_frees, mmap_first, mmap_last);
+    }
+}
+
+
+
+/**
+ * @function:   static MallocMetadata* heap_alloc(arena_t* arena, size_t size)
+ * @brief:      allocate a block from the arena, after freeing its remote frees: a free'd block,
+ *              the (extended) last block or a new block at the arena's break (call with the
+ *              arena's lock held).
+ * 
+ * @returns:
+ *     - Success: a pointer to the block.
+ *
+ *     - Failure:
+ *          If the arena can't grow, returns nullptr.
+ */
+static MallocMetadata* heap_alloc(arena_t* arena, size_t size)
+{
+    arena_drain_remote_frees(arena);
+
+    // try to use free'd block
+    MallocMetadata* freed = get_free_metadata_block(arena, size);
+
+    if (freed != nullptr)
+    {
+        return freed;
+    }
+
+    // try to expand the last brk
+    MallocMetadata* last = get_last_free_block(arena);
+    if (last)
+    {
+        remove_from_bin(arena, last);
+        if (extend_last_block(arena, last, size))
+        {
+            set_block_is_free(last, false);
+            return last;
+        }
+        insert_block_to_bin(arena, last);
+    }
+
+    return sbrk_new_block(arena, size);
+}
+
+
+
+
+/**
+ * @function:   static void* heap_realloc(arena_t* arena, MallocMetadata* old_ptr, size_t size)
+ * @brief:      resize a heap block in place: reuse it, merge it with its free neighbours or
+ *              expand it if it's the last block (call with the arena's lock held).
+ * 
+ * @returns:
+ *     - Success: a pointer to the first byte of the resized block (the data is moved to it).
+ *
+ *     - Failure:
+ *          If the block can't be resized in place, returns nullptr (and nothing changes).
+ */
+static void* heap_realloc(arena_t* arena, MallocMetadata* old_ptr, size_t size)
+{
+    MallocMetadata* prev = get_prev_free_block(old_ptr);
+    MallocMetadata* next = get_next_block(old_ptr);
+    if (next && !GET_METADATA_IS_FREE(next))
+    {
+        next = nullptr;
+    }
+    
+    // Try to reuse the current block without any merging
+    if (GET_METADATA_SIZE(old_ptr) >= size)
+    {
+        if (IS_LARGE_ENOUGH(GET_METADATA_SIZE(old_ptr), size))
+        {
+            cut_block(arena, old_ptr, size);
+        }
+        return GET_PTR_FROM_METADATA(old_ptr);
+    }
+
+    // Try to merge with the adjacent block with the lower address.
+    else if (prev && GET_METADATA_SIZE(prev) + GET_METADATA_SIZE(old_ptr) >= size)
+    {
+        remove_from_bin(arena, prev);
+        SET_METADATA_SIZE(prev, GET_METADATA_SIZE(prev) + GET_METADATA_SIZE(old_ptr) + sizeof(malloc_metadata_t));
+        set_block_is_free(prev, false);
+        memmove(GET_PTR_FROM_METADATA(prev), GET_PTR_FROM_METADATA(old_ptr), MMIN(size, GET_METADATA_SIZE(old_ptr)));
+        if (IS_LARGE_ENOUGH(GET_METADATA_SIZE(prev), size))
+        {
+            cut_block(arena, prev, size);
+        }
+        return GET_PTR_FROM_METADATA(prev);
+    }
+
+    // Try to merge with the adjacent block with the higher address.
+    else if (next && GET_METADATA_SIZE(next) + GET_METADATA_SIZE(old_ptr) >= size)
+    {
+        remove_from_bin(arena, next);
+        SET_METADATA_SIZE(old_ptr, GET_METADATA_SIZE(old_ptr) + GET_METADATA_SIZE(next) + sizeof(malloc_metadata_t));
+        set_block_is_free(old_ptr, false);
+        if (IS_LARGE_ENOUGH(GET_METADATA_SIZE(old_ptr), size))
+        {
+            cut_block(arena, old_ptr, size);
+        }
+        return GET_PTR_FROM_METADATA(old_ptr);
+    }
+
+    // Try to merge all those three adjacent blocks together
+    else if (prev && next && GET_METADATA_SIZE(prev) + GET_METADATA_SIZE(next) + GET_METADATA_SIZE(old_ptr) >= size)
+    {
+        remove_from_bin(arena, prev);
+        remove_from_bin(arena, next);
+        SET_METADATA_SIZE(prev, GET_METADATA_SIZE(prev) + GET_METADATA_SIZE(old_ptr) + GET_METADATA_SIZE(next) + 2*sizeof(malloc_metadata_t));
+        set_block_is_free(prev, false);
+        memmove(GET_PTR_FROM_METADATA(prev), GET_PTR_FROM_METADATA(old_ptr), MMIN(size, GET_METADATA_SIZE(old_ptr)));
+        if (IS_LARGE_ENOUGH(GET_METADATA_SIZE(prev), size))
+        {
+            cut_block(arena, prev, size);
+        }
+        return GET_PTR_FROM_METADATA(prev);
+    }
+
+    // Try to expand the last block (and take the free space before it also)
+    size_t prev_space = prev ? GET_METADATA_SIZE(prev) + sizeof(malloc_metadata_t) : 0;
+    if (get_next_block(old_ptr) == nullptr &&
+        (GET_METADATA_SIZE(old_ptr) + prev_space >= size || extend_last_block(arena, old_ptr, size - prev_space)))
+    {
+        if (!prev)
+        {
+            return GET_PTR_FROM_METADATA(old_ptr);
+        }
+        remove_from_bin(arena, prev);
+        SET_METADATA_SIZE(prev, GET_METADATA_SIZE(prev) + GET_METADATA_SIZE(old_ptr) + sizeof(malloc_metadata_t));
+        set_block_is_free(prev, false);
+        memmove(GET_PTR_FROM_METADATA(prev), GET_PTR_FROM_METADATA(old_ptr), MMIN(size, GET_METADATA_SIZE(old_ptr)));
+        return GET_PTR_FROM_METADATA(prev);
+    }
+
+    return nullptr;
+}
+
+
+
+/**
+ * @function:   static MallocMetadata* heap_memalign(arena_t* arena, size_t alignment, size_t size)
+ * @brief:      allocate a block whose payload is aligned to alignment: a block with alignment
+ *              bytes of room is taken from the arena, the slack before the aligned payload is
+ *              split off into a free block (moving one alignment further if it's too small to
+ *              be one) and the slack after size bytes too, like cut_block does (call with the
+ *              arena's lock held).
+ *
+ * @returns:
+ *     - Success: a pointer to the aligned block.
+ *
+ *     - Failure:
+ *          If the arena can't grow, returns nullptr.
+ */
+static MallocMetadata* heap_memalign(arena_t* arena, size_t alignment, size_t size)
+{
+    size_t min_lead = sizeof(malloc_metadata_t) + MIN_BLOCK_SIZE;
+    MallocMetadata* block = heap_alloc(arena, size + alignment + min_lead);
+    if (block == nullptr)
+    {
+        return nullptr;
+    }
+    uintptr_t payload = (uintptr_t)GET_PTR_FROM_METADATA(block);
+    uintptr_t aligned = (payload + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    if (aligned != payload)
+    {
+        if (aligned - payload < min_lead)
+        {
+            aligned += alignment;
+        }
+        MallocMetadata* lead = block;
+        block = GET_METADATA_FROM_PTR((void*)aligned);
+        INIT_METADATA(block, GET_METADATA_SIZE(lead) - (aligned - payload), BLOCK_PREV_IN_USE);
+        SET_METADATA_SIZE(lead, aligned - payload - sizeof(malloc_metadata_t));
+        free_block(arena, lead);
+    }
+    if (IS_LARGE_ENOUGH(GET_METADATA_SIZE(block), size))
+    {
+        cut_block(arena, block, size);
+    }
+    return block;
+}
+
+
+
+
+/**
+ * @function:   static void* small_alloc(size_t size)
+ * @brief:      allocate a slab slot of size's class, through the CPU's or the thread's cache.
+ * 
+ * @returns:
+ *     - Success: a pointer to the slot.
+ *
+ *     - Failure:
+ *          If no page is left for a new slab, returns nullptr.
+ */
+static void* small_alloc(size_t size)
+{
+    return USE_PERCPU_CACHE ? cpu_cache_alloc(size) : USE_TCACHE ? tcache_alloc(size) : slab_alloc(size);
+}
+
+
+
+/**
+ * @function:   static char* mmap_huge_reserve(size_t size, size_t alignment)
+ * @brief:      reserve (PROT_NONE, no memory) a range for a huge page block of size bytes: a
+ *              small page for the header, then the payload on an alignment boundary.
+ * 
+ * @returns:
+ *     - Success: the start of the range (the header's page).
+ *
+ *     - Failure:
+ *          If mmap fails, returns nullptr.
+ */
+static char* mmap_huge_reserve(size_t size, size_t alignment)
+{
+    size_t length = MALLOC_PAGE_SIZE + size + alignment;
+    char* ret = (char*)mmap(nullptr, length, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (ret == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    char* payload = (char*)(((uintptr_t)ret + MALLOC_PAGE_SIZE + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    char* start = payload - MALLOC_PAGE_SIZE;
+    if (start > ret)
+    {
+        munmap(ret, start - ret);
+    }
+    munmap(payload + size, ret + length - (payload + size));
+    return start;
+}
+
+
+
+/**
+ * @function:   static void* mmap_huge_alloc(size_t size, size_t alignment)
+ * @brief:      map a block of its own on huge pages: whole huge pages of payload, starting on a
+ *              huge page boundary (or the larger alignment), and the header at the end of a
+ *              small page of its own right before it, like mmap_alloc's. The range is reserved
+ *              first, then the payload is mapped over it with MAP_HUGETLB
+ *              (-DMALLOC_4_HUGE_PAGES=2). If no reserved huge page is left (or MAP_HUGETLB isn't
+ *              used) the block is mapped with small pages and advised with MADV_HUGEPAGE, for
+ *              the kernel to back it with transparent huge pages.
+ * 
+ * @returns:
+ *     - Success: a pointer to the payload.
+ *
+ *     - Failure:
+ *          If mmap fails, returns nullptr.
+ */
+static void* mmap_huge_alloc(size_t size, size_t alignment)
+{
+    alignment = MMAX(alignment, HUGE_PAGE_SIZE);
+    size = GET_SIZE_WITH_HUGE_PAGES(size);
+    char* start = mmap_huge_reserve(size, alignment);
+    if (!start)
+    {
+        return nullptr;
+    }
+    char* payload = start + MALLOC_PAGE_SIZE;
+
+    // the reserved huge pages, over the payload's part of the range (its header gets a small page)
+    size_t flags = BLOCK_MMAPPED;
+    if (USE_HUGETLB &&
+        mmap(payload, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_HUGETLB|(HUGE_PAGE_SHIFT << MAP_HUGE_SHIFT), -1, 0) != MAP_FAILED &&
+        mprotect(start, MALLOC_PAGE_SIZE, PROT_READ|PROT_WRITE) == 0)
+    {
+        flags |= BLOCK_HUGETLB;
+    }
+    // or small pages over the whole range, transparent huge pages if the kernel can
+    else
+    {
+        if (mmap(start, MALLOC_PAGE_SIZE + size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0) == MAP_FAILED)
+        {
+            munmap(start, MALLOC_PAGE_SIZE + size);
+            return nullptr;
+        }
+        madvise(start, MALLOC_PAGE_SIZE + size, MADV_HUGEPAGE);
+    }
+    MallocMetadata* block = GET_METADATA_FROM_PTR(payload);
+    block->prev_size = (char*)block - start;
+    INIT_METADATA(block, size, flags);
+    lock(&growth_lock);
+    mmap_blocks_count++;
+    mmap_bytes_count += size;
+    if (flags & BLOCK_HUGETLB)
+    {
+        huge_pages_count += size / HUGE_PAGE_SIZE;
+    }
+    unlock(&growth_lock);
+    return payload;
+}
+
+
+
+/**
+ * @function:   static void* mmap_alloc(size_t size, size_t alignment)
+ * @brief:      map a block of its own: whole pages of payload, aligned to a page at least. The
+ *              header sits at the end of a page of its own right before the payload and keeps
+ *              its offset from the start of the mapping in prev_size, for munmap (the mapping
+ *              is trimmed to the header's page and the payload's pages). The sizes of
+ *              HUGE_PAGE_SIZE and up go on huge pages with -DMALLOC_4_HUGE_PAGES (see
+ *              mmap_huge_alloc).
+ * 
+ * @returns:
+ *     - Success: a pointer to the payload.
+ *
+ *     - Failure:
+ *          If mmap fails, returns nullptr.
+ */
+static void* mmap_alloc(size_t size, size_t alignment)
+{
+    if (IS_HUGE_SIZE(size))
+    {
+        return mmap_huge_alloc(size, alignment);
+    }
+    alignment = MMAX(alignment, (size_t)MALLOC_PAGE_SIZE);
+    size = GET_SIZE_WITH_PAGES(size);
+    size_t length = alignment + size;
+    char* ret = (char*)mmap(nullptr, length, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (ret == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    char* payload = (char*)(((uintptr_t)ret + MALLOC_PAGE_SIZE + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    char* start = payload - MALLOC_PAGE_SIZE;
+    if (start > ret)
+    {
+        munmap(ret, start - ret);
+    }
+    if (payload + size < ret + length)
+    {
+        munmap(payload + size, ret + length - (payload + size));
+    }
+    MallocMetadata* block = GET_METADATA_FROM_PTR(payload);
+    block->prev_size = (char*)block - start;
+    INIT_METADATA(block, size, BLOCK_MMAPPED);
+    lock(&growth_lock);
+    mmap_blocks_count++;
+    mmap_bytes_count += size;
+    unlock(&growth_lock);
+    return payload;
+}
+
+
+
+/**
+ * @function:   static void* mmap_realloc(MallocMetadata* block, size_t size)
+ * @brief:      resize an mmap block to size bytes (at least MIN_KB_BLOCK, rounded up to pages)
+ *              with mremap: the kernel grows the mapping in place, or moves its pages to a
+ *              bigger range without copying them, and a smaller mapping gives its tail pages
+ *              back. The payload keeps its offset in the mapping, so it stays page aligned.
+ *              A block on transparent huge pages (see mmap_huge_alloc) is resized to whole huge
+ *              pages, and moved only into a reserved range whose payload is huge page aligned,
+ *              so it keeps its huge pages.
+ * 
+ * @returns:
+ *     - Success: a pointer to the resized block's payload.
+ *
+ *     - Failure:
+ *          If mremap fails, or the block is on reserved huge pages (its header's page is a
+ *          mapping apart), returns nullptr (and the block is left as is).
+ */
+static void* mmap_realloc(MallocMetadata* block, size_t size)
+{
+    if (IS_METADATA_HUGETLB(block))
+    {
+        return nullptr;
+    }
+    bool huge = IS_HUGE_SIZE(size);
+    size = huge ? GET_SIZE_WITH_HUGE_PAGES(size) : GET_SIZE_WITH_PAGES(size);
+    char* start = (char*)block - block->prev_size;
+    size_t old_length = block->prev_size + sizeof(malloc_metadata_t) + GET_METADATA_SIZE(block);
+    size_t new_length = block->prev_size + sizeof(malloc_metadata_t) + size;
+    if (new_length != old_length)
+    {
+        char* ret = (char*)mremap(start, old_length, new_length, huge ? 0 : MREMAP_MAYMOVE);
+        if (ret == MAP_FAILED && huge)
+        {
+            // no room to grow in place: move the pages into an aligned range
+            char* new_start = mmap_huge_reserve(size, HUGE_PAGE_SIZE);
+            if (!new_start)
+            {
+                return nullptr;
+            }
+            ret = (char*)mremap(start, old_length, new_length, MREMAP_MAYMOVE|MREMAP_FIXED, new_start);
+            if (ret == MAP_FAILED)
+            {
+                munmap(new_start, MALLOC_PAGE_SIZE + size);
+            }
+        }
+        if (ret == MAP_FAILED)
+        {
+            return nullptr;
+        }
+        block = (MallocMetadata*)(ret + (size_t)((char*)block - start));
+    }
+    lock(&growth_lock);
+    mmap_bytes_count += size - GET_METADATA_SIZE(block);
+    unlock(&growth_lock);
+    INIT_METADATA(block, size, BLOCK_MMAPPED);
+    return GET_PTR_FROM_METADATA(block);
+}
+
+
+
+/**
+ * @function:   void* smalloc(size_t size)
  * @brief:  Searches for a free block with up to ‘size’ bytes or allocates (sbrk())
  *          one if none are found.
  * 
  * @arguments:
- *     - size_t size: # of bytes to allocate.
+ *     - size_t size: # of bytes to allocate.
+ * 
+ * @returns:
+ *     - Success: a pointer to the first allocated byte within the allocated block.
+ *                (excluding the meta-data)
+ *
+ *     - Failure:
+ *          If ‘size’ is 0 returns nullptr.
+ *          If ‘size’ is more than 10^8 , return nullptr. 
+ *          If sbrk fails, return nullptr.
+ */
+void* smalloc(size_t size)
+{
+    if (size > MAX_MALLOC_4_SIZE || size == 0)
+    {
+        return nullptr;
+    }
+    size = MMAX(GET_SIZE_WITH_ALIGNMENT(size), MIN_BLOCK_SIZE);
+    pthread_once(&malloc_once, init_malloc);
+
+    // small enough for a slab, through the CPU's or the thread's cache (falls back to the heap
+    // if no page is left)
+    if (USE_SLABS && size <= SLAB_MAX_SIZE)
+    {
+        void* slot = small_alloc(size);
+        if (slot != nullptr)
+        {
+            return slot;
+        }
+    }
+
+    // medium sizes come from the runs (falls back to the heap if no chunk is left)
+    if (USE_RUNS && size > SLAB_MAX_SIZE && size < MIN_KB_BLOCK)
+    {
+        void* slot = run_alloc(size);
+        if (slot != nullptr)
+        {
+            return slot;
+        }
+    }
+
+    // the heap and mmap sizes give the scavenger a chance to run (the caches' slow paths do too)
+    scavenge_tick();
+
+    // to big for sbrk, use mmap (whole, page aligned pages)
+    if (size >= MIN_KB_BLOCK)
+    {
+        return mmap_alloc(size, MALLOC_ALIGNMENT);
+    }
+
+    // the thread's arena (falls back to arena 0 if the arena's region is full)
+    arena_t* arena = get_thread_arena();
+    lock(&arena->lock);
+    MallocMetadata* mt = heap_alloc(arena, size);
+    unlock(&arena->lock);
+    if (mt == nullptr && arena != &arenas[0])
+    {
+        lock(&arenas[0].lock);
+        mt = heap_alloc(&arenas[0], size);
+        unlock(&arenas[0].lock);
+    }
+    mmap_drain_remote_frees();
+    if (mt == nullptr)
+    {
+        return nullptr;
+    }
+    return GET_PTR_FROM_METADATA(mt);
+}
+
+
+
+
+
+/**
+ * @function:   void* scalloc(size_t num, size_t size)
+ * @brief:  Searches for a free block of up to ‘num’ elements, each ‘size’ bytes that 
+ *          are all set to 0 or allocates if none are found.
+ * 
+ * @arguments:
+ *     - size_t num: # of elements to allocate.
+ *     - size_t size: size (bytes) of each element.
+ * 
+ * @returns:
+ *     - Success: - returns pointer to the first byte in the allocated block.
+ *
+ *     - Failure:
+ *          If ‘size’ is 0 returns nullptr.
+ *          If ‘size’ is more than 10^8 , return nullptr. 
+ *          If sbrk fails, return nullptr.
+ */
+void* scalloc(size_t num, size_t size)
+{
+    if (size != 0 && num > MAX_MALLOC_4_SIZE / size)
+    {
+        return nullptr;
+    }
+    void* res = smalloc(num * size);
+    if (res != nullptr)
+    {
+        // the mmap blocks are fresh pages, already zeroed
+        if (num * size < MIN_KB_BLOCK)
+        {
+            memset(res, 0, num * size);
+        }
+        return res;
+    }
+    return nullptr;
+}
+
+
+
+/**
+ * @function:   void sfree(void* p)
+ * @brief:  Releases the usage of the block that starts with the pointer ‘p’. 
+ * 
+ * @arguments:
+ *     - void* p: pointer to allocated block to free.
+ *                If ‘p’ is nullptr or already released, simply returns.
+ *                Presume that all pointers ‘p’ truly points to the beginning of an allocated block.
+ * 
+ * @returns:
+ *     None
+ */
+void sfree(void* p)
+{
+    if (p == nullptr)
+    {
+        return;
+    }
+    // slab slot
+    if (IS_SLAB_PTR(p))
+    {
+        if (USE_PERCPU_CACHE)
+        {
+            cpu_cache_free(p);
+        }
+        else if (USE_TCACHE)
+        {
+            tcache_free(p);
+        }
+        else
+        {
+            slab_free(p);
+        }
+        return;
+    }
+    // run slot
+    if (IS_RUN_PTR(p))
+    {
+        run_free(p);
+        return;
+    }
+    MallocMetadata* to_free =  GET_METADATA_FROM_PTR(p);
+
+    // heap block (merged with its free neighbours by the boundary tags) or mmap block (arena
+    // 0's). The header is read with the arena's lock held, its neighbours update its flags.
+    // If another thread holds the lock the block goes to the arena's remote frees, drained by
+    // whoever takes the lock next (tried again right away, the holder may have just left).
+    arena_t* arena = get_arena(to_free);
+    if (!try_lock(&arena->lock))
+    {
+        remote_push(&arena->remote_frees, p);
+        if (try_lock(&arena->lock))
+        {
+            arena_drain_remote_frees(arena);
+            unlock(&arena->lock);
+        }
+        mmap_drain_remote_frees();
+        return;
+    }
+    arena_drain_remote_frees(arena);
+    bool mmapped = IS_METADATA_MMAPPED(to_free);
+    if (!mmapped && !GET_METADATA_IS_FREE(to_free))
+    {
+        free_block(arena, to_free);
+    }
+    unlock(&arena->lock);
+    if (mmapped)
+    {
+        mmap_free(to_free);
+    }
+    mmap_drain_remote_frees();
+    return;
+}
+
+
+
+/**
+ * @function:   void* srealloc(void* oldp, size_t size)
+ * @brief:  If ‘size’ is smaller than the current block’s size, reuses the same block.
+ *          Otherwise, finds/allocates ‘size’ bytes for a new space, copies content of oldp
+ *          into the new allocated space and frees the oldp. An mmap block that stays mmap is
+ *          remapped instead (see mmap_realloc), so its content isn't copied.
+ * 
+ * @arguments:
+ *     - void* oldp: pointer to block-to-copy.
+ *     - size_t size: # of bytes to allocate.
+ * 
+ * @returns:
+ *     - Success:
+ *          Returns pointer to the first byte in the (newly) allocated space.
+ *          If ‘oldp’ is nullptr, allocates space for ‘size’ bytes and returns a pointer to it.
+ *
+ *     - Failure:
+ *          If ‘size’ is 0 returns nullptr.
+ *          If ‘size’ is more than 10^8 , return nullptr. 
+ *          If sbrk fails, return nullptr.
+ */
+void* srealloc(void* oldp, size_t size)
+{
+    if (size > MAX_MALLOC_4_SIZE || size == 0)
+    {
+        return nullptr;
+    }
+    size = MMAX(GET_SIZE_WITH_ALIGNMENT(size), MIN_BLOCK_SIZE);
+
+    if (oldp == nullptr)
+    {
+        return smalloc(size);
+    }
+
+    // ** oldp is a slab or a run slot **
+    if (IS_SLAB_PTR(oldp) || IS_RUN_PTR(oldp))
+    {
+        size_t slot_size = IS_SLAB_PTR(oldp) ? slab_class_table.slot_size[GET_SLAB(oldp)->size_class] :
+                                               run_class_table.slot_size[get_run(oldp)->size_class];
+        if (size <= slot_size)
+        {
+            return oldp;
+        }
+        void* ret = smalloc(size);
+        if (!ret) return nullptr;
+        memmove(ret, oldp, slot_size);
+        sfree(oldp);
+        return ret;
+    }
+
+    MallocMetadata* old_ptr = GET_METADATA_FROM_PTR(oldp);
+
+    // ** oldp is a heap block (try in place, in its own arena) or mmap (moved) **
+    arena_t* arena = get_arena(old_ptr);
+    lock(&arena->lock);
+    size_t old_size = GET_METADATA_SIZE(old_ptr);
+    bool mmapped = IS_METADATA_MMAPPED(old_ptr);
+    void* ret = mmapped ? nullptr : heap_realloc(arena, old_ptr, size);
+    unlock(&arena->lock);
+    mmap_drain_remote_frees();
+    if (ret)
+    {
+        return ret;
+    }
+
+    // ** oldp is on huge pages, and still takes as many: nothing to do **
+    if (mmapped && IS_HUGE_SIZE(old_size) && IS_HUGE_SIZE(size) && GET_SIZE_WITH_HUGE_PAGES(size) == old_size)
+    {
+        return oldp;
+    }
+
+    // ** oldp is mmap and stays mmap (on the same kind of pages): remap its pages instead of
+    // copying them (a MAP_HUGETLB block is copied, its header's page is a mapping apart) **
+    if (USE_MREMAP && mmapped && size >= MIN_KB_BLOCK && !IS_METADATA_HUGETLB(old_ptr) &&
+        IS_HUGE_SIZE(size) == IS_HUGE_SIZE(old_size))
+    {
+        ret = mmap_realloc(old_ptr, size);
+        if (ret)
+        {
+            return ret;
+        }
+    }
+
+    // Allocate a new block
+    ret = smalloc(size);
+    if (!ret) return nullptr;
+    memmove(ret, oldp, MMIN(size, old_size));
+    sfree(oldp);
+    return ret;
+}
+
+
+
+/**
+ * @function:   void* smemalign(size_t alignment, size_t size)
+ * @brief:  Allocates ‘size’ bytes aligned to ‘alignment’ (a power of 2). Every block is
+ *          MALLOC_ALIGNMENT aligned, a larger alignment takes:
+ *          - a slab slot whose size is a multiple of it (the slabs' header is SLAB_ALIGNMENT long),
+ *          - the run slot of the size's class if its size is a multiple of it (the runs start at
+ *            a page),
+ *          - or else a heap block, the slack before and after the aligned payload split off
+ *            into free blocks (see heap_memalign), or a block of its own mapped with the
+ *            alignment if that doesn't fit the heap.
+ *          So the block starts at the returned address, and sfree / srealloc take it as is.
+ * 
+ * @arguments:
+ *     - size_t alignment: the alignment (a power of 2).
+ *     - size_t size: # of bytes to allocate.
+ * 
+ * @returns:
+ *     - Success: a pointer to the first allocated byte, aligned.
+ *
+ *     - Failure:
+ *          If ‘size’ is 0 or ‘alignment’ isn't a power of 2 returns nullptr.
+ *          If ‘size’ is more than 10^8 , return nullptr.
+ *          If sbrk or mmap fails, return nullptr.
+ */
+void* smemalign(size_t alignment, size_t size)
+{
+    if (size > MAX_MALLOC_4_SIZE || size == 0 || alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        return nullptr;
+    }
+    if (alignment <= MALLOC_ALIGNMENT)
+    {
+        return smalloc(size);
+    }
+    size = MMAX(GET_SIZE_WITH_ALIGNMENT(size), MIN_BLOCK_SIZE);
+    pthread_once(&malloc_once, init_malloc);
+
+    if (USE_SLABS && alignment <= SLAB_ALIGNMENT && size <= SLAB_MAX_SIZE)
+    {
+        for (int i = GET_SLAB_CLASS(size); i < SLAB_CLASS_COUNT; i++)
+        {
+            if (slab_class_table.slot_size[i] % alignment == 0)
+            {
+                void* slot = small_alloc(slab_class_table.slot_size[i]);
+                if (slot != nullptr)
+                {
+                    return slot;
+                }
+                break;
+            }
+        }
+    }
+    if (USE_RUNS && alignment <= MALLOC_PAGE_SIZE && size > SLAB_MAX_SIZE && size < MIN_KB_BLOCK &&
+        run_class_table.slot_size[GET_RUN_CLASS(size)] % alignment == 0)
+    {
+        void* slot = run_alloc(size);
+        if (slot != nullptr)
+        {
+            return slot;
+        }
+    }
+
+    scavenge_tick();
+
+    if (size + alignment >= MIN_KB_BLOCK)
+    {
+        return mmap_alloc(size, alignment);
+    }
+
+    // the thread's arena (falls back to arena 0 if the arena's region is full)
+    arena_t* arena = get_thread_arena();
+    lock(&arena->lock);
+    MallocMetadata* mt = heap_memalign(arena, alignment, size);
+    unlock(&arena->lock);
+    if (mt == nullptr && arena != &arenas[0])
+    {
+        lock(&arenas[0].lock);
+        mt = heap_memalign(&arenas[0], alignment, size);
+        unlock(&arenas[0].lock);
+    }
+    mmap_drain_remote_frees();
+    if (mt == nullptr)
+    {
+        return nullptr;
+    }
+    return GET_PTR_FROM_METADATA(mt);
+}
+
+
+
+/**
+ * @function:   void* saligned_alloc(size_t alignment, size_t size)
+ * @brief:  Allocates ‘size’ bytes aligned to ‘alignment’ (see smemalign).
+ * 
+ * @arguments:
+ *     - size_t alignment: the alignment (a power of 2).
+ *     - size_t size: # of bytes to allocate.
+ * 
+ * @returns:
+ *     - Success: a pointer to the first allocated byte, aligned.
+ *
+ *     - Failure:
+ *          If ‘size’ is 0 or ‘alignment’ isn't a power of 2 returns nullptr.
+ *          If ‘size’ is more than 10^8 , return nullptr.
+ *          If sbrk or mmap fails, return nullptr.
+ */
+void* saligned_alloc(size_t alignment, size_t size)
+{
+    return smemalign(alignment, size);
+}
+
+
+
+/**
+ * @function:   int sposix_memalign(void** memptr, size_t alignment, size_t size)
+ * @brief:  Allocates ‘size’ bytes aligned to ‘alignment’ (see smemalign) into ‘*memptr’.
+ * 
+ * @arguments:
+ *     - void** memptr: where to put the block (set to nullptr if ‘size’ is 0).
+ *     - size_t alignment: the alignment (a power of 2 and a multiple of sizeof(void*)).
+ *     - size_t size: # of bytes to allocate.
+ * 
+ * @returns:
+ *     - Success: 0.
+ *
+ *     - Failure:
+ *          If ‘alignment’ isn't a power of 2 or a multiple of sizeof(void*) returns EINVAL.
+ *          If ‘size’ is more than 10^8 or sbrk or mmap fails, returns ENOMEM (and ‘*memptr’
+ *          is left as is).
+ */
+int sposix_memalign(void** memptr, size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment % sizeof(void*) != 0)
+    {
+        return EINVAL;
+    }
+    if (size == 0)
+    {
+        *memptr = nullptr;
+        return 0;
+    }
+    void* p = smemalign(alignment, size);
+    if (p == nullptr)
+    {
+        return ENOMEM;
+    }
+    *memptr = p;
+    return 0;
+}
+
+
+
+/**
+ * @function:   size_t smalloc_usable_size(void* p)
+ * @brief:  The # of bytes the block at ‘p’ can hold (at least the size it was allocated with).
+ * 
+ * @arguments:
+ *     - void* p: a block from smalloc / scalloc / srealloc / smemalign / saligned_alloc /
+ *                sposix_memalign (or nullptr).
+ * 
+ * @returns:
+ *     the block's size (its slot's size for the slabs and runs), 0 for nullptr.
+ */
+size_t smalloc_usable_size(void* p)
+{
+    if (p == nullptr)
+    {
+        return 0;
+    }
+    if (IS_SLAB_PTR(p))
+    {
+        return slab_class_table.slot_size[GET_SLAB(p)->size_class];
+    }
+    if (IS_RUN_PTR(p))
+    {
+        return run_class_table.slot_size[get_run(p)->size_class];
+    }
+    MallocMetadata* block = GET_METADATA_FROM_PTR(p);
+    arena_t* arena = get_arena(block);
+    lock(&arena->lock);
+    size_t size = GET_METADATA_SIZE(block);
+    unlock(&arena->lock);
+    return size;
+}
+
+
+
+/**
+ * @function:   static void spool_push(spool_t* pool, void* first, void* last)
+ * @brief:      push the linked objects first .. last on the pool's free stack, with one
+ *              compare and swap.
+ */
+static void spool_push(spool_t* pool, void* first, void* last)
+{
+    uint64_t top = __atomic_load_n(&pool->top, __ATOMIC_RELAXED);
+    do
+    {
+        __atomic_store_n((void**)last, SPOOL_GET_PTR(top), __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&pool->top, &top, SPOOL_TAGGED(first, top), true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+
+/**
+ * @function:   static void* spool_grow(spool_t* pool)
+ * @brief:      take a new chunk with smalloc, keep its first object for the caller and push
+ *              the others on the pool's free stack (threads that find the stack empty at the
+ *              same time grow it each).
+ * 
+ * @returns:
+ *     - Success: the chunk's first object.
+ *
+ *     - Failure:
+ *          If smalloc fails, returns nullptr.
+ */
+static void* spool_grow(spool_t* pool)
+{
+    char* chunk = (char*)smalloc(SPOOL_CHUNK_HEADER + pool->chunk_objects * pool->object_size);
+    if (chunk == nullptr)
+    {
+        return nullptr;
+    }
+    char* first = chunk + SPOOL_CHUNK_HEADER;
+    for (size_t i = 1; i + 1 < pool->chunk_objects; i++)
+    {
+        *(void**)(first + i * pool->object_size) = first + (i + 1) * pool->object_size;
+    }
+    spool_push(pool, first + pool->object_size, first + (pool->chunk_objects - 1) * pool->object_size);
+    void* head = __atomic_load_n(&pool->chunks, __ATOMIC_RELAXED);
+    do
+    {
+        *(void**)chunk = head;
+    } while (!__atomic_compare_exchange_n(&pool->chunks, &head, chunk, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return first;
+}
+
+
+
+/**
+ * @function:   spool_t* spool_create(size_t size)
+ * @brief:      create a lock free pool of ‘size’ bytes objects (see spool_t).
+ * 
+ * @arguments:
+ *     - size_t size: # of bytes of every object.
  * 
  * @returns:
- *     - Success: a pointer to the first allocated byte within the allocated block.
- *                (excluding the meta-data)
+ *     - Success: the pool.
+ *
+ *     - Failure:
+ *          If ‘size’ is 0 or a chunk of SPOOL_MIN_OBJECTS objects (aligned, with the chunk's
+ *          header) is more than 10^8 bytes, returns nullptr.
+ *          If smalloc fails, returns nullptr.
+ */
+spool_t* spool_create(size_t size)
+{
+    if (size == 0 || size > MAX_MALLOC_4_SIZE)
+    {
+        return nullptr;
+    }
+
+    // the smallest chunk spool_grow asks for, SPOOL_CHUNK_HEADER + SPOOL_MIN_OBJECTS *
+    // object_size, must fit in smalloc's limit (divided, so it can't overflow)
+    size_t object_size = MMAX(GET_SIZE_WITH_ALIGNMENT(size), sizeof(void*));
+    if (object_size > (MAX_MALLOC_4_SIZE - SPOOL_CHUNK_HEADER) / SPOOL_MIN_OBJECTS)
+    {
+        return nullptr;
+    }
+    spool_t* pool = (spool_t*)smalloc(sizeof(spool_t));
+    if (pool == nullptr)
+    {
+        return nullptr;
+    }
+    pool->top = 0;
+    pool->object_size = object_size;
+    pool->chunk_objects = MMAX((SPOOL_CHUNK_SIZE - SPOOL_CHUNK_HEADER) / object_size, (size_t)SPOOL_MIN_OBJECTS);
+    pool->chunks = nullptr;
+    return pool;
+}
+
+
+
+/**
+ * @function:   void* spool_alloc(spool_t* pool)
+ * @brief:      pop an object from the pool's free stack (lock free), or grow the pool if it
+ *              has none.
+ * 
+ * @arguments:
+ *     - spool_t* pool: the pool (see spool_create).
+ * 
+ * @returns:
+ *     - Success: a pointer to the object.
+ *
+ *     - Failure:
+ *          If the pool has no free object and smalloc fails, returns nullptr.
+ */
+void* spool_alloc(spool_t* pool)
+{
+    uint64_t top = __atomic_load_n(&pool->top, __ATOMIC_ACQUIRE);
+    while (SPOOL_GET_PTR(top) != nullptr)
+    {
+        void* next = __atomic_load_n((void**)SPOOL_GET_PTR(top), __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&pool->top, &top, SPOOL_TAGGED(next, top), true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+        {
+            return SPOOL_GET_PTR(top);
+        }
+    }
+    return spool_grow(pool);
+}
+
+
+
+/**
+ * @function:   void spool_free(spool_t* pool, void* p)
+ * @brief:      push the object back on its pool's free stack (lock free, from any thread).
+ * 
+ * @arguments:
+ *     - spool_t* pool: the pool the object was taken from.
+ *     - void* p: the object (nullptr is ignored).
+ */
+void spool_free(spool_t* pool, void* p)
+{
+    if (p == nullptr)
+    {
+        return;
+    }
+    spool_push(pool, p, p);
+}
+
+
+
+/**
+ * @function:   void spool_destroy(spool_t* pool)
+ * @brief:      give the pool's chunks and the pool back with sfree (once none of its objects
+ *              is used anymore).
+ * 
+ * @arguments:
+ *     - spool_t* pool: the pool (nullptr is ignored).
+ */
+void spool_destroy(spool_t* pool)
+{
+    if (pool == nullptr)
+    {
+        return;
+    }
+    void* chunk = pool->chunks;
+    while (chunk)
+    {
+        void* next = *(void**)chunk;
+        sfree(chunk);
+        chunk = next;
+    }
+    sfree(pool);
+}
+
+
+
+/**
+ * @function:   static void lock_stats()
+ * @brief:      give the CPUs', the calling thread's (out of the scavenger's way) and the
+ *              transfer caches' slots back to the slabs, drain the remote frees and take every
+ *              lock, for the stats (the slots other threads cache count as used).
+ */
+static void lock_stats()
+{
+    if (USE_PERCPU_CACHE)
+    {
+        for (int i = 0; i < CPU_CACHE_COUNT; i++)
+        {
+            if (!cpu_cache_in_use(i))
+            {
+                continue;
+            }
+            cpu_cache_stop(i);
+            for (int j = 0; j < SLAB_CLASS_COUNT; j++)
+            {
+                tcache_bin_t bin;
+                cpu_bin_load(&cpu_caches[i].bins[j], &bin);
+                cache_bin_flush(&bin, j, bin.count);
+                cpu_bin_store(&cpu_caches[i].bins[j], &bin);
+            }
+            cpu_cache_start(i);
+        }
+    }
+    if (USE_TCACHE)
+    {
+        lock(&tcache_list_lock);
+        cache_flush_all(tcache.bins);
+        unlock(&tcache_list_lock);
+    }
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+    {
+        transfer_flush_all(i);
+        lock(&slab_locks[i]);
+        slab_drain_remote_frees(i);
+        unlock(&slab_locks[i]);
+    }
+    for (int i = 0; i < RUN_CLASS_COUNT; i++)
+    {
+        lock(&run_locks[i]);
+        run_drain_remote_frees(i);
+        unlock(&run_locks[i]);
+    }
+    for (int i = 0; i < ARENA_COUNT; i++)
+    {
+        lock(&arenas[i].lock);
+        arena_drain_remote_frees(&arenas[i]);
+        unlock(&arenas[i].lock);
+    }
+    mmap_drain_remote_frees();
+    lock_all();
+}
+
+
+
+/**
+ * @function:   static size_t arena_free_blocks(arena_t* arena)
+ * @brief:      # of free blocks in the arena (call with the arena's lock held).
+ */
+static size_t arena_free_blocks(arena_t* arena)
+{
+    size_t result = 0;
+    HEAP_FOR_EACH(arena, block)
+    {
+        if (GET_METADATA_IS_FREE(block)) result++;
+    }
+    return result;
+}
+
+
+
+/**
+ * @function:   static size_t arena_free_bytes(arena_t* arena)
+ * @brief:      # of bytes in the arena's free blocks (call with the arena's lock held).
+ */
+static size_t arena_free_bytes(arena_t* arena)
+{
+    size_t result = 0;
+    HEAP_FOR_EACH(arena, block)
+    {
+        if (GET_METADATA_IS_FREE(block)) 
+            result += GET_METADATA_SIZE(block);
+    }
+    return result;
+}
+
+
+
+/**
+ * @function:   static size_t arena_allocated_blocks(arena_t* arena)
+ * @brief:      # of blocks (free and used) in the arena (call with the arena's lock held).
+ */
+static size_t arena_allocated_blocks(arena_t* arena)
+{
+    size_t result = 0;
+    HEAP_FOR_EACH(arena, block)
+    { 
+        result++;
+    }
+    return result;
+}
+
+
+
+/**
+ * @function:   static size_t arena_allocated_bytes(arena_t* arena)
+ * @brief:      # of bytes in the arena's blocks (free and used), excluding the meta-data
+ *              (call with the arena's lock held).
+ */
+static size_t arena_allocated_bytes(arena_t* arena)
+{
+    size_t result = 0;
+    HEAP_FOR_EACH(arena, block)
+    {
+        result += GET_METADATA_SIZE(block);
+    }
+    return result;
+}
+
+
+
+/**
+ * @function:   size_t _num_free_blocks()
+ *
+ * @returns:
+ *     Returns the number of allocated blocks in the heap that are currently free
+ *     (free slab and run slots included).
+ */
+size_t _num_free_blocks()
+{
+    lock_stats();
+    size_t result = 0;
+    for (int i = 0; i < ARENA_COUNT; i++)
+    {
+        result += arena_free_blocks(&arenas[i]);
+    }
+    PAGE_REGION_FOR_EACH(slab)
+    {
+        if (slab->size_class != SLAB_NO_CLASS)
+            result += slab_class_table.capacity[slab->size_class] - slab->used;
+    }
+    RUN_REGION_FOR_EACH(chunk, run)
+    {
+        if (run->size_class != RUN_NO_CLASS)
+            result += __builtin_popcountll(run->free_slots);
+    }
+    unlock_all();
+    return result;
+}
+
+
+
+/**
+ * @function:  size_t _num_free_bytes()
+ *
+ * @returns:
+ *     Returns the number of bytes in all allocated blocks in the heap that are 
+ *     currently free, excluding the bytes used by the meta-data structs.
+ */
+size_t _num_free_bytes()
+{
+    lock_stats();
+    size_t result = 0;
+    for (int i = 0; i < ARENA_COUNT; i++)
+    {
+        result += arena_free_bytes(&arenas[i]);
+    }
+    PAGE_REGION_FOR_EACH(slab)
+    {
+        if (slab->size_class != SLAB_NO_CLASS)
+            result += (size_t)(slab_class_table.capacity[slab->size_class] - slab->used) * slab_class_table.slot_size[slab->size_class];
+    }
+    RUN_REGION_FOR_EACH(chunk, run)
+    {
+        if (run->size_class != RUN_NO_CLASS)
+            result += (size_t)__builtin_popcountll(run->free_slots) * run_class_table.slot_size[run->size_class];
+    }
+    unlock_all();
+    return result;
+}
+
+
+/**
+ * @function:   size_t _num_allocated_blocks()
+ *
+ * @returns:
+ *      Returns the overall (free and used) number of allocated blocks in the heap
+ *      (every slot of the slabs and the runs included).
+ */
+size_t _num_allocated_blocks()
+{
+    lock_stats();
+    size_t result = mmap_blocks_count;
+    for (int i = 0; i < ARENA_COUNT; i++)
+    {
+        result += arena_allocated_blocks(&arenas[i]);
+    }
+    PAGE_REGION_FOR_EACH(slab)
+    {
+        if (slab->size_class != SLAB_NO_CLASS)
+            result += slab_class_table.capacity[slab->size_class];
+    }
+    RUN_REGION_FOR_EACH(chunk, run)
+    {
+        if (run->size_class != RUN_NO_CLASS)
+            result += run_class_table.slots[run->size_class];
+    }
+    unlock_all();
+    return result;
+}
+
+
+
+/**
+ * @function:  size_t _num_allocated_bytes()
+ *
+ * @returns:
+ *      Returns the overall number (free and used) of allocated bytes in the heap, 
+ *      excluding the bytes used by the meta-data structs.
+ */
+size_t _num_allocated_bytes()
+{
+    lock_stats();
+    size_t result = mmap_bytes_count;
+    for (int i = 0; i < ARENA_COUNT; i++)
+    {
+        result += arena_allocated_bytes(&arenas[i]);
+    }
+    PAGE_REGION_FOR_EACH(slab)
+    {
+        if (slab->size_class != SLAB_NO_CLASS)
+            result += (size_t)slab_class_table.capacity[slab->size_class] * slab_class_table.slot_size[slab->size_class];
+    }
+    RUN_REGION_FOR_EACH(chunk, run)
+    {
+        if (run->size_class != RUN_NO_CLASS)
+            result += (size_t)run_class_table.slots[run->size_class] * run_class_table.slot_size[run->size_class];
+    }
+    unlock_all();
+    return result;
+}
+
+
+
+/**
+ * @function:   size_t _num_meta_data_bytes()
+ *
+ * @returns:
+ *     Returns the overall number of meta-data bytes currently in the heap
+ *     (the segments' end fences are not counted, a slab counts its header only and a chunk
+ *     the pages of its header).
+ */
+size_t _num_meta_data_bytes()
+{
+    lock_stats();
+    size_t result = mmap_blocks_count * sizeof(malloc_metadata_t);
+    for (int i = 0; i < ARENA_COUNT; i++)
+    {
+        result += arena_allocated_blocks(&arenas[i]) * sizeof(malloc_metadata_t);
+    }
+    PAGE_REGION_FOR_EACH(slab)
+    {
+        if (slab->size_class != SLAB_NO_CLASS)
+            result += SLAB_HEADER_SIZE;
+    }
+    for (char* chunk = run_region_start; chunk < run_region_top; chunk += CHUNK_SIZE)
+    {
+        result += CHUNK_HEADER_PAGES * MALLOC_PAGE_SIZE;
+    }
+    unlock_all();
+    return result;
+}
+
+
+
+/**
+ * @function:   size_t _size_meta_data()
+ *
+ * @returns:
+ *     Returns the number of bytes of a single meta-data structure in your system.
+ */
+size_t _size_meta_data()
+{
+    return sizeof(malloc_metadata_t);
+}
+
+
+
+/**
+ * @function:   size_t _num_lock_contentions()
  *
- *     - Failure:
- *          If ‘size’ is 0 returns nullptr.
- *          If ‘size’ is more than 10^8 , return nullptr. 
- *          If sbrk fails, return nullptr.
+ * @returns:
+ *     Returns the number of times a thread had to wait for one of the allocator's locks
+ *     (every lock counts its own, see slab_locks, run_locks, the arenas', CPU caches' and
+ *     transfer caches' locks, tcache_list_lock and growth_lock).
  */
-void* smalloc(size_t size)
+size_t _num_lock_contentions()
 {
-    if (size > MAX_MALLOC_4_SIZE || size == 0)
+    size_t result = growth_lock.contentions + tcache_list_lock.contentions;
+    for (int i = 0; i < ARENA_COUNT; i++)
     {
-        return nullptr;
+        result += arenas[i].lock.contentions;
     }
-    size = GET_SIZE_WITH_ALIGNMENT(size);
-
-    // to big for sbrk, use mmap
-    if (size >= MIN_KB_BLOCK)
+    for (int i = 0; i < CPU_CACHE_COUNT; i++)
     {
-        void* ret = mmap(nullptr, size + sizeof(malloc_metadata_t), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-        if (ret == MAP_FAILED)
-        {
-            return nullptr;
-        }
-        MallocMetadata* mt = (MallocMetadata*)ret;
-        INIT_METADATA(mt, size, false, nullptr, nullptr, nullptr, nullptr);
-        insert_to_metadata_list(mt, &mmap_metadata_head);
-        return GET_PTR_FROM_METADATA(ret);
+        result += cpu_caches[i].lock.contentions;
     }
-    // try to use free'd block
-    MallocMetadata* freed = get_free_metadata_block(size);
-
-    if (freed != nullptr)
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++)
     {
-        return GET_PTR_FROM_METADATA(freed);
+        result += transfer_caches[i].lock.contentions;
     }
-
-    // try to expand the last brk
-
-    MallocMetadata* last = get_last_metadata_block(metadata_head);
-    if (last && last->is_free)
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++)
     {
-        void* ret = sbrk(GET_SIZE_WITH_ALIGNMENT(size) - last->size);
-        if ((intptr_t)ret == SBRK_FAIL)
-        {
-            return nullptr;
-        }
-
-        if (last->bin_prev == nullptr)
-        {
-            free_block_bin[GET_BIN_ENTRY(last->size)] = last->bin_next;
-        }
-        else
-        {
-            last->bin_prev->bin_next = last->bin_next;
-            if (last->bin_next)
-            {
-                last->bin_next->bin_prev = last->bin_prev;
-            }
-        }
-        last->is_free = false;
-        last->size = size;
-        return GET_PTR_FROM_METADATA(last);
+        result += slab_locks[i].contentions;
     }
-
-    void* ret = sbrk(size + sizeof(malloc_metadata_t));
-    if ((intptr_t)ret == SBRK_FAIL)
+    for (int i = 0; i < RUN_CLASS_COUNT; i++)
     {
-        return nullptr;
+        result += run_locks[i].contentions;
     }
-    INIT_METADATA((MallocMetadata*)ret, size, false, nullptr, nullptr, nullptr, nullptr);
-    MallocMetadata* mt = (MallocMetadata*)ret;
-
-    insert_to_metadata_list(mt, &metadata_head);
-    return GET_PTR_FROM_METADATA(mt);
+    return result;
 }
 
 
 
-
-
 /**
- * @function:   void* scalloc(size_t num, size_t size)
- * @brief:  Searches for a free block of up to ‘num’ elements, each ‘size’ bytes that 
- *          are all set to 0 or allocates if none are found.
- * 
- * @arguments:
- *     - size_t num: # of elements to allocate.
- *     - size_t size: size (bytes) of each element.
- * 
- * @returns:
- *     - Success: - returns pointer to the first byte in the allocated block.
+ * @function:   size_t _num_remote_frees()
  *
- *     - Failure:
- *          If ‘size’ is 0 returns nullptr.
- *          If ‘size’ is more than 10^8 , return nullptr. 
- *          If sbrk fails, return nullptr.
+ * @returns:
+ *     Returns the number of blocks that were free'd to a remote frees list (lock free) because
+ *     another thread held their slab class, run class or arena lock.
  */
-void* scalloc(size_t num, size_t size)
+size_t _num_remote_frees()
 {
-    void* res = smalloc(num * size);
-    if (res != nullptr)
-    {
-        memset(res, 0, num * size);
-        return res;
-    }
-    return nullptr;
+    return __atomic_load_n(&remote_frees_count, __ATOMIC_RELAXED);
 }
 
 
 
 /**
- * @function:   void sfree(void* p)
- * @brief:  Releases the usage of the block that starts with the pointer ‘p’. 
- * 
- * @arguments:
- *     - void* p: pointer to allocated block to free.
- *                If ‘p’ is nullptr or already released, simply returns.
- *                Presume that all pointers ‘p’ truly points to the beginning of an allocated block.
- * 
+ * @function:   size_t _num_cached_bytes()
+ *
  * @returns:
- *     None
+ *     Returns the number of bytes of the free small blocks held in the caches: the CPUs'
+ *     caches (-DMALLOC_4_PERCPU_CACHE) or the caches of every live thread, and the transfer
+ *     caches.
  */
-void sfree(void* p)
+size_t _num_cached_bytes()
 {
-    if (p == nullptr)
+    size_t result = 0;
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++)
     {
-        return;
+        lock(&transfer_caches[i].lock);
+        result += (size_t)transfer_caches[i].count * TCACHE_BATCH * slab_class_table.slot_size[i];
+        unlock(&transfer_caches[i].lock);
     }
-    MallocMetadata* to_free =  GET_METADATA_FROM_PTR(p);
-    // mmap block
-    if (to_free->size >= MIN_KB_BLOCK)
+    for (int i = 0; USE_PERCPU_CACHE && i < CPU_CACHE_COUNT; i++)
     {
-        remove_from_list(to_free, &mmap_metadata_head);
-        munmap((void *)to_free, to_free->size + sizeof(malloc_metadata_t));
+        for (int j = 0; j < SLAB_CLASS_COUNT; j++)
+        {
+            uint64_t list = __atomic_load_n(&cpu_caches[i].bins[j].list, __ATOMIC_RELAXED);
+            result += (size_t)CPU_BIN_COUNT(list) * slab_class_table.slot_size[j];
+        }
     }
-
-    // sbrk block
-    else
+    lock(&tcache_list_lock);
+    for (tcache_t* cache = tcache_list; cache; cache = cache->next)
     {
-        insert_block_to_bin(to_free);
+        result += cache_bytes(cache->bins);
+    }
+    unlock(&tcache_list_lock);
+    return result;
+}
 
-        // try to merge with next
-        if (to_free->next && to_free->next->is_free)
-        {
 
-            MallocMetadata* temp = to_free->next;
-            to_free->next = temp->next;
-            if (temp->next)
-            {
-                temp->next->prev = to_free;
-            }
-            
-            remove_from_bin(temp);
-            remove_from_bin(to_free);
-            to_free->size += (temp->size + sizeof(malloc_metadata_t));
-            insert_block_to_bin(to_free);
-        }
 
-        // try to merge with prev
-        if (to_free->prev && to_free->prev->is_free)
-        {
-            MallocMetadata* temp = to_free->prev;
-            temp->next = to_free->next;
-            if (to_free->next)
-            {
-                to_free->next->prev = temp;
-            }
-            remove_from_bin(temp);
-            remove_from_bin(to_free);
-            temp->size += (to_free->size + sizeof(malloc_metadata_t));
-            insert_block_to_bin(temp);
-        }
-        to_free->is_free = true;
-    }
-    return;
+/**
+ * @function:   size_t _num_scavenges()
+ *
+ * @returns:
+ *     Returns the number of times the scavenger went over the caches (every SCAVENGE_MS).
+ */
+size_t _num_scavenges()
+{
+    return __atomic_load_n(&scavenges_count, __ATOMIC_RELAXED);
 }
 
 
 
 /**
- * @function:   void* srealloc(void* oldp, size_t size)
- * @brief:  If ‘size’ is smaller than the current block’s size, reuses the same block.
- *          Otherwise, finds/allocates ‘size’ bytes for a new space, copies content of oldp
- *          into the new allocated space and frees the oldp.
- * 
- * @arguments:
- *     - void* oldp: pointer to block-to-copy.
- *     - size_t size: # of bytes to allocate.
- * 
- * @returns:
- *     - Success:
- *          Returns pointer to the first byte in the (newly) allocated space.
- *          If ‘oldp’ is nullptr, allocates space for ‘size’ bytes and returns a pointer to it.
+ * @function:   size_t _num_scavenged_blocks()
  *
- *     - Failure:
- *          If ‘size’ is 0 returns nullptr.
- *          If ‘size’ is more than 10^8 , return nullptr. 
- *          If sbrk fails, return nullptr.
+ * @returns:
+ *     Returns the number of cached free small blocks the scavenger gave back to the slabs
+ *     because they were left unused for a whole SCAVENGE_MS.
  */
-void* srealloc(void* oldp, size_t size)
+size_t _num_scavenged_blocks()
 {
-    if (size > MAX_MALLOC_4_SIZE || size == 0)
-    {
-        return nullptr;
-    }
-    size = GET_SIZE_WITH_ALIGNMENT(size);
+    return __atomic_load_n(&scavenged_blocks_count, __ATOMIC_RELAXED);
+}
 
-    if (oldp == nullptr)
-    {
-        return smalloc(size);
-    }
 
-    MallocMetadata* old_ptr = GET_METADATA_FROM_PTR(oldp);
 
-    // ** oldp is mmap **
-    if (old_ptr->size >= MIN_KB_BLOCK)
-    {
-        void* ret = smalloc(size);
-        if (!ret) return nullptr;
-        memmove(ret, oldp, MMIN(old_ptr->size, size));
-        sfree(oldp);
-        return ret;
-    }
+/**
+ * @function:   size_t _num_huge_pages()
+ *
+ * @returns:
+ *     Returns the number of reserved huge pages (MAP_HUGETLB, -DMALLOC_4_HUGE_PAGES=2) the mmap
+ *     blocks take.
+ */
+size_t _num_huge_pages()
+{
+    return __atomic_load_n(&huge_pages_count, __ATOMIC_RELAXED);
+}
 
-    // ** oldp is sbrk **
-    
-    // Try to reuse the current block without any merging
-    if (old_ptr->size >= size)
-    {
-        if (IS_LARGE_ENOUGH(old_ptr->size, size))
-        {
-            cut_block(old_ptr, size);
-            if (old_ptr->next && old_ptr->next->is_free && old_ptr->next->next && old_ptr->next->next->is_free)
-            {
-                MallocMetadata* base = old_ptr->next;
-                MallocMetadata* base_next = old_ptr->next->next;
-                remove_from_bin(base);
-                remove_from_bin(base_next);
-                base->next = base_next->next;
-                if (base_next->next)
-                {
-                    base_next->next->prev = base;
-                }
-                base->size += sizeof(malloc_metadata_t) + base_next->size;
-                insert_block_to_bin(base);
-            }
-        }
-        return oldp;
-    }
 
-    // Try to merge with the adjacent block with the lower address.
-    else if (old_ptr->prev && old_ptr->prev->is_free &&
-             old_ptr->prev->size + old_ptr->size >= size)
-    {
-        MallocMetadata* ret = old_ptr->prev;
-        remove_from_bin(ret);
-        ret->is_free = false;
-        ret->next = old_ptr->next;
-        if (old_ptr->next)
-        {
-            old_ptr->next->prev = ret;
-        }
-        ret->size += old_ptr->size + sizeof(malloc_metadata_t);
-        memmove(GET_PTR_FROM_METADATA(ret), oldp, MMIN(size, old_ptr->size));
-        if (IS_LARGE_ENOUGH(ret->size, size))
-        {
-            cut_block(ret, size, false);
-            //merge old_ptr_next with old_ptr_next_next
-            if (ret->next && ret->next->is_free && ret->next->next && ret->next->next->is_free)
-            {
-                MallocMetadata* base = ret->next;
-                MallocMetadata* base_next = ret->next->next;
-                remove_from_bin(base);
-                remove_from_bin(base_next);
-                base->next = base_next->next;
-                if (base_next->next)
-                {
-                    base_next->next->prev = base;
-                }
-                base->size += sizeof(malloc_metadata_t) + base_next->size;
-                insert_block_to_bin(base);
-            }
-        }
 
-        return GET_PTR_FROM_METADATA(ret);
+/**
+ * @function:   size_t _num_transparent_huge_pages()
+ *
+ * @returns:
+ *     Returns the number of transparent huge pages the kernel backs the process's anonymous
+ *     memory with (AnonHugePages in /proc/self/smaps_rollup, read without allocating), 0 if
+ *     it can't tell.
+ */
+size_t _num_transparent_huge_pages()
+{
+    int fd = open("/proc/self/smaps_rollup", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return 0;
     }
-
-    // Try to merge with the adjacent block with the higher address.
-    else if (old_ptr->next && old_ptr->next->is_free &&
-             old_ptr->next->size + old_ptr->size >= size)
+    char buffer[4096];
+    ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (length <= 0)
     {
-        MallocMetadata* to_merge = old_ptr->next;
-        remove_from_bin(to_merge);
-        old_ptr->is_free = false;
-        old_ptr->next = to_merge->next;
-        if (to_merge->next)
-        {
-            to_merge->next->prev = old_ptr;
-        }
-        old_ptr->size += to_merge->size + sizeof(malloc_metadata_t);
-        if (IS_LARGE_ENOUGH(old_ptr->size, size))
-        {
-            cut_block(old_ptr, size, false);
-            if (old_ptr->next && old_ptr->next->is_free && old_ptr->next->next && old_ptr->next->next->is_free)
-            {
-                MallocMetadata* base = old_ptr->next;
-                MallocMetadata* base_next = old_ptr->next->next;
-                remove_from_bin(base);
-                remove_from_bin(base_next);
-                base->next = base_next->next;
-                if (base_next->next)
-                {
-                    base_next->next->prev = base;
-                }
-                base->size += sizeof(malloc_metadata_t) + base_next->size;
-                insert_block_to_bin(base);
-            }
-        }
-        return GET_PTR_FROM_METADATA(old_ptr);
+        return 0;
     }
-
-    // Try to merge all those three adjacent blocks together
-    else if (old_ptr->prev && old_ptr->prev->is_free &&
-             old_ptr->next && old_ptr->next->is_free &&
-             old_ptr->prev->size + old_ptr->next->size + old_ptr->size >= size)
-    {
-        MallocMetadata* prev = old_ptr->prev;
-        MallocMetadata* next = old_ptr->next;
-        remove_from_bin(prev);
-        remove_from_bin(next);
-        prev->is_free = false;
-        prev->next = next->next;
-        if (next->next)
-        {
-            next->next->prev = prev;
-        }
-        prev->size += old_ptr->size + next->size + 2*sizeof(malloc_metadata_t);
-        memmove(GET_PTR_FROM_METADATA(prev), oldp, MMIN(size, old_ptr->size));
-        if (IS_LARGE_ENOUGH(prev->size, size))
-        {
-            cut_block(prev, size, false);
-            if (prev->next && prev->next->is_free && prev->next->next && prev->next->next->is_free)
-            {
-                MallocMetadata* base = prev->next;
-                MallocMetadata* base_next = prev->next->next;
-                remove_from_bin(base);
-                remove_from_bin(base_next);
-                base->next = base_next->next;
-                if (base_next->next)
-                {
-                    base_next->next->prev = base;
-                }
-                base->size += sizeof(malloc_metadata_t) + base_next->size;
-                insert_block_to_bin(base);
-            }
-        }
-        return GET_PTR_FROM_METADATA(prev);
+    buffer[length] = '\0';
+    const char* field = strstr(buffer, "AnonHugePages:");
+    if (field == nullptr)
+    {
+        return 0;
     }
-
-    // Try to expand the last block (if free)
-    else if (old_ptr->next == nullptr)
+    size_t kb = 0;
+    for (field += strlen("AnonHugePages:"); *field == ' '; field++)
     {
-        // take the free space before also
-        if (old_ptr->prev && old_ptr->prev->is_free)
-        {
-            MallocMetadata* ret = old_ptr->prev;
-            remove_from_bin(ret);
-            ret->is_free = false;
-            ret->next = old_ptr->next;
-            if (old_ptr->next)
-            {
-                old_ptr->next->prev = ret;
-            }
-            ret->size += old_ptr->size + sizeof(malloc_metadata_t);
-            void* mem = sbrk(size - ret->size);
-            if ((intptr_t)mem == SBRK_FAIL)
-            {
-                return nullptr;
-            }
-            ret->size = size;
-            memmove(GET_PTR_FROM_METADATA(ret), oldp, old_ptr->size);
-            return GET_PTR_FROM_METADATA(ret);
-        }
-        
-        // default case
-        void* ret = sbrk(size - old_ptr->size);
-        if ((intptr_t)ret == SBRK_FAIL)
-        {
-            return nullptr;
-        }
-        old_ptr->size = size;
-        return oldp;
     }
-
-    // Allocate a new block with sbrk()
-    else
+    for (; *field >= '0' && *field <= '9'; field++)
     {
-
-        void* ret = smalloc(size);
-        memmove(ret, oldp, MMIN(size, old_ptr->size));
-        sfree(oldp);
-        return ret;
+        kb = kb * 10 + (*field - '0');
     }
-
-    return nullptr;
+    return kb * KB / HUGE_PAGE_SIZE;
 }
 
 
 
 /**
- * @function:   size_t _num_free_blocks()
+ * @function:   size_t _num_arenas()
  *
  * @returns:
- *     Returns the number of allocated blocks in the heap that are currently free.
+ *     Returns the number of arenas (arena 0 is the sbrk heap).
  */
-size_t _num_free_blocks()
+size_t _num_arenas()
 {
-    size_t result = 0;
-    METADATA_FOR_EACH(block, metadata_head)
-    {
-        if (block->is_free) result++;
-    }
-    return result;
+    return ARENA_COUNT;
 }
 
 
 
 /**
- * @function:  size_t _num_free_bytes()
+ * @function:   size_t _num_arena_free_blocks(size_t arena)
  *
  * @returns:
- *     Returns the number of bytes in all allocated blocks in the heap that are 
- *     currently free, excluding the bytes used by the meta-data structs.
+ *     Returns the number of free blocks in the arena (0 if there is no such arena).
  */
-size_t _num_free_bytes()
+size_t _num_arena_free_blocks(size_t arena)
 {
-    size_t result = 0;
-    METADATA_FOR_EACH(block, metadata_head)
+    if (arena >= ARENA_COUNT)
     {
-        if (block->is_free) 
-            result += (block->size);
+        return 0;
     }
+    lock(&arenas[arena].lock);
+    size_t result = arena_free_blocks(&arenas[arena]);
+    unlock(&arenas[arena].lock);
     return result;
 }
 
 
+
 /**
- * @function:   size_t _num_allocated_blocks()
+ * @function:   size_t _num_arena_free_bytes(size_t arena)
  *
  * @returns:
- *      Returns the overall (free and used) number of allocated blocks in the heap.
+ *     Returns the number of bytes in the arena's free blocks, excluding the meta-data
+ *     (0 if there is no such arena).
  */
-size_t _num_allocated_blocks()
+size_t _num_arena_free_bytes(size_t arena)
 {
-    size_t result = 0;
-    METADATA_FOR_EACH(block, metadata_head)
-    { 
-        result++;
-    }
-    METADATA_FOR_EACH(block, mmap_metadata_head)
-    { 
-        result++;
+    if (arena >= ARENA_COUNT)
+    {
+        return 0;
     }
-
+    lock(&arenas[arena].lock);
+    size_t result = arena_free_bytes(&arenas[arena]);
+    unlock(&arenas[arena].lock);
     return result;
 }
 
 
 
 /**
- * @function:  size_t _num_allocated_bytes()
+ * @function:   size_t _num_arena_allocated_blocks(size_t arena)
  *
  * @returns:
- *      Returns the overall number (free and used) of allocated bytes in the heap, 
- *      excluding the bytes used by the meta-data structs.
+ *     Returns the overall (free and used) number of blocks in the arena
+ *     (0 if there is no such arena).
  */
-size_t _num_allocated_bytes()
+size_t _num_arena_allocated_blocks(size_t arena)
 {
-    size_t result = 0;
-    METADATA_FOR_EACH(block, metadata_head)
+    if (arena >= ARENA_COUNT)
     {
-        result += (block->size);
-    }
-
-    METADATA_FOR_EACH(block, mmap_metadata_head)
-    { 
-        result += (block->size);
+        return 0;
     }
-
+    lock(&arenas[arena].lock);
+    size_t result = arena_allocated_blocks(&arenas[arena]);
+    unlock(&arenas[arena].lock);
     return result;
 }
 
 
 
 /**
- * @function:   size_t _num_meta_data_bytes()
+ * @function:   size_t _num_arena_allocated_bytes(size_t arena)
  *
  * @returns:
- *     Returns the overall number of meta-data bytes currently in the heap.
+ *     Returns the overall (free and used) number of bytes in the arena's blocks, excluding
+ *     the meta-data (0 if there is no such arena).
  */
-size_t _num_meta_data_bytes()
+size_t _num_arena_allocated_bytes(size_t arena)
 {
-    size_t result = 0;
-    METADATA_FOR_EACH(block, metadata_head)
+    if (arena >= ARENA_COUNT)
     {
-        result += (sizeof(malloc_metadata_t));
-    }    
-
-    METADATA_FOR_EACH(block, mmap_metadata_head)
-    {
-        result += (sizeof(malloc_metadata_t));
+        return 0;
     }
+    lock(&arenas[arena].lock);
+    size_t result = arena_allocated_bytes(&arenas[arena]);
+    unlock(&arenas[arena].lock);
     return result;
 }
 
 
 
 /**
- * @function:   size_t _size_meta_data()
+ * @function:   size_t _num_arena_lock_contentions(size_t arena)
  *
  * @returns:
- *     Returns the number of bytes of a single meta-data structure in your system.
+ *     Returns the number of times a thread had to wait for the arena's lock
+ *     (0 if there is no such arena).
  */
-size_t _size_meta_data()
+size_t _num_arena_lock_contentions(size_t arena)
 {
-    return sizeof(malloc_metadata_t);
-}
\ No newline at end of file
+    if (arena >= ARENA_COUNT)
+    {
+        return 0;
+    }
+    return arenas[arena].lock.contentions;
+}
+
+
+
+#ifdef MALLOC_DISPATCH
+} /* namespace malloc_4 */
+#endif
@@ -3,10 +3,22 @@
 #ifndef MALLOC4
 #define MALLOC4
 
+// with -DMALLOC_DISPATCH the engines live side by side, each in its own namespace; otherwise
+// the API has C linkage, so C programs can link against malloc_4.o
+#ifdef MALLOC_DISPATCH
+namespace malloc_4 {
+#elif defined(__cplusplus)
+extern "C" {
+#endif
+
 void *smalloc(size_t size);
 void *scalloc(size_t num, size_t size);
 void sfree(void *p);
 void *srealloc(void *oldp, size_t size);
+void *smemalign(size_t alignment, size_t size);
+void *saligned_alloc(size_t alignment, size_t size);
+int sposix_memalign(void **memptr, size_t alignment, size_t size);
+size_t smalloc_usable_size(void *p);
 
 // for debug
 size_t _num_free_blocks();
@@ -15,5 +27,33 @@ size_t _num_allocated_blocks();
 size_t _num_allocated_bytes();
 size_t _num_meta_data_bytes();
 size_t _size_meta_data();
+size_t _num_lock_contentions();
+size_t _num_remote_frees();
+size_t _num_cached_bytes();
+size_t _num_scavenges();
+size_t _num_scavenged_blocks();
+size_t _num_huge_pages();
+size_t _num_transparent_huge_pages();
+
+// per arena (arena 0 is the sbrk heap)
+size_t _num_arenas();
+size_t _num_arena_free_blocks(size_t arena);
+size_t _num_arena_free_bytes(size_t arena);
+size_t _num_arena_allocated_blocks(size_t arena);
+size_t _num_arena_allocated_bytes(size_t arena);
+size_t _num_arena_lock_contentions(size_t arena);
+
+// lock free pools of fixed size objects
+typedef struct spool_t spool_t;
+spool_t* spool_create(size_t size);
+void* spool_alloc(spool_t* pool);
+void spool_free(spool_t* pool, void* p);
+void spool_destroy(spool_t* pool);
+
+#ifdef MALLOC_DISPATCH
+} /* namespace malloc_4 */
+#elif defined(__cplusplus)
+} /* extern "C" */
+#endif
 
 #endif /* MALLOC4 */
\ No newline at end of file
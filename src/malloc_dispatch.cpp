@@ -0,0 +1,185 @@
+/**
+ * @file        malloc_dispatch.cpp
+ * @author      Art Vandelay
+ * @version     1
+ * @date        2022-01-13
+ * @copyright   Copyright (c) 2022
+ *
+ * Built with -DMALLOC_DISPATCH, malloc_2, malloc_3 and malloc_4 live in the malloc_N namespaces
+ * and link into one program or library (make dispatch builds libmalloc_dispatch.so). This file
+ * gives them back the smalloc / sfree / ... API and sends every call to the engine chosen at
+ * startup, so engines can be compared without relinking:
+ *     MALLOC_ENGINE=3 <program>
+ * The engine is fixed by the first call (a block has to be freed by the engine that gave it).
+ */
+
+
+
+// includes
+#include <stdlib.h>
+#include "malloc_dispatch.h"
+
+#ifndef MALLOC_DISPATCH
+#define MALLOC_DISPATCH
+#endif
+#include "malloc_2.h"
+#include "malloc_3.h"
+#include "malloc_4.h"
+
+
+
+// constants
+#define MALLOC_ENGINE_ENV "MALLOC_ENGINE"
+#define MALLOC_ENGINE_NONE 0
+#define MALLOC_ENGINE_DEFAULT 4
+
+
+
+/**
+ * @macro: IS_ENGINE(N)
+ * @brief: returns true if malloc_N is one of the engines.
+ */
+#define IS_ENGINE(N) ((N) >= 2 && (N) <= 4)
+
+
+
+// the engine every call goes to (MALLOC_ENGINE_NONE until the first call)
+static int engine = MALLOC_ENGINE_NONE;
+
+
+
+/**
+ * @function:   static int resolve_engine()
+ * @brief:      fix the engine to the one MALLOC_ENGINE names (malloc_4 if it isn't set or isn't
+ *              2, 3 or 4), unless malloc_select_engine() or another thread fixed it first.
+ *
+ * @returns:
+ *     the engine.
+ */
+static int resolve_engine()
+{
+    const char* name = getenv(MALLOC_ENGINE_ENV);
+    int wanted = name != nullptr ? atoi(name) : MALLOC_ENGINE_DEFAULT;
+    if (!IS_ENGINE(wanted))
+    {
+        wanted = MALLOC_ENGINE_DEFAULT;
+    }
+    int expected = MALLOC_ENGINE_NONE;
+    __atomic_compare_exchange_n(&engine, &expected, wanted, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    return __atomic_load_n(&engine, __ATOMIC_RELAXED);
+}
+
+
+
+/**
+ * @macro: DISPATCH(CALL)
+ * @brief: returns CALL made on the engine's namespace. The engine is compared against each one
+ *         in turn rather than called through a function pointer, so once it's fixed every call
+ *         is a direct call behind a branch that is always predicted.
+ */
+#define DISPATCH(CALL)                                                      \
+    do                                                                      \
+    {                                                                       \
+        int current = __atomic_load_n(&engine, __ATOMIC_RELAXED);         \
+        if (current == MALLOC_ENGINE_NONE)                                  \
+        {                                                                   \
+            current = resolve_engine();                                     \
+        }                                                                   \
+        if (current == 4)                                                   \
+        {                                                                   \
+            return malloc_4::CALL;                                          \
+        }                                                                   \
+        if (current == 3)                                                   \
+        {                                                                   \
+            return malloc_3::CALL;                                          \
+        }                                                                   \
+        return malloc_2::CALL;                                              \
+    } while (0)
+
+
+
+/**
+ * @function:   bool malloc_select_engine(int wanted)
+ * @brief:      fix the engine to malloc_‘wanted’, it has to be called before the first allocation.
+ *
+ * @returns:
+ *     true if ‘wanted’ is the engine now, false if it isn't 2, 3 or 4 or another engine was
+ *     already fixed.
+ */
+bool malloc_select_engine(int wanted)
+{
+    if (!IS_ENGINE(wanted))
+    {
+        return false;
+    }
+    int expected = MALLOC_ENGINE_NONE;
+    return __atomic_compare_exchange_n(&engine, &expected, wanted, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ||
+           expected == wanted;
+}
+
+
+
+/**
+ * @function:   int malloc_engine()
+ *
+ * @returns:
+ *     the N of the malloc_N engine the calls go to (fixing it if no call did yet).
+ */
+int malloc_engine()
+{
+    int current = __atomic_load_n(&engine, __ATOMIC_RELAXED);
+    return current != MALLOC_ENGINE_NONE ? current : resolve_engine();
+}
+
+
+
+// the malloc_N API
+void* smalloc(size_t size)
+{
+    DISPATCH(smalloc(size));
+}
+
+void* scalloc(size_t num, size_t size)
+{
+    DISPATCH(scalloc(num, size));
+}
+
+void sfree(void* p)
+{
+    DISPATCH(sfree(p));
+}
+
+void* srealloc(void* oldp, size_t size)
+{
+    DISPATCH(srealloc(oldp, size));
+}
+
+size_t _num_free_blocks()
+{
+    DISPATCH(_num_free_blocks());
+}
+
+size_t _num_free_bytes()
+{
+    DISPATCH(_num_free_bytes());
+}
+
+size_t _num_allocated_blocks()
+{
+    DISPATCH(_num_allocated_blocks());
+}
+
+size_t _num_allocated_bytes()
+{
+    DISPATCH(_num_allocated_bytes());
+}
+
+size_t _num_meta_data_bytes()
+{
+    DISPATCH(_num_meta_data_bytes());
+}
+
+size_t _size_meta_data()
+{
+    DISPATCH(_size_meta_data());
+}
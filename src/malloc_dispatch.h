@@ -0,0 +1,25 @@
+#include <unistd.h>
+
+#ifndef MALLOCDISPATCH
+#define MALLOCDISPATCH
+
+// the malloc_N API, served by the engine chosen at startup
+void *smalloc(size_t size);
+void *scalloc(size_t num, size_t size);
+void sfree(void *p);
+void *srealloc(void *oldp, size_t size);
+
+// for debug
+size_t _num_free_blocks();
+size_t _num_free_bytes();
+size_t _num_allocated_blocks();
+size_t _num_allocated_bytes();
+size_t _num_meta_data_bytes();
+size_t _size_meta_data();
+
+// engine selection: malloc_select_engine(N) before the first allocation, or else the
+// MALLOC_ENGINE environment variable (N = 2, 3, 4), or else malloc_4
+bool malloc_select_engine(int engine);
+int malloc_engine();
+
+#endif /* MALLOCDISPATCH */
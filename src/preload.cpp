@@ -0,0 +1,310 @@
+/**
+ * @file        preload.cpp
+ * @author      Art Vandelay
+ * @version     1
+ * @date        2022-01-13
+ * @copyright   Copyright (c) 2022
+ *
+ * The libc and C++ allocation entry points over malloc_4, built with malloc_4.cpp into
+ * libmalloc_4.so (make preload) to run real programs on it:
+ *     LD_PRELOAD=./libmalloc_4.so <program>
+ * malloc_4 initializes itself on the first call, and its load time constructor
+ * (malloc_fork_init) registers the fork handlers that take every lock around fork (see
+ * fork_prepare).
+ */
+
+
+
+// includes
+#include <errno.h>
+#include <stdint.h>
+#include <new>
+#include "malloc_4.h"
+
+
+
+// constants
+#define PRELOAD_PAGE_SIZE 4096
+#define PRELOAD_MIN_ALIGNMENT 16
+
+
+
+/**
+ * @macro: IS_POWER_OF_2(X)
+ * @brief: returns true if X is a power of 2.
+ */
+#define IS_POWER_OF_2(X) ((X) != 0 && ((X) & ((X) - 1)) == 0)
+
+
+
+/**
+ * @function:   static void* preload_alloc(size_t alignment, size_t size)
+ * @brief:      allocate ‘size’ bytes (a unique block for 0) aligned to ‘alignment’, errno is
+ *              ENOMEM if it fails.
+ */
+static void* preload_alloc(size_t alignment, size_t size)
+{
+    size = size ? size : 1;
+    void* p = alignment > PRELOAD_MIN_ALIGNMENT ? smemalign(alignment, size) : smalloc(size);
+    if (p == nullptr)
+    {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+
+
+/**
+ * @function:   static void* new_alloc(size_t size, size_t alignment)
+ * @brief:      operator new's allocation: calls the new handler and retries while it fails.
+ *
+ * @returns:
+ *     nullptr if it fails and there is no new handler.
+ */
+static void* new_alloc(size_t size, size_t alignment)
+{
+    for (;;)
+    {
+        void* p = preload_alloc(alignment, size);
+        if (p != nullptr)
+        {
+            return p;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr)
+        {
+            return nullptr;
+        }
+        handler();
+    }
+}
+
+
+
+// the C allocator
+extern "C" {
+
+void* malloc(size_t size) noexcept
+{
+    return preload_alloc(0, size);
+}
+
+void free(void* p) noexcept
+{
+    sfree(p);
+}
+
+void* calloc(size_t num, size_t size) noexcept
+{
+    if (size != 0 && num > SIZE_MAX / size)
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    if (num == 0 || size == 0)
+    {
+        num = size = 1;
+    }
+    void* p = scalloc(num, size);
+    if (p == nullptr)
+    {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+void* realloc(void* oldp, size_t size) noexcept
+{
+    if (oldp == nullptr)
+    {
+        return preload_alloc(0, size);
+    }
+    if (size == 0)
+    {
+        sfree(oldp);
+        return nullptr;
+    }
+    void* p = srealloc(oldp, size);
+    if (p == nullptr)
+    {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+void* reallocarray(void* oldp, size_t num, size_t size) noexcept
+{
+    if (size != 0 && num > SIZE_MAX / size)
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return realloc(oldp, num * size);
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) noexcept
+{
+    if (!IS_POWER_OF_2(alignment) || alignment % sizeof(void*) != 0)
+    {
+        return EINVAL;
+    }
+    void* p = preload_alloc(alignment, size);
+    if (p == nullptr)
+    {
+        return ENOMEM;
+    }
+    *memptr = p;
+    return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) noexcept
+{
+    if (!IS_POWER_OF_2(alignment))
+    {
+        errno = EINVAL;
+        return nullptr;
+    }
+    return preload_alloc(alignment, size);
+}
+
+void* memalign(size_t alignment, size_t size) noexcept
+{
+    // like glibc, an alignment that isn't a power of 2 is rounded up to one
+    size_t power = 1;
+    while (power < alignment)
+    {
+        power <<= 1;
+    }
+    return preload_alloc(power, size);
+}
+
+void* valloc(size_t size) noexcept
+{
+    return preload_alloc(PRELOAD_PAGE_SIZE, size);
+}
+
+void* pvalloc(size_t size) noexcept
+{
+    return preload_alloc(PRELOAD_PAGE_SIZE, (size + PRELOAD_PAGE_SIZE - 1) & ~(size_t)(PRELOAD_PAGE_SIZE - 1));
+}
+
+size_t malloc_usable_size(void* p) noexcept
+{
+    return smalloc_usable_size(p);
+}
+
+}
+
+
+
+// the C++ allocator
+void* operator new(size_t size)
+{
+    void* p = new_alloc(size, 0);
+    if (p == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    return new_alloc(size, 0);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    return new_alloc(size, 0);
+}
+
+void* operator new(size_t size, std::align_val_t alignment)
+{
+    void* p = new_alloc(size, (size_t)alignment);
+    if (p == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](size_t size, std::align_val_t alignment)
+{
+    return operator new(size, alignment);
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return new_alloc(size, (size_t)alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return new_alloc(size, (size_t)alignment);
+}
+
+void operator delete(void* p) noexcept
+{
+    sfree(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    sfree(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    sfree(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+    sfree(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+    sfree(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+    sfree(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept
+{
+    sfree(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept
+{
+    sfree(p);
+}
+
+void operator delete(void* p, size_t, std::align_val_t) noexcept
+{
+    sfree(p);
+}
+
+void operator delete[](void* p, size_t, std::align_val_t) noexcept
+{
+    sfree(p);
+}
+
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    sfree(p);
+}
+
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    sfree(p);
+}
@@ -0,0 +1,989 @@
+/**
+ * @file        bench_malloc.cpp
+ * @brief       Micro benchmarks for the malloc_N engines.
+ *
+ * Build and run from src/ with:
+ *      make bench BENCH_ENGINE=<N>     (N = 2, 3, 4)
+ *      ./bench_malloc_<N> [benchmark name]
+ * or, to pick the engine when it runs (single threaded benchmarks only, malloc_2 and malloc_3
+ * aren't thread safe):
+ *      make bench_dispatch
+ *      MALLOC_ENGINE=<N> ./bench_malloc_dispatch [benchmark name]
+ *
+ * Every benchmark runs in its own forked child, so each one starts from a fresh heap.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#if defined(BENCH_MALLOC_DISPATCH)
+#include "malloc_dispatch.h"
+#elif defined(BENCH_MALLOC_2)
+#include "malloc_2.h"
+#elif defined(BENCH_MALLOC_3)
+#include "malloc_3.h"
+#else
+#include "malloc_4.h"
+#define BENCH_THREAD_SAFE
+#define BENCH_SPOOL
+#define BENCH_ALIGNED
+#define BENCH_HUGE_PAGES
+#endif
+
+
+
+typedef std::chrono::steady_clock bench_clock;
+
+typedef void (*BenchFunc)();
+
+
+
+/**
+ * @function:   static double ns_since(bench_clock::time_point start, size_t ops)
+ * @brief:      average nanoseconds per operation since start.
+ */
+static double ns_since(bench_clock::time_point start, size_t ops)
+{
+    std::chrono::duration<double, std::nano> elapsed = bench_clock::now() - start;
+    return elapsed.count() / ops;
+}
+
+
+
+/**
+ * @function:   static void print_row(size_t live, double ns)
+ * @brief:      print one "live blocks | ns per op" row.
+ */
+static void print_row(size_t live, double ns)
+{
+    std::cout << std::setw(12) << live << " | " << std::setw(10) << std::fixed << std::setprecision(1) << ns << std::endl;
+}
+
+
+
+/**
+ * @function:   static void bench_latency_vs_live_blocks(size_t block_size, size_t max_live, size_t batch)
+ * @brief:      grow the number of live blocks by powers of 10 and time a batch of new
+ *              allocations at every level. Nothing is ever free'd, so every allocation
+ *              appends a block to the end of the list.
+ */
+static void bench_latency_vs_live_blocks(size_t block_size, size_t max_live, size_t batch)
+{
+    size_t live = 0;
+    std::cout << std::setw(12) << "live blocks" << " | " << std::setw(10) << "ns/alloc" << std::endl;
+    for (size_t level = 1000; level <= max_live; level *= 10)
+    {
+        for (; live < level; live++)
+        {
+            if (!smalloc(block_size))
+            {
+                std::cerr << "smalloc failed at " << live << " live blocks" << std::endl;
+                exit(1);
+            }
+        }
+        bench_clock::time_point start = bench_clock::now();
+        for (size_t i = 0; i < batch; i++)
+        {
+            if (!smalloc(block_size))
+            {
+                std::cerr << "smalloc failed at " << live << " live blocks" << std::endl;
+                exit(1);
+            }
+        }
+        print_row(level, ns_since(start, batch));
+        live += batch;
+    }
+}
+
+
+
+/**
+ * @function:   static size_t bench_random(size_t& state)
+ * @brief:      small deterministic pseudo random generator (same sequence for every engine).
+ */
+static size_t bench_random(size_t& state)
+{
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return state >> 33;
+}
+
+
+
+/**
+ * @function:   static void bench_fragmented_churn(size_t holes, size_t min_size, size_t max_size, size_t ops)
+ * @brief:      leave 'holes' free blocks of random sizes between min_size and max_size, each one
+ *              pinned between live blocks so they cannot be merged, then time malloc/free
+ *              pairs of random sizes over that fragmented heap.
+ */
+static void bench_fragmented_churn(size_t holes, size_t min_size, size_t max_size, size_t ops)
+{
+    size_t state = 42;
+    void** blocks = (void**)smalloc(holes * sizeof(void*));
+    for (size_t i = 0; i < holes; i++)
+    {
+        blocks[i] = smalloc(min_size + bench_random(state) % (max_size - min_size));
+        if (!blocks[i] || !smalloc(64))
+        {
+            std::cerr << "smalloc failed at hole " << i << std::endl;
+            exit(1);
+        }
+    }
+    for (size_t i = 0; i < holes; i++)
+    {
+        sfree(blocks[i]);
+    }
+
+    bench_clock::time_point start = bench_clock::now();
+    for (size_t i = 0; i < ops; i++)
+    {
+        void* p = smalloc(min_size + bench_random(state) % (max_size - min_size));
+        if (!p)
+        {
+            std::cerr << "smalloc failed at op " << i << std::endl;
+            exit(1);
+        }
+        sfree(p);
+    }
+    std::cout << std::setw(12) << "free holes" << " | " << std::setw(10) << "ns/pair" << std::endl;
+    print_row(holes, ns_since(start, ops));
+}
+
+
+
+/**
+ * @function:   static void bench_small_objects(size_t block_size, size_t count)
+ * @brief:      allocate count blocks of block_size, then free them all, and report the heap's
+ *              bytes per object (payload + meta-data, from the engine's stats) and the
+ *              malloc and free throughput. Build with BENCH_FLAGS="-O2 -pthread -DMALLOC_4_NO_SLABS"
+ *              to compare malloc_4 against its heap path.
+ */
+static void bench_small_objects(size_t block_size, size_t count)
+{
+    void** blocks = (void**)smalloc(count * sizeof(void*));
+    size_t base_bytes = _num_allocated_bytes() + _num_meta_data_bytes();
+
+    bench_clock::time_point start = bench_clock::now();
+    for (size_t i = 0; i < count; i++)
+    {
+        blocks[i] = smalloc(block_size);
+        if (!blocks[i])
+        {
+            std::cerr << "smalloc failed at block " << i << std::endl;
+            exit(1);
+        }
+    }
+    double alloc_ns = ns_since(start, count);
+    double bytes = (double)(_num_allocated_bytes() + _num_meta_data_bytes() - base_bytes) / count;
+
+    start = bench_clock::now();
+    for (size_t i = 0; i < count; i++)
+    {
+        sfree(blocks[i]);
+    }
+    double free_ns = ns_since(start, count);
+
+    std::cout << std::setw(12) << "bytes/object" << " | " << std::setw(10) << "malloc/s" << " | " << std::setw(10) << "free/s" << std::endl;
+    std::cout << std::setw(12) << std::fixed << std::setprecision(1) << bytes << " | "
+              << std::setw(9) << std::setprecision(1) << 1000.0 / alloc_ns << "M | "
+              << std::setw(9) << 1000.0 / free_ns << "M" << std::endl;
+}
+
+
+
+/**
+ * @function:   static void bench_realloc_growth(size_t step, size_t max_size)
+ * @brief:      grow one buffer by step bytes at a time up to max_size with srealloc (writing
+ *              its last byte each time, like an append), then shrink it back, and report the
+ *              average time of a srealloc each way. Build with
+ *              BENCH_FLAGS="-O2 -pthread -DMALLOC_4_NO_MREMAP" to compare malloc_4's mremap
+ *              against copying.
+ */
+static void bench_realloc_growth(size_t step, size_t max_size)
+{
+    size_t steps = max_size / step - 1;
+    char* buffer = (char*)smalloc(step);
+    buffer[step - 1] = 1;
+
+    bench_clock::time_point start = bench_clock::now();
+    for (size_t size = 2 * step; size <= max_size; size += step)
+    {
+        buffer = (char*)srealloc(buffer, size);
+        if (!buffer)
+        {
+            std::cerr << "srealloc failed at " << size << std::endl;
+            exit(1);
+        }
+        buffer[size - 1] = 1;
+    }
+    double grow_ns = ns_since(start, steps);
+
+    start = bench_clock::now();
+    for (size_t size = max_size - step; size >= step; size -= step)
+    {
+        buffer = (char*)srealloc(buffer, size);
+        if (!buffer)
+        {
+            std::cerr << "srealloc failed at " << size << std::endl;
+            exit(1);
+        }
+        buffer[size - 1] = 1;
+    }
+    double shrink_ns = ns_since(start, steps);
+    sfree(buffer);
+
+    std::cout << std::setw(12) << "max MB" << " | " << std::setw(10) << "grow us" << " | " << std::setw(10) << "shrink us" << std::endl;
+    std::cout << std::setw(12) << max_size / (1024 * 1024) << " | " << std::setw(10) << std::fixed << std::setprecision(1) << grow_ns / 1000.0
+              << " | " << std::setw(10) << shrink_ns / 1000.0 << std::endl;
+}
+
+
+
+/**
+ * @function:   static void bench_table_scan(size_t size, size_t reads)
+ * @brief:      fill a table of size bytes, then make reads dependent random reads over it (each
+ *              index comes from the last read, so the TLB misses aren't hidden) and report the
+ *              average time of a read, and for malloc_4 the huge pages backing the table. Build
+ *              with BENCH_FLAGS="-O2 -pthread -DMALLOC_4_HUGE_PAGES=1" (or =2 with reserved huge
+ *              pages) to compare huge pages against small ones.
+ */
+static void bench_table_scan(size_t size, size_t reads)
+{
+    size_t count = size / sizeof(size_t);
+    size_t* table = (size_t*)smalloc(count * sizeof(size_t));
+    if (!table)
+    {
+        std::cerr << "smalloc failed" << std::endl;
+        exit(1);
+    }
+    size_t seed = 1;
+    for (size_t i = 0; i < count; i++)
+    {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        table[i] = seed >> 16;
+    }
+
+    size_t index = 0;
+    bench_clock::time_point start = bench_clock::now();
+    for (size_t i = 0; i < reads; i++)
+    {
+        index = (table[index] + i) % count;
+    }
+    double ns = ns_since(start, reads);
+    volatile size_t last_index = index;
+    (void)last_index;
+
+    std::cout << std::setw(12) << "table MB" << " | " << std::setw(10) << "read ns" << " | " << std::setw(10) << "huge pages" << std::endl;
+    std::cout << std::setw(12) << size / (1024 * 1024) << " | " << std::setw(10) << std::fixed << std::setprecision(1) << ns << " | ";
+#ifdef BENCH_HUGE_PAGES
+    std::cout << std::setw(10) << _num_huge_pages() + _num_transparent_huge_pages();
+#else
+    std::cout << std::setw(10) << "-";
+#endif
+    std::cout << std::endl;
+    sfree(table);
+}
+
+
+
+/**
+ * @function:   static void bench_object_graph(size_t object_size, size_t count, size_t hops)
+ * @brief:      allocate count objects of object_size bytes, link them in a random cycle (each
+ *              object points to the next in its first word) and follow hops links, then report
+ *              the average time of a hop, and for malloc_4 the transparent huge pages backing
+ *              the process. Build with BENCH_FLAGS="-O2 -pthread -DMALLOC_4_THP_HEAP" to compare
+ *              a heap on transparent huge pages against small ones.
+ */
+static void bench_object_graph(size_t object_size, size_t count, size_t hops)
+{
+    void*** objects = (void***)smalloc(count * sizeof(void**));
+    for (size_t i = 0; i < count; i++)
+    {
+        objects[i] = (void**)smalloc(object_size);
+        if (!objects[i])
+        {
+            std::cerr << "smalloc failed at object " << i << std::endl;
+            exit(1);
+        }
+    }
+    size_t seed = 1;
+    for (size_t i = count - 1; i > 0; i--)
+    {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        size_t j = (seed >> 16) % (i + 1);
+        void** swapped = objects[i];
+        objects[i] = objects[j];
+        objects[j] = swapped;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        *objects[i] = objects[(i + 1) % count];
+    }
+
+    void** object = objects[0];
+    bench_clock::time_point start = bench_clock::now();
+    for (size_t i = 0; i < hops; i++)
+    {
+        object = (void**)*object;
+    }
+    double ns = ns_since(start, hops);
+    void* volatile last_object = object;
+    (void)last_object;
+
+    std::cout << std::setw(12) << "objects" << " | " << std::setw(10) << "hop ns" << " | " << std::setw(10) << "huge pages" << std::endl;
+    std::cout << std::setw(12) << count << " | " << std::setw(10) << std::fixed << std::setprecision(1) << ns << " | ";
+#ifdef BENCH_HUGE_PAGES
+    std::cout << std::setw(10) << _num_transparent_huge_pages();
+#else
+    std::cout << std::setw(10) << "-";
+#endif
+    std::cout << std::endl;
+    for (size_t i = 0; i < count; i++)
+    {
+        sfree(objects[i]);
+    }
+    sfree(objects);
+}
+
+
+
+/**
+ * @function:   static size_t resident_bytes()
+ * @brief:      the process's resident memory, from /proc/self/statm.
+ */
+static size_t resident_bytes()
+{
+    size_t pages = 0, resident = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm)
+    {
+        if (fscanf(statm, "%zu %zu", &pages, &resident) != 2) resident = 0;
+        fclose(statm);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+
+
+/**
+ * @function:   static void bench_mixed_lifetimes(size_t min_size, size_t max_size, size_t ops)
+ * @brief:      allocate blocks of random sizes between min_size and max_size, a quarter of them
+ *              long lived and the rest free'd a few allocations later, then report the live
+ *              bytes against the resident memory the heap grew by, and the time per operation.
+ */
+static void bench_mixed_lifetimes(size_t min_size, size_t max_size, size_t ops)
+{
+    const size_t short_lived = 64;
+    void* recent[short_lived] = {};
+    size_t recent_size[short_lived] = {};
+    size_t state = 7, live = 0;
+    size_t base = resident_bytes();
+
+    bench_clock::time_point start = bench_clock::now();
+    for (size_t i = 0; i < ops; i++)
+    {
+        size_t size = min_size + bench_random(state) % (max_size - min_size);
+        void* p = smalloc(size);
+        if (!p)
+        {
+            std::cerr << "smalloc failed at op " << i << std::endl;
+            exit(1);
+        }
+        memset(p, 1, size);
+        live += size;
+        if (bench_random(state) % 4 == 0)
+        {
+            continue;
+        }
+        size_t slot = bench_random(state) % short_lived;
+        sfree(recent[slot]);
+        live -= recent_size[slot];
+        recent[slot] = p;
+        recent_size[slot] = size;
+    }
+    double ns = ns_since(start, ops);
+    for (size_t slot = 0; slot < short_lived; slot++)
+    {
+        sfree(recent[slot]);
+        live -= recent_size[slot];
+    }
+
+    std::cout << std::setw(12) << "live MB" << " | " << std::setw(10) << "heap MB" << " | " << std::setw(10) << "ns/op" << std::endl;
+    std::cout << std::setw(12) << std::fixed << std::setprecision(1) << live / (1024.0 * 1024) << " | "
+              << std::setw(10) << (resident_bytes() - base) / (1024.0 * 1024) << " | "
+              << std::setw(10) << ns << std::endl;
+}
+
+
+
+#ifdef BENCH_THREAD_SAFE
+/**
+ * @function:   static void bench_thread_worker(size_t block_size, size_t ops)
+ * @brief:      one thread of bench_thread_scaling: ops malloc/free pairs, 16 blocks at a time,
+ *              all of them free'd by the thread that allocated them.
+ */
+static void bench_thread_worker(size_t block_size, size_t ops)
+{
+    const size_t batch = 16;
+    void* blocks[batch];
+    for (size_t i = 0; i < ops; i += batch)
+    {
+        for (size_t j = 0; j < batch; j++)
+        {
+            blocks[j] = smalloc(block_size);
+            if (!blocks[j])
+            {
+                std::cerr << "smalloc failed at op " << i + j << std::endl;
+                exit(1);
+            }
+        }
+        for (size_t j = 0; j < batch; j++)
+        {
+            sfree(blocks[j]);
+        }
+    }
+}
+
+
+
+/**
+ * @function:   static void bench_thread_scaling(size_t block_size, size_t ops_per_thread)
+ * @brief:      run bench_thread_worker on 1, 2, 4, ... threads (up to the number of cores, at
+ *              least 4) and report the total malloc/free pairs per second and the lock
+ *              contentions. Build with BENCH_FLAGS="-O2 -pthread -DMALLOC_4_NO_TCACHE" to
+ *              compare malloc_4's thread caches against the shared slabs.
+ */
+static void bench_thread_scaling(size_t block_size, size_t ops_per_thread)
+{
+    size_t max_threads = std::thread::hardware_concurrency();
+    if (max_threads < 4)
+    {
+        max_threads = 4;
+    }
+    std::cout << std::setw(12) << "threads" << " | " << std::setw(10) << "pairs/s" << " | " << std::setw(11) << "contentions" << std::endl;
+    for (size_t threads = 1; threads <= max_threads; threads *= 2)
+    {
+        size_t base_contentions = _num_lock_contentions();
+        std::vector<std::thread> workers;
+        bench_clock::time_point start = bench_clock::now();
+        for (size_t i = 0; i < threads; i++)
+        {
+            workers.push_back(std::thread(bench_thread_worker, block_size, ops_per_thread));
+        }
+        for (size_t i = 0; i < threads; i++)
+        {
+            workers[i].join();
+        }
+        double ns = ns_since(start, threads * ops_per_thread);
+        std::cout << std::setw(12) << threads << " | " << std::setw(9) << std::fixed << std::setprecision(1) << 1000.0 / ns << "M | "
+                  << std::setw(11) << _num_lock_contentions() - base_contentions << std::endl;
+    }
+}
+
+
+
+/**
+ * @struct: bench_park_t
+ * @brief:  Where the threads of bench_idle_threads wait, idle, after their burst.
+ */
+struct bench_park_t {
+    std::mutex mutex;
+    std::condition_variable done_cv;
+    std::condition_variable release_cv;
+    size_t done;
+    bool release;
+};
+
+
+
+/**
+ * @function:   static void bench_burst_then_idle(bench_park_t* park, size_t ops)
+ * @brief:      one thread of bench_idle_threads: ops malloc/free pairs of 16 - 1024 byte blocks,
+ *              32 blocks at a time, then wait (idle) until the park is released.
+ */
+static void bench_burst_then_idle(bench_park_t* park, size_t ops)
+{
+    const size_t batch = 32;
+    const size_t sizes[] = {16, 64, 256, 1024};
+    void* blocks[batch];
+    for (size_t i = 0; i < ops; i += batch)
+    {
+        size_t size = sizes[(i / batch) % 4];
+        for (size_t j = 0; j < batch; j++)
+        {
+            blocks[j] = smalloc(size);
+            if (!blocks[j])
+            {
+                std::cerr << "smalloc failed at op " << i + j << std::endl;
+                exit(1);
+            }
+        }
+        for (size_t j = 0; j < batch; j++)
+        {
+            sfree(blocks[j]);
+        }
+    }
+    std::unique_lock<std::mutex> guard(park->mutex);
+    park->done++;
+    park->done_cv.notify_one();
+    park->release_cv.wait(guard, [park] { return park->release; });
+}
+
+
+
+#define BENCH_SCAVENGE_MS 1000
+
+/**
+ * @function:   static void bench_idle_threads(size_t max_threads, size_t ops_per_thread)
+ * @brief:      run bench_burst_then_idle on 1, 4, 16, ... max_threads threads and report the
+ *              malloc/free pairs per second of the bursts and the bytes the caches hold while
+ *              all the threads are idle: right after the bursts and after two of malloc_4's
+ *              scavenge intervals (BENCH_SCAVENGE_MS, a large block is allocated after each
+ *              to run the scavenger). Build with BENCH_FLAGS="-O2 -pthread
+ *              -DMALLOC_4_PERCPU_CACHE" to compare malloc_4's per CPU caches against its
+ *              thread caches.
+ */
+static void bench_idle_threads(size_t max_threads, size_t ops_per_thread)
+{
+    std::cout << std::setw(12) << "threads" << " | " << std::setw(10) << "pairs/s" << " | " << std::setw(10) << "cached KB"
+              << " | " << std::setw(10) << "idle KB" << std::endl;
+    for (size_t threads = 1; threads <= max_threads; threads *= 4)
+    {
+        bench_park_t park;
+        park.done = 0;
+        park.release = false;
+        std::vector<std::thread> workers;
+        bench_clock::time_point start = bench_clock::now();
+        for (size_t i = 0; i < threads; i++)
+        {
+            workers.push_back(std::thread(bench_burst_then_idle, &park, ops_per_thread));
+        }
+        size_t cached;
+        size_t idle_cached;
+        double ns;
+        {
+            std::unique_lock<std::mutex> guard(park.mutex);
+            park.done_cv.wait(guard, [&park, threads] { return park.done == threads; });
+            ns = ns_since(start, threads * ops_per_thread);
+            cached = _num_cached_bytes();
+            for (int i = 0; i < 2; i++)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(BENCH_SCAVENGE_MS + 50));
+                sfree(smalloc(256 * 1024));
+            }
+            idle_cached = _num_cached_bytes();
+            park.release = true;
+            park.release_cv.notify_all();
+        }
+        for (size_t i = 0; i < threads; i++)
+        {
+            workers[i].join();
+        }
+        std::cout << std::setw(12) << threads << " | " << std::setw(9) << std::fixed << std::setprecision(1) << 1000.0 / ns << "M | "
+                  << std::setw(10) << cached / 1024.0 << " | " << std::setw(10) << idle_cached / 1024.0 << std::endl;
+    }
+}
+
+
+
+#ifdef BENCH_SPOOL
+#define BENCH_MPMC_SLOTS 1024
+
+/**
+ * @function:   static void bench_mpmc_worker(spool_t* pool, size_t block_size, std::atomic<void*>* slots, size_t ops, unsigned seed)
+ * @brief:      one thread of bench_pool_mpmc: ops times, allocate a block (from the pool, or
+ *              with smalloc if pool is nullptr), swap it into a random shared slot and free the
+ *              block it replaced, which another thread likely allocated.
+ */
+static void bench_mpmc_worker(spool_t* pool, size_t block_size, std::atomic<void*>* slots, size_t ops, unsigned seed)
+{
+    for (size_t i = 0; i < ops; i++)
+    {
+        void* block = pool ? spool_alloc(pool) : smalloc(block_size);
+        if (!block)
+        {
+            std::cerr << "alloc failed at op " << i << std::endl;
+            exit(1);
+        }
+        seed = seed * 1103515245 + 12345;
+        void* old = slots[(seed >> 16) % BENCH_MPMC_SLOTS].exchange(block);
+        if (pool)
+        {
+            spool_free(pool, old);
+        }
+        else if (old)
+        {
+            sfree(old);
+        }
+    }
+}
+
+
+
+/**
+ * @function:   static double bench_mpmc_round(spool_t* pool, size_t block_size, size_t threads, size_t ops_per_thread)
+ * @brief:      run bench_mpmc_worker on threads threads and free the blocks left in the slots.
+ * 
+ * @returns:
+ *     the ns per alloc/free pair.
+ */
+static double bench_mpmc_round(spool_t* pool, size_t block_size, size_t threads, size_t ops_per_thread)
+{
+    std::vector<std::atomic<void*>> slots(BENCH_MPMC_SLOTS);
+    for (size_t i = 0; i < BENCH_MPMC_SLOTS; i++)
+    {
+        slots[i] = nullptr;
+    }
+    std::vector<std::thread> workers;
+    bench_clock::time_point start = bench_clock::now();
+    for (size_t i = 0; i < threads; i++)
+    {
+        workers.push_back(std::thread(bench_mpmc_worker, pool, block_size, slots.data(), ops_per_thread, (unsigned)i + 1));
+    }
+    for (size_t i = 0; i < threads; i++)
+    {
+        workers[i].join();
+    }
+    double ns = ns_since(start, threads * ops_per_thread);
+    for (size_t i = 0; i < BENCH_MPMC_SLOTS; i++)
+    {
+        if (pool)
+        {
+            spool_free(pool, slots[i]);
+        }
+        else if (slots[i])
+        {
+            sfree(slots[i]);
+        }
+    }
+    return ns;
+}
+
+
+
+/**
+ * @function:   static void bench_pool_mpmc(size_t block_size, size_t ops_per_thread)
+ * @brief:      on 1, 2, 4, ... threads (up to the number of cores, at least 4), every thread
+ *              allocating blocks and freeing the other threads' ones (see bench_mpmc_worker),
+ *              report the alloc/free pairs per second of smalloc / sfree and of a lock free
+ *              pool (spool_alloc / spool_free).
+ */
+static void bench_pool_mpmc(size_t block_size, size_t ops_per_thread)
+{
+    size_t max_threads = std::thread::hardware_concurrency();
+    if (max_threads < 4)
+    {
+        max_threads = 4;
+    }
+    spool_t* pool = spool_create(block_size);
+    std::cout << std::setw(12) << "threads" << " | " << std::setw(10) << "smalloc/s" << " | " << std::setw(10) << "spool/s" << std::endl;
+    for (size_t threads = 1; threads <= max_threads; threads *= 2)
+    {
+        double malloc_ns = bench_mpmc_round(nullptr, block_size, threads, ops_per_thread);
+        double pool_ns = bench_mpmc_round(pool, block_size, threads, ops_per_thread);
+        std::cout << std::setw(12) << threads << " | " << std::setw(9) << std::fixed << std::setprecision(1) << 1000.0 / malloc_ns << "M | "
+                  << std::setw(9) << 1000.0 / pool_ns << "M" << std::endl;
+    }
+    spool_destroy(pool);
+}
+#endif
+
+
+
+#ifdef BENCH_ALIGNED
+/**
+ * @function:   static void bench_aligned_buffers(size_t min_size, size_t max_size, size_t count)
+ * @brief:      for a few alignments, allocate count buffers of random sizes in [min_size, max_size]
+ *              with saligned_alloc, then free them all, and report the malloc throughput and the
+ *              bytes the buffers can hold per byte asked (smalloc_usable_size) - the slack an
+ *              alignment costs.
+ */
+static void bench_aligned_buffers(size_t min_size, size_t max_size, size_t count)
+{
+    void** blocks = (void**)smalloc(count * sizeof(void*));
+    size_t* sizes = (size_t*)smalloc(count * sizeof(size_t));
+    unsigned seed = 1;
+    for (size_t i = 0; i < count; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        sizes[i] = min_size + (seed >> 8) % (max_size - min_size + 1);
+    }
+
+    std::cout << std::setw(12) << "alignment" << " | " << std::setw(10) << "malloc/s" << " | " << std::setw(10) << "used/asked" << std::endl;
+    for (size_t alignment : {(size_t)16, (size_t)64, (size_t)4096})
+    {
+        bench_clock::time_point start = bench_clock::now();
+        for (size_t i = 0; i < count; i++)
+        {
+            blocks[i] = saligned_alloc(alignment, sizes[i]);
+            if (!blocks[i])
+            {
+                std::cerr << "saligned_alloc failed at block " << i << std::endl;
+                exit(1);
+            }
+        }
+        double ns = ns_since(start, count);
+        double used = 0, asked = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            used += smalloc_usable_size(blocks[i]);
+            asked += sizes[i];
+            sfree(blocks[i]);
+        }
+        std::cout << std::setw(12) << alignment << " | " << std::setw(9) << std::fixed << std::setprecision(1) << 1000.0 / ns << "M | "
+                  << std::setw(10) << std::setprecision(3) << used / asked << std::endl;
+    }
+    sfree(sizes);
+    sfree(blocks);
+}
+#endif
+
+
+
+#define BENCH_RING_SIZE 1024
+
+/**
+ * @struct: bench_ring_t
+ * @brief:  Single producer / single consumer ring of blocks for bench_producer_consumer.
+ */
+struct bench_ring_t {
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+    void* blocks[BENCH_RING_SIZE];
+};
+
+
+
+/**
+ * @function:   static void bench_produce(bench_ring_t* ring, size_t block_size, size_t count)
+ * @brief:      allocate count blocks and hand them to the consumer through the ring.
+ */
+static void bench_produce(bench_ring_t* ring, size_t block_size, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        void* p = smalloc(block_size);
+        if (!p)
+        {
+            std::cerr << "smalloc failed at block " << i << std::endl;
+            exit(1);
+        }
+        size_t head = ring->head.load(std::memory_order_relaxed);
+        while (head - ring->tail.load(std::memory_order_acquire) == BENCH_RING_SIZE)
+        {
+            std::this_thread::yield();
+        }
+        ring->blocks[head % BENCH_RING_SIZE] = p;
+        ring->head.store(head + 1, std::memory_order_release);
+    }
+}
+
+
+
+/**
+ * @function:   static void bench_consume(bench_ring_t* ring, size_t count)
+ * @brief:      free the count blocks the producer hands through the ring.
+ */
+static void bench_consume(bench_ring_t* ring, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t tail = ring->tail.load(std::memory_order_relaxed);
+        while (ring->head.load(std::memory_order_acquire) == tail)
+        {
+            std::this_thread::yield();
+        }
+        sfree(ring->blocks[tail % BENCH_RING_SIZE]);
+        ring->tail.store(tail + 1, std::memory_order_release);
+    }
+}
+
+
+
+/**
+ * @function:   static void bench_producer_consumer(size_t block_size, size_t max_pairs, size_t count)
+ * @brief:      run 1, 2, ... max_pairs producer / consumer pairs, every block is allocated by the
+ *              producer and free'd by the consumer, and report the blocks per second, the lock
+ *              contentions and the blocks free'd lock free to a remote frees list.
+ */
+static void bench_producer_consumer(size_t block_size, size_t max_pairs, size_t count)
+{
+    std::cout << std::setw(12) << "pairs" << " | " << std::setw(10) << "blocks/s" << " | " << std::setw(11) << "contentions"
+              << " | " << std::setw(12) << "remote frees" << std::endl;
+    for (size_t pairs = 1; pairs <= max_pairs; pairs *= 2)
+    {
+        size_t base_contentions = _num_lock_contentions();
+        size_t base_remote = _num_remote_frees();
+        std::vector<bench_ring_t> rings(pairs);
+        std::vector<std::thread> workers;
+        bench_clock::time_point start = bench_clock::now();
+        for (size_t i = 0; i < pairs; i++)
+        {
+            rings[i].head = 0;
+            rings[i].tail = 0;
+            workers.push_back(std::thread(bench_produce, &rings[i], block_size, count));
+            workers.push_back(std::thread(bench_consume, &rings[i], count));
+        }
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            workers[i].join();
+        }
+        double ns = ns_since(start, pairs * count);
+        std::cout << std::setw(12) << pairs << " | " << std::setw(9) << std::fixed << std::setprecision(1) << 1000.0 / ns << "M | "
+                  << std::setw(11) << _num_lock_contentions() - base_contentions << " | "
+                  << std::setw(12) << _num_remote_frees() - base_remote << std::endl;
+    }
+}
+#endif
+
+
+
+///////////////benchmark functions/////////////////////
+
+void heapLatencyVsLiveBlocks()
+{
+    bench_latency_vs_live_blocks(64, 1000000, 1000);
+}
+
+void mmapLatencyVsLiveBlocks()
+{
+    bench_latency_vs_live_blocks(128 * 1024, 10000, 100);
+}
+
+void fragmentedMediumChurn()
+{
+    bench_fragmented_churn(8000, 1024, 16 * 1024, 200000);
+}
+
+void smallObjects()
+{
+    bench_small_objects(32, 1000000);
+}
+
+void mixedLifetimeMedium()
+{
+    bench_mixed_lifetimes(1024, 64 * 1024, 20000);
+}
+
+void reallocGrowth()
+{
+    bench_realloc_growth(1024 * 1024, 64 * 1024 * 1024);
+}
+
+void tableScan()
+{
+    bench_table_scan(64 * 1024 * 1024, 20000000);
+}
+
+void objectGraph()
+{
+    bench_object_graph(64, 400000, 20000000);
+}
+
+void threadScaling()
+{
+#ifdef BENCH_THREAD_SAFE
+    bench_thread_scaling(64, 4000000);
+#else
+    std::cout << "skipped, the engine is not thread safe" << std::endl;
+#endif
+}
+
+void producerConsumer()
+{
+#ifdef BENCH_THREAD_SAFE
+    bench_producer_consumer(2 * 1024, 4, 1000000);
+#else
+    std::cout << "skipped, the engine is not thread safe" << std::endl;
+#endif
+}
+
+void producerConsumerSmall()
+{
+#ifdef BENCH_THREAD_SAFE
+    bench_producer_consumer(64, 4, 1000000);
+#else
+    std::cout << "skipped, the engine is not thread safe" << std::endl;
+#endif
+}
+
+void poolMpmc()
+{
+#ifdef BENCH_SPOOL
+    bench_pool_mpmc(64, 1000000);
+#else
+    std::cout << "skipped, the engine has no pools" << std::endl;
+#endif
+}
+
+void alignedBuffers()
+{
+#ifdef BENCH_ALIGNED
+    bench_aligned_buffers(1000, 20000, 20000);
+#else
+    std::cout << "skipped, the engine has no aligned allocations" << std::endl;
+#endif
+}
+
+void idleThreadsCache()
+{
+#ifdef BENCH_THREAD_SAFE
+    bench_idle_threads(1024, 100000);
+#else
+    std::cout << "skipped, the engine is not thread safe" << std::endl;
+#endif
+}
+
+/////////////////////////////////////////////////////
+
+
+
+#define NUM_BENCH 14
+
+BenchFunc functions[NUM_BENCH] = {heapLatencyVsLiveBlocks, mmapLatencyVsLiveBlocks, fragmentedMediumChurn, smallObjects, mixedLifetimeMedium, threadScaling, idleThreadsCache, producerConsumer, producerConsumerSmall, poolMpmc, alignedBuffers, reallocGrowth, tableScan, objectGraph};
+std::string function_names[NUM_BENCH] = {"heapLatencyVsLiveBlocks", "mmapLatencyVsLiveBlocks", "fragmentedMediumChurn", "smallObjects", "mixedLifetimeMedium", "threadScaling", "idleThreadsCache", "producerConsumer", "producerConsumerSmall", "poolMpmc", "alignedBuffers", "reallocGrowth", "tableScan", "objectGraph"};
+
+
+
+int main(int argc, char* argv[])
+{
+#ifdef BENCH_MALLOC_DISPATCH
+    std::cout << "engine: malloc_" << malloc_engine() << std::endl << std::endl;
+#endif
+    for (int i = 0; i < NUM_BENCH; i++)
+    {
+        if (argc > 1 && function_names[i] != argv[1])
+        {
+            continue;
+        }
+        std::cout << "== " << function_names[i] << " ==" << std::endl;
+        std::cout.flush();
+
+        int wait_status;
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            functions[i]();
+            std::cout.flush();
+            exit(0);
+        }
+        waitpid(pid, &wait_status, 0);
+        if (!WIFEXITED(wait_status) || WEXITSTATUS(wait_status) != 0)
+        {
+            std::cout << function_names[i] << ": CRASHED" << std::endl;
+        }
+        std::cout << std::endl;
+    }
+    return 0;
+}
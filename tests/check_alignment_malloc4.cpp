@@ -0,0 +1,256 @@
+/*
+Checks that every malloc_4 block is MALLOC_ALIGNMENT (16 bytes, alignof(max_align_t)) aligned:
+the slab and run slots, the heap blocks (split remainders, merged blocks, grown last blocks),
+the mmap blocks (page aligned, whole pages), srealloc's blocks, the arenas of other threads and smemalign's bigger
+alignments. It also checks that the blocks hold their data.
+
+HOW TO RUN? from src/:
+	g++ -g -Wall -pthread -I. ../tests/check_alignment_malloc4.cpp malloc_4.cpp -o check_alignment_malloc4
+	./check_alignment_malloc4
+and again with every size from the heap (no slabs / runs), so the heap's splits, merges and
+growth are the ones checked:
+	g++ -g -Wall -pthread -DMALLOC_4_NO_SLABS -DMALLOC_4_NO_RUNS -I. ../tests/check_alignment_malloc4.cpp malloc_4.cpp -o check_alignment_malloc4
+	./check_alignment_malloc4
+(it replaces check_alignment_malloc4.py, which checked 8 bytes alignment of an address list)
+ */
+
+#include "malloc_4.h"
+#include <unistd.h>
+#include <assert.h>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <iostream>
+
+#define ALIGNMENT 16
+#define MIN_KB_BLOCK (128 * 1024)
+#define PAGE_SIZE 4096
+#define NUM_THREADS 8
+
+#define assert_aligned(_p, _alignment)\
+	do {\
+		assert((_p) != NULL); \
+		assert((uintptr_t)(_p) % (_alignment) == 0); \
+	} while (0)
+
+typedef unsigned char byte;
+
+/*******************************************************************************
+ *  AUXILIARY FUNCTIONS
+ ******************************************************************************/
+
+/* allocates a block of size bytes, checks its alignment and fills it with its size's pattern */
+byte* aligned_block(size_t size) {
+    byte *p = static_cast<byte*>(smalloc(size));
+    assert_aligned(p, ALIGNMENT);
+    memset(p, (byte)size, size);
+    return p;
+}
+
+/* checks that a block of size bytes still holds its size's pattern */
+bool check_block(byte *p, size_t size) {
+    for (size_t i = 0; i < size; ++i)
+        if (p[i] != (byte)size)
+            return false;
+    return true;
+}
+
+/*******************************************************************************
+ *  TEST FUNCTIONS
+ ******************************************************************************/
+
+/* every small size (the slab slots) */
+void test_small_sizes() {
+    static byte *blocks[1025];
+    for (size_t size = 1; size <= 1024; ++size)
+        blocks[size] = aligned_block(size);
+    for (size_t size = 1; size <= 1024; ++size) {
+        assert(check_block(blocks[size], size));
+        sfree(blocks[size]);
+    }
+    for (size_t size = 1; size <= 1024; size += 7) {
+        byte *p = static_cast<byte*>(scalloc(size, 1));
+        assert_aligned(p, ALIGNMENT);
+        sfree(p);
+    }
+}
+
+/* medium sizes (the run slots) and the sizes around the mmap threshold */
+void test_medium_and_mmap_sizes() {
+    for (size_t size = 1025; size < MIN_KB_BLOCK; size += 1021) {
+        byte *p = aligned_block(size);
+        byte *q = aligned_block(size + 3);
+        assert(check_block(p, size) && check_block(q, size + 3));
+        sfree(p);
+        sfree(q);
+    }
+    for (size_t size = MIN_KB_BLOCK - 33; size < MIN_KB_BLOCK + 33; ++size)
+        sfree(aligned_block(size));
+    // the mmap blocks' payloads are page aligned and take whole pages
+    for (size_t size = MIN_KB_BLOCK; size < 64 * MIN_KB_BLOCK; size = size * 3 + 5) {
+        byte *p = aligned_block(size);
+        assert_aligned(p, PAGE_SIZE);
+        assert(smalloc_usable_size(p) % PAGE_SIZE == 0 && smalloc_usable_size(p) - size < PAGE_SIZE);
+        byte *q = static_cast<byte*>(srealloc(p, size + PAGE_SIZE + 1));
+        assert_aligned(q, PAGE_SIZE);
+        assert(check_block(q, size));
+        sfree(q);
+    }
+}
+
+/* odd sized heap blocks split out of freed bigger ones (cut_block's remainders), merged with
+ * their neighbours and grown at the end of the heap (the wilderness block) */
+void test_heap_split_merge_grow() {
+    const int COUNT = 64;
+    byte *blocks[COUNT];
+    for (int i = 0; i < COUNT; ++i)
+        blocks[i] = aligned_block(1000 + 37 * i);
+    // holes: free every other block, then fill them with smaller blocks (the rest is split off)
+    for (int i = 0; i < COUNT; i += 2)
+        sfree(blocks[i]);
+    for (int i = 0; i < COUNT; i += 2)
+        blocks[i] = aligned_block(200 + 13 * i);
+    for (int i = 0; i < COUNT; ++i)
+        assert(check_block(blocks[i], i % 2 ? 1000 + 37 * i : 200 + 13 * i));
+    // merges: free runs of neighbours and take the merged space with odd sizes
+    for (int i = 0; i < COUNT; ++i)
+        if (i % 4 != 3)
+            sfree(blocks[i]);
+    for (int i = 0; i < COUNT; ++i)
+        if (i % 4 != 3)
+            blocks[i] = aligned_block(2000 + 11 * i);
+    // wilderness: grow the last block step by step
+    byte *last = aligned_block(3);
+    for (size_t size = 5; size < 100000; size = size * 2 + 1) {
+        sfree(last);
+        last = aligned_block(size);
+    }
+    for (int i = 0; i < COUNT; ++i)
+        sfree(blocks[i]);
+    sfree(last);
+}
+
+/* srealloc, growing and shrinking, in place or moved */
+void test_realloc() {
+    byte *p = aligned_block(1);
+    size_t size = 1;
+    for (size_t next = 3; next < 4 * MIN_KB_BLOCK; next = next * 2 + 7) {
+        byte *q = static_cast<byte*>(srealloc(p, next));
+        assert_aligned(q, ALIGNMENT);
+        assert(check_block(q, size));
+        memset(q, (byte)next, next);
+        p = q;
+        size = next;
+    }
+    for (size_t next = size / 3; next > 1; next = next / 3) {
+        byte *q = static_cast<byte*>(srealloc(p, next));
+        assert_aligned(q, ALIGNMENT);
+        for (size_t i = 0; i < next; ++i)
+            assert(q[i] == (byte)size);
+        p = q;
+    }
+    sfree(p);
+}
+
+/* bigger alignments, from the slabs, the runs, the heap and mmap */
+void test_memalign() {
+    for (size_t alignment = 8; alignment <= 64 * 1024; alignment *= 2) {
+        for (size_t size = 1; size < 2 * MIN_KB_BLOCK; size = size * 5 + 3) {
+            byte *p = static_cast<byte*>(saligned_alloc(alignment, size));
+            assert_aligned(p, alignment < ALIGNMENT ? ALIGNMENT : alignment);
+            assert(smalloc_usable_size(p) >= size);
+            memset(p, (byte)size, size);
+            void *q = NULL;
+            assert(sposix_memalign(&q, alignment, size) == 0);
+            assert_aligned(q, alignment < ALIGNMENT ? ALIGNMENT : alignment);
+            assert(check_block(p, size));
+            sfree(q);
+            sfree(p);
+        }
+    }
+}
+
+/* the other threads' arenas and caches */
+static void *thread_blocks(void *arg) {
+    size_t seed = (size_t)arg;
+    byte *blocks[256];
+    for (int round = 0; round < 20; ++round) {
+        for (int i = 0; i < 256; ++i) {
+            seed = seed * 1103515245 + 12345;
+            size_t size = 1 + (seed >> 8) % (i % 8 ? 2000 : 150000);
+            blocks[i] = aligned_block(size);
+        }
+        for (int i = 0; i < 256; ++i)
+            sfree(blocks[i]);
+    }
+    return NULL;
+}
+
+void test_threads() {
+    pthread_t threads[NUM_THREADS];
+    for (size_t i = 0; i < NUM_THREADS; ++i)
+        assert(pthread_create(&threads[i], NULL, thread_blocks, (void*)(i + 1)) == 0);
+    for (int i = 0; i < NUM_THREADS; ++i)
+        pthread_join(threads[i], NULL);
+}
+
+/* a random mix of the above */
+void test_random() {
+    const int COUNT = 1000;
+    static byte *blocks[COUNT];
+    static size_t sizes[COUNT];
+    size_t seed = 7;
+    for (int op = 0; op < 100000; ++op) {
+        seed = seed * 1103515245 + 12345;
+        int i = (seed >> 8) % COUNT;
+        if (blocks[i]) {
+            assert(check_block(blocks[i], sizes[i]));
+            sfree(blocks[i]);
+            blocks[i] = NULL;
+        } else {
+            sizes[i] = 1 + (seed >> 16) % ((seed >> 4) % 16 ? 3000 : 200000);
+            blocks[i] = aligned_block(sizes[i]);
+        }
+    }
+    for (int i = 0; i < COUNT; ++i)
+        sfree(blocks[i]);
+}
+
+/*******************************************************************************
+ *  MAIN
+ ******************************************************************************/
+
+static void callTestFunction(void (*func)()) {
+    if (!fork()) {  // test as son, to get a clear heap
+        func();
+        exit(0);
+    } else {		// father waits for son before continuing to next test
+        int exit_status = 0;
+        wait(&exit_status);
+        if (exit_status)
+            std::cout << "*** FAILED with exit status " << exit_status << std::endl;
+    }
+}
+
+int main()
+{
+    static_assert(alignof(max_align_t) <= ALIGNMENT, "blocks must fit any type");
+    std::cout << "test_small_sizes" << std::endl;
+    callTestFunction(test_small_sizes);
+    std::cout << "test_medium_and_mmap_sizes" << std::endl;
+    callTestFunction(test_medium_and_mmap_sizes);
+    std::cout << "test_heap_split_merge_grow" << std::endl;
+    callTestFunction(test_heap_split_merge_grow);
+    std::cout << "test_realloc" << std::endl;
+    callTestFunction(test_realloc);
+    std::cout << "test_memalign" << std::endl;
+    callTestFunction(test_memalign);
+    std::cout << "test_threads" << std::endl;
+    callTestFunction(test_threads);
+    std::cout << "test_random" << std::endl;
+    callTestFunction(test_random);
+    return 0;
+}